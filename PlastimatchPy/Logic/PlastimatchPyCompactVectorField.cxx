@@ -0,0 +1,436 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "PlastimatchPyCompactVectorField.h"
+#include "PlastimatchPyTransformEvaluator.h"
+
+// STD includes
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+//----------------------------------------------------------------------------
+PlastimatchPyCompactVectorField::PlastimatchPyCompactVectorField()
+{
+  this->Encoding = HalfFloat;
+  this->TileSize = 32;
+  for (int d=0; d < 3; d++)
+    {
+    this->NumberOfTiles[d] = 0;
+    this->Size[d] = 0;
+    }
+}
+
+//----------------------------------------------------------------------------
+PlastimatchPyCompactVectorField::~PlastimatchPyCompactVectorField()
+{
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyCompactVectorField::Compress(const DeformationFieldType* vectorField, EncodingType encoding)
+{
+  this->InitializeTiles(vectorField->GetBufferedRegion(), vectorField->GetOrigin(),
+    vectorField->GetSpacing(), vectorField->GetDirection(), encoding);
+
+  const VectorType* buffer = vectorField->GetBufferPointer();
+  const long numberOfTiles = (long) this->Tiles.size();
+
+#pragma omp parallel for schedule(dynamic)
+  for (long tileIndex=0; tileIndex < numberOfTiles; tileIndex++)
+    {
+    long tileStart[3];
+    long tileDimension[3];
+    this->GetTileExtent(tileIndex, tileStart, tileDimension);
+
+    std::vector<float> tileVectors(tileDimension[0] * tileDimension[1] * tileDimension[2] * 3);
+    long voxelIndexInTile = 0;
+    for (long z=0; z < tileDimension[2]; z++)
+      {
+      for (long y=0; y < tileDimension[1]; y++)
+        {
+        const VectorType* row = buffer + ((tileStart[2] + z) * this->Size[1] + tileStart[1] + y) * this->Size[0] + tileStart[0];
+        for (long x=0; x < tileDimension[0]; x++, voxelIndexInTile++)
+          {
+          for (int c=0; c < 3; c++)
+            {
+            tileVectors[3 * voxelIndexInTile + c] = row[x][c];
+            }
+          }
+        }
+      }
+    this->EncodeTile(this->Tiles[tileIndex], &tileVectors[0], voxelIndexInTile);
+    }
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyCompactVectorField::CompressBspline(const Bspline_xform* bsplineTransformation,
+  const itk::ImageBase<3>* referenceGrid, EncodingType encoding)
+{
+  this->InitializeTiles(referenceGrid->GetLargestPossibleRegion(), referenceGrid->GetOrigin(),
+    referenceGrid->GetSpacing(), referenceGrid->GetDirection(), encoding);
+
+  const long numberOfTiles = (long) this->Tiles.size();
+
+#pragma omp parallel for schedule(dynamic)
+  for (long tileIndex=0; tileIndex < numberOfTiles; tileIndex++)
+    {
+    long tileStart[3];
+    long tileDimension[3];
+    this->GetTileExtent(tileIndex, tileStart, tileDimension);
+
+    // Only the vectors of the current tile are evaluated in single precision
+    std::vector<float> tileVectors(tileDimension[0] * tileDimension[1] * tileDimension[2] * 3);
+    long voxelIndexInTile = 0;
+    itk::ImageBase<3>::IndexType index;
+    itk::ImageBase<3>::PointType physicalPoint;
+    for (long z=0; z < tileDimension[2]; z++)
+      {
+      index[2] = this->StartIndex[2] + tileStart[2] + z;
+      for (long y=0; y < tileDimension[1]; y++)
+        {
+        index[1] = this->StartIndex[1] + tileStart[1] + y;
+        for (long x=0; x < tileDimension[0]; x++, voxelIndexInTile++)
+          {
+          index[0] = this->StartIndex[0] + tileStart[0] + x;
+          referenceGrid->TransformIndexToPhysicalPoint(index, physicalPoint);
+          const float point[3] = { (float) physicalPoint[0], (float) physicalPoint[1], (float) physicalPoint[2] };
+          PlastimatchPyTransformEvaluator::EvaluateBspline(bsplineTransformation, point, &tileVectors[3 * voxelIndexInTile]);
+          }
+        }
+      }
+    this->EncodeTile(this->Tiles[tileIndex], &tileVectors[0], voxelIndexInTile);
+    }
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyCompactVectorField::InitializeTiles(const DeformationFieldType::RegionType& region,
+  const DeformationFieldType::PointType& origin, const DeformationFieldType::SpacingType& spacing,
+  const DeformationFieldType::DirectionType& direction, EncodingType encoding)
+{
+  this->Encoding = encoding;
+  for (int d=0; d < 3; d++)
+    {
+    this->Size[d] = (long) region.GetSize()[d];
+    this->NumberOfTiles[d] = (this->Size[d] + this->TileSize - 1) / this->TileSize;
+    }
+  this->Origin = origin;
+  this->Spacing = spacing;
+  this->Direction = direction;
+  this->StartIndex = region.GetIndex();
+
+  this->Tiles.clear();
+  this->Tiles.resize(this->NumberOfTiles[0] * this->NumberOfTiles[1] * this->NumberOfTiles[2]);
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyCompactVectorField::GetTileExtent(long tileIndex, long tileStart[3], long tileDimension[3]) const
+{
+  tileStart[0] = (tileIndex % this->NumberOfTiles[0]) * this->TileSize;
+  tileStart[1] = ((tileIndex / this->NumberOfTiles[0]) % this->NumberOfTiles[1]) * this->TileSize;
+  tileStart[2] = (tileIndex / (this->NumberOfTiles[0] * this->NumberOfTiles[1])) * this->TileSize;
+  for (int d=0; d < 3; d++)
+    {
+    tileDimension[d] = std::min(this->TileSize, this->Size[d] - tileStart[d]);
+    }
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyCompactVectorField::EncodeTile(Tile& tile, const float* tileVectors, long numberOfVoxels) const
+{
+  const int bytesPerComponent = (this->Encoding == HalfFloat) ? 2 : 1;
+  tile.Data.resize(numberOfVoxels * 3 * bytesPerComponent);
+
+  // Range of each component, for the quantization
+  float minimum[3] = {FLT_MAX, FLT_MAX, FLT_MAX};
+  float maximum[3] = {-FLT_MAX, -FLT_MAX, -FLT_MAX};
+  if (this->Encoding == Quantized8Bit)
+    {
+    for (long i=0; i < numberOfVoxels; i++)
+      {
+      for (int c=0; c < 3; c++)
+        {
+        minimum[c] = tileVectors[3 * i + c] < minimum[c] ? tileVectors[3 * i + c] : minimum[c];
+        maximum[c] = tileVectors[3 * i + c] > maximum[c] ? tileVectors[3 * i + c] : maximum[c];
+        }
+      }
+    }
+  for (int c=0; c < 3; c++)
+    {
+    tile.Offset[c] = (this->Encoding == Quantized8Bit) ? minimum[c] : 0.0f;
+    tile.Step[c] = (this->Encoding == Quantized8Bit) ? (maximum[c] - minimum[c]) / 255.0f : 0.0f;
+    }
+
+  for (long i=0; i < numberOfVoxels; i++)
+    {
+    for (int c=0; c < 3; c++)
+      {
+      if (this->Encoding == HalfFloat)
+        {
+        unsigned short half = FloatToHalf(tileVectors[3 * i + c]);
+        memcpy(&tile.Data[(3 * i + c) * 2], &half, 2);
+        }
+      else
+        {
+        tile.Data[3 * i + c] = (tile.Step[c] > 0.0f)
+          ? (unsigned char) floorf((tileVectors[3 * i + c] - tile.Offset[c]) / tile.Step[c] + 0.5f) : 0;
+        }
+      }
+    }
+}
+
+//----------------------------------------------------------------------------
+PlastimatchPyCompactVectorField::DeformationFieldType::Pointer PlastimatchPyCompactVectorField::Decompress() const
+{
+  DeformationFieldType::RegionType region;
+  DeformationFieldType::SizeType size;
+  for (int d=0; d < 3; d++)
+    {
+    size[d] = this->Size[d];
+    }
+  region.SetIndex(this->StartIndex);
+  region.SetSize(size);
+
+  DeformationFieldType::Pointer vectorField = DeformationFieldType::New();
+  vectorField->SetRegions(region);
+  vectorField->SetOrigin(this->Origin);
+  vectorField->SetSpacing(this->Spacing);
+  vectorField->SetDirection(this->Direction);
+  vectorField->Allocate();
+
+  VectorType* buffer = vectorField->GetBufferPointer();
+  const long numberOfTiles = (long) this->Tiles.size();
+
+#pragma omp parallel for schedule(dynamic)
+  for (long tileIndex=0; tileIndex < numberOfTiles; tileIndex++)
+    {
+    long tileStart[3];
+    long tileDimension[3];
+    this->GetTileExtent(tileIndex, tileStart, tileDimension);
+
+    for (long z=0; z < tileDimension[2]; z++)
+      {
+      for (long y=0; y < tileDimension[1]; y++)
+        {
+        VectorType* row = buffer + ((tileStart[2] + z) * this->Size[1] + tileStart[1] + y) * this->Size[0] + tileStart[0];
+        for (long x=0; x < tileDimension[0]; x++)
+          {
+          float vector[3];
+          this->GetVector(tileStart[0] + x, tileStart[1] + y, tileStart[2] + z, vector);
+          row[x][0] = vector[0];
+          row[x][1] = vector[1];
+          row[x][2] = vector[2];
+          }
+        }
+      }
+    }
+
+  return vectorField;
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyCompactVectorField::LocateVoxel(long x, long y, long z, long& tileIndex, long& voxelIndexInTile) const
+{
+  const long tileCoordinate[3] = {x / this->TileSize, y / this->TileSize, z / this->TileSize};
+  tileIndex = (tileCoordinate[2] * this->NumberOfTiles[1] + tileCoordinate[1]) * this->NumberOfTiles[0] + tileCoordinate[0];
+
+  const long tileDimensionX = std::min(this->TileSize, this->Size[0] - tileCoordinate[0] * this->TileSize);
+  const long tileDimensionY = std::min(this->TileSize, this->Size[1] - tileCoordinate[1] * this->TileSize);
+  voxelIndexInTile = ((z - tileCoordinate[2] * this->TileSize) * tileDimensionY
+    + (y - tileCoordinate[1] * this->TileSize)) * tileDimensionX + (x - tileCoordinate[0] * this->TileSize);
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyCompactVectorField::GetVector(long x, long y, long z, float vector[3]) const
+{
+  long tileIndex = 0;
+  long voxelIndexInTile = 0;
+  this->LocateVoxel(x, y, z, tileIndex, voxelIndexInTile);
+  const Tile& tile = this->Tiles[tileIndex];
+
+  for (int c=0; c < 3; c++)
+    {
+    if (this->Encoding == HalfFloat)
+      {
+      unsigned short half = 0;
+      memcpy(&half, &tile.Data[(3 * voxelIndexInTile + c) * 2], 2);
+      vector[c] = HalfToFloat(half);
+      }
+    else
+      {
+      vector[c] = tile.Offset[c] + tile.Step[c] * tile.Data[3 * voxelIndexInTile + c];
+      }
+    }
+}
+
+//----------------------------------------------------------------------------
+bool PlastimatchPyCompactVectorField::EvaluateVectorField(const float point[3], float displacement[3]) const
+{
+  displacement[0] = displacement[1] = displacement[2] = 0.0f;
+  if (this->Tiles.empty())
+    {
+    return false;
+    }
+
+  // Physical point to continuous index (direction cosines are orthonormal)
+  long baseIndex[3];
+  float fraction[3];
+  for (int d=0; d < 3; d++)
+    {
+    double projection = 0.0;
+    for (int c=0; c < 3; c++)
+      {
+      projection += this->Direction[c][d] * (point[c] - this->Origin[c]);
+      }
+    const double index = projection / this->Spacing[d];
+    if (index < 0.0 || index > (double) (this->Size[d] - 1))
+      {
+      return false;
+      }
+    baseIndex[d] = (long) floor(index);
+    if (baseIndex[d] >= this->Size[d] - 1)
+      {
+      baseIndex[d] = this->Size[d] - 2 >= 0 ? this->Size[d] - 2 : 0;
+      }
+    fraction[d] = (float) (index - (double) baseIndex[d]);
+    }
+
+  for (int k=0; k < 2; k++)
+    {
+    const long z = (this->Size[2] > 1) ? baseIndex[2] + k : baseIndex[2];
+    const float weightZ = k ? fraction[2] : 1.0f - fraction[2];
+    for (int j=0; j < 2; j++)
+      {
+      const long y = (this->Size[1] > 1) ? baseIndex[1] + j : baseIndex[1];
+      const float weightYZ = weightZ * (j ? fraction[1] : 1.0f - fraction[1]);
+      for (int i=0; i < 2; i++)
+        {
+        const long x = (this->Size[0] > 1) ? baseIndex[0] + i : baseIndex[0];
+        const float weight = weightYZ * (i ? fraction[0] : 1.0f - fraction[0]);
+        float vector[3];
+        this->GetVector(x, y, z, vector);
+        displacement[0] += weight * vector[0];
+        displacement[1] += weight * vector[1];
+        displacement[2] += weight * vector[2];
+        }
+      }
+    }
+
+  return true;
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyCompactVectorField::TransformPoints(const float* inputPoints, float* outputPoints, long numberOfPoints) const
+{
+#pragma omp parallel for
+  for (long i=0; i < numberOfPoints; i++)
+    {
+    float displacement[3];
+    this->EvaluateVectorField(inputPoints + 3*i, displacement);
+    outputPoints[3*i]   = inputPoints[3*i]   + displacement[0];
+    outputPoints[3*i+1] = inputPoints[3*i+1] + displacement[1];
+    outputPoints[3*i+2] = inputPoints[3*i+2] + displacement[2];
+    }
+}
+
+//----------------------------------------------------------------------------
+unsigned long long PlastimatchPyCompactVectorField::GetMemorySize() const
+{
+  unsigned long long memorySize = 0;
+  for (std::vector<Tile>::const_iterator tileIt = this->Tiles.begin(); tileIt != this->Tiles.end(); ++tileIt)
+    {
+    memorySize += sizeof(Tile) + tileIt->Data.size();
+    }
+  return memorySize;
+}
+
+//----------------------------------------------------------------------------
+unsigned short PlastimatchPyCompactVectorField::FloatToHalf(float value)
+{
+  unsigned int bits = 0;
+  memcpy(&bits, &value, 4);
+
+  const unsigned int sign = (bits >> 16) & 0x8000;
+  const int exponent = (int) ((bits >> 23) & 0xff) - 127 + 15;
+  unsigned int mantissa = bits & 0x7fffff;
+
+  if ((bits & 0x7fffffff) > 0x7f800000)
+    {
+    // NaN
+    return (unsigned short) (sign | 0x7e00);
+    }
+  if (exponent >= 31)
+    {
+    // Overflow to infinity
+    return (unsigned short) (sign | 0x7c00);
+    }
+  if (exponent <= 0)
+    {
+    // Subnormal half, or underflow to zero
+    if (exponent < -10)
+      {
+      return (unsigned short) sign;
+      }
+    mantissa |= 0x800000;
+    const unsigned int shift = (unsigned int) (14 - exponent);
+    unsigned int halfMantissa = mantissa >> shift;
+    const unsigned int remainder = mantissa & ((1u << shift) - 1);
+    const unsigned int halfway = 1u << (shift - 1);
+    if (remainder > halfway || (remainder == halfway && (halfMantissa & 1)))
+      {
+      halfMantissa++;
+      }
+    return (unsigned short) (sign | halfMantissa);
+    }
+
+  // Normal half, rounded to nearest even (a carry correctly propagates into the exponent)
+  unsigned int half = sign | ((unsigned int) exponent << 10) | (mantissa >> 13);
+  const unsigned int remainder = mantissa & 0x1fff;
+  if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+    {
+    half++;
+    }
+  return (unsigned short) half;
+}
+
+//----------------------------------------------------------------------------
+float PlastimatchPyCompactVectorField::HalfToFloat(unsigned short value)
+{
+  const unsigned int sign = ((unsigned int) value & 0x8000) << 16;
+  const unsigned int exponent = ((unsigned int) value >> 10) & 0x1f;
+  const unsigned int mantissa = (unsigned int) value & 0x3ff;
+
+  if (exponent == 0)
+    {
+    // Zero or subnormal
+    const float magnitude = (float) ldexp((double) mantissa, -24);
+    return sign ? -magnitude : magnitude;
+    }
+
+  unsigned int bits = 0;
+  if (exponent == 31)
+    {
+    bits = sign | 0x7f800000 | (mantissa << 13);
+    }
+  else
+    {
+    bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+    }
+  float result = 0.0f;
+  memcpy(&result, &bits, 4);
+  return result;
+}
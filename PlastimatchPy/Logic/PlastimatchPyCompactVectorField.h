@@ -0,0 +1,137 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME PlastimatchPyCompactVectorField - reduced precision storage of a dense vector field
+// .SECTION Description
+// The field is split in cubic tiles. Each tile stores its vectors either as 16 bit
+// half floats, or as 8 bit values quantized between the per-tile minimum and maximum
+// of each component. Vectors can be read one by one (with trilinear interpolation)
+// without decompressing the field, or the whole field can be decompressed tile by tile.
+
+#ifndef __PlastimatchPyCompactVectorField_h
+#define __PlastimatchPyCompactVectorField_h
+
+// ITK includes
+#include "itkImage.h"
+
+// Plastimatch includes
+#include "bspline_xform.h"
+
+// STD includes
+#include <vector>
+
+class PlastimatchPyCompactVectorField
+{
+public:
+  typedef itk::Vector< float, 3 >  VectorType;
+  typedef itk::Image< VectorType, 3 >  DeformationFieldType;
+
+  /// Encoding of the vectors
+  enum EncodingType
+  {
+    HalfFloat = 0,  /*!< IEEE 754 half precision, 6 bytes per vector */
+    Quantized8Bit   /*!< 8 bit per component quantized per tile, 3 bytes per vector */
+  };
+
+public:
+  PlastimatchPyCompactVectorField();
+  virtual ~PlastimatchPyCompactVectorField();
+
+  /// Compress a dense vector field. Tiles are encoded in parallel.
+  void Compress(const DeformationFieldType* vectorField, EncodingType encoding);
+
+  /// Generate the field of a B-spline transformation on the grid of a reference image. Tiles are evaluated
+  /// and encoded in parallel, so that only one tile per thread is held in single precision.
+  void CompressBspline(const Bspline_xform* bsplineTransformation, const itk::ImageBase<3>* referenceGrid, EncodingType encoding);
+
+  /// Decompress the whole field, tile by tile in parallel
+  DeformationFieldType::Pointer Decompress() const;
+
+  /// Read the vector of a voxel (index relative to the buffered region)
+  void GetVector(long x, long y, long z, float vector[3]) const;
+
+  /// Evaluate the field at a physical point (LPS) using trilinear interpolation.
+  /// Returns false (and a zero displacement) if the point lies outside of the field.
+  bool EvaluateVectorField(const float point[3], float displacement[3]) const;
+
+  /// Transform a packed array of points (x0 y0 z0 x1 y1 z1 ...) through the field, in parallel.
+  void TransformPoints(const float* inputPoints, float* outputPoints, long numberOfPoints) const;
+
+  /// Get the memory (bytes) used by the compressed field
+  unsigned long long GetMemorySize() const;
+
+  /// True if a field has been compressed
+  bool IsEmpty() const { return this->Tiles.empty(); };
+
+  /// Convert a float to IEEE 754 half precision (round to nearest)
+  static unsigned short FloatToHalf(float value);
+  /// Convert an IEEE 754 half precision value to float
+  static float HalfToFloat(unsigned short value);
+
+protected:
+  /// Compressed tile
+  struct Tile
+  {
+    /// Encoded vectors (2 bytes per component for half floats, 1 byte for quantized)
+    std::vector<unsigned char> Data;
+    /// Minimum of each component (quantized encoding only)
+    float Offset[3];
+    /// Quantization step of each component (quantized encoding only)
+    float Step[3];
+  };
+
+  /// Set the geometry and the encoding of the field, and create its empty tiles
+  void InitializeTiles(const DeformationFieldType::RegionType& region, const DeformationFieldType::PointType& origin,
+    const DeformationFieldType::SpacingType& spacing, const DeformationFieldType::DirectionType& direction, EncodingType encoding);
+
+  /// Get the first voxel and the size of a tile
+  void GetTileExtent(long tileIndex, long tileStart[3], long tileDimension[3]) const;
+
+  /// Encode the vectors of a tile (x0 y0 z0 x1 y1 z1 ..., voxels ordered x fastest)
+  void EncodeTile(Tile& tile, const float* tileVectors, long numberOfVoxels) const;
+
+  /// Get the index of the tile containing a voxel, and the index of the voxel inside the tile
+  void LocateVoxel(long x, long y, long z, long& tileIndex, long& voxelIndexInTile) const;
+
+protected:
+  /// Compressed tiles, ordered x fastest
+  std::vector<Tile> Tiles;
+
+  /// Encoding of the vectors
+  EncodingType Encoding;
+
+  /// Size of the tiles (voxels per side)
+  long TileSize;
+
+  /// Number of tiles along each axis
+  long NumberOfTiles[3];
+
+  /// Size of the field
+  long Size[3];
+
+  /// Geometry of the field
+  DeformationFieldType::PointType Origin;
+  DeformationFieldType::SpacingType Spacing;
+  DeformationFieldType::DirectionType Direction;
+  DeformationFieldType::IndexType StartIndex;
+
+private:
+  PlastimatchPyCompactVectorField(const PlastimatchPyCompactVectorField&); // Not implemented
+  void operator=(const PlastimatchPyCompactVectorField&);                  // Not implemented
+};
+
+#endif
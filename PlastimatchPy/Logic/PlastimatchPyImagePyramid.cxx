@@ -0,0 +1,185 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "PlastimatchPyImagePyramid.h"
+
+// ITK includes
+#include <itkDiscreteGaussianImageFilter.h>
+#include <itkShrinkImageFilter.h>
+
+// STD includes
+#include <algorithm>
+#include <sstream>
+
+//----------------------------------------------------------------------------
+PlastimatchPyImagePyramid::PlastimatchPyImagePyramid()
+{
+  this->MemoryBudget = 0;
+  this->MemoryUsage = 0;
+  this->AccessCounter = 0;
+}
+
+//----------------------------------------------------------------------------
+PlastimatchPyImagePyramid::~PlastimatchPyImagePyramid()
+{
+  this->Clear();
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyImagePyramid::SetMemoryBudget(unsigned long long memoryBudget)
+{
+  this->MemoryBudget = memoryBudget;
+  this->EvictLevels();
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyImagePyramid::BuildLevels(const std::vector<LevelRequest>& requests)
+{
+  // Select the levels to build, each one only once
+  std::vector<const LevelRequest*> missingLevels;
+  std::vector<std::string> missingLevelKeys;
+  for (std::vector<LevelRequest>::const_iterator requestIt = requests.begin(); requestIt != requests.end(); ++requestIt)
+    {
+    if (requestIt->Subsampling[0] == 1 && requestIt->Subsampling[1] == 1 && requestIt->Subsampling[2] == 1)
+      {
+      continue;
+      }
+    std::string levelKey = GetLevelKey(requestIt->ImageKey, requestIt->Subsampling);
+    if (this->Levels.find(levelKey) != this->Levels.end()
+      || std::find(missingLevelKeys.begin(), missingLevelKeys.end(), levelKey) != missingLevelKeys.end())
+      {
+      continue;
+      }
+    missingLevels.push_back(&(*requestIt));
+    missingLevelKeys.push_back(levelKey);
+    }
+
+  // Build the levels in parallel
+  std::vector<ImageType::Pointer> builtLevels(missingLevels.size());
+#pragma omp parallel for schedule(dynamic)
+  for (long i=0; i < (long) missingLevels.size(); i++)
+    {
+    builtLevels[i] = BuildLevel(missingLevels[i]->Image, missingLevels[i]->Subsampling);
+    }
+
+  for (unsigned int i=0; i < builtLevels.size(); i++)
+    {
+    this->InsertLevel(missingLevelKeys[i], builtLevels[i]);
+    }
+}
+
+//----------------------------------------------------------------------------
+PlastimatchPyImagePyramid::ImageType::Pointer PlastimatchPyImagePyramid::GetLevel(
+  const std::string& imageKey, ImageType* image, const int subsampling[3])
+{
+  if (subsampling[0] == 1 && subsampling[1] == 1 && subsampling[2] == 1)
+    {
+    return image;
+    }
+
+  std::string levelKey = GetLevelKey(imageKey, subsampling);
+  std::map<std::string, Level>::iterator levelIt = this->Levels.find(levelKey);
+  if (levelIt != this->Levels.end())
+    {
+    levelIt->second.LastAccess = ++this->AccessCounter;
+    return levelIt->second.Image;
+    }
+
+  ImageType::Pointer level = BuildLevel(image, subsampling);
+  this->InsertLevel(levelKey, level);
+  return level;
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyImagePyramid::Clear()
+{
+  this->Levels.clear();
+  this->MemoryUsage = 0;
+}
+
+//----------------------------------------------------------------------------
+PlastimatchPyImagePyramid::ImageType::Pointer PlastimatchPyImagePyramid::BuildLevel(
+  ImageType* image, const int subsampling[3])
+{
+  // Anti-aliasing: Gaussian with a standard deviation of half the subsampled voxel size
+  typedef itk::DiscreteGaussianImageFilter<ImageType, ImageType> GaussianFilterType;
+  GaussianFilterType::Pointer gaussianFilter = GaussianFilterType::New();
+  GaussianFilterType::ArrayType variance;
+  for (int d=0; d < 3; d++)
+    {
+    const double sigma = (subsampling[d] > 1) ? 0.5 * subsampling[d] * image->GetSpacing()[d] : 0.0;
+    variance[d] = sigma * sigma;
+    }
+  gaussianFilter->SetInput(image);
+  gaussianFilter->SetVariance(variance);
+  gaussianFilter->SetUseImageSpacingOn();
+
+  typedef itk::ShrinkImageFilter<ImageType, ImageType> ShrinkFilterType;
+  ShrinkFilterType::Pointer shrinkFilter = ShrinkFilterType::New();
+  shrinkFilter->SetInput(gaussianFilter->GetOutput());
+  for (int d=0; d < 3; d++)
+    {
+    shrinkFilter->SetShrinkFactor(d, subsampling[d] > 1 ? subsampling[d] : 1);
+    }
+  shrinkFilter->Update();
+
+  ImageType::Pointer level = shrinkFilter->GetOutput();
+  level->DisconnectPipeline();
+  return level;
+}
+
+//----------------------------------------------------------------------------
+std::string PlastimatchPyImagePyramid::GetLevelKey(const std::string& imageKey, const int subsampling[3])
+{
+  std::ostringstream levelKey;
+  levelKey << imageKey << "|" << subsampling[0] << " " << subsampling[1] << " " << subsampling[2];
+  return levelKey.str();
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyImagePyramid::InsertLevel(const std::string& levelKey, ImageType* image)
+{
+  const ImageType::SizeType& size = image->GetBufferedRegion().GetSize();
+
+  Level level;
+  level.Image = image;
+  level.Size = (unsigned long long) size[0] * size[1] * size[2] * sizeof(ImageType::PixelType);
+  level.LastAccess = ++this->AccessCounter;
+
+  this->Levels[levelKey] = level;
+  this->MemoryUsage += level.Size;
+  this->EvictLevels();
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyImagePyramid::EvictLevels()
+{
+  // The most recently used level is always kept, even if it alone exceeds the budget
+  while (this->MemoryBudget > 0 && this->MemoryUsage > this->MemoryBudget && this->Levels.size() > 1)
+    {
+    std::map<std::string, Level>::iterator leastRecentlyUsedIt = this->Levels.begin();
+    for (std::map<std::string, Level>::iterator levelIt = this->Levels.begin(); levelIt != this->Levels.end(); ++levelIt)
+      {
+      if (levelIt->second.LastAccess < leastRecentlyUsedIt->second.LastAccess)
+        {
+        leastRecentlyUsedIt = levelIt;
+        }
+      }
+    this->MemoryUsage -= leastRecentlyUsedIt->second.Size;
+    this->Levels.erase(leastRecentlyUsedIt);
+    }
+}
@@ -0,0 +1,111 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME PlastimatchPyImagePyramid - cache of subsampled images shared by the registration stages
+// .SECTION Description
+// Each resolution level of an image is built once (Gaussian anti-aliasing followed by
+// subsampling) and reused by every stage and every registration run requesting it.
+// Levels are identified by a key describing the source image and by the subsampling
+// factors. When the cached levels exceed the memory budget, the least recently used
+// levels are evicted.
+
+#ifndef __PlastimatchPyImagePyramid_h
+#define __PlastimatchPyImagePyramid_h
+
+// ITK includes
+#include "itkImage.h"
+
+// STD includes
+#include <map>
+#include <string>
+#include <vector>
+
+class PlastimatchPyImagePyramid
+{
+public:
+  typedef itk::Image< float, 3 >  ImageType;
+
+  /// Description of a resolution level to build
+  struct LevelRequest
+  {
+    std::string ImageKey;      /*!< Key identifying the source image and its content */
+    ImageType::Pointer Image;  /*!< Full resolution source image */
+    int Subsampling[3];        /*!< Integer subsampling factors */
+  };
+
+public:
+  PlastimatchPyImagePyramid();
+  virtual ~PlastimatchPyImagePyramid();
+
+  /// Set the maximum memory (bytes) used by the cached levels. 0 means unlimited.
+  void SetMemoryBudget(unsigned long long memoryBudget);
+  /// Get the maximum memory (bytes) used by the cached levels.
+  unsigned long long GetMemoryBudget() const { return this->MemoryBudget; };
+
+  /// Get the memory (bytes) currently used by the cached levels
+  unsigned long long GetMemoryUsage() const { return this->MemoryUsage; };
+
+  /// Build in parallel all the requested levels not yet in the cache
+  void BuildLevels(const std::vector<LevelRequest>& requests);
+
+  /// Get a resolution level, building it if it is not in the cache.
+  /// Subsampling 1 1 1 returns the source image itself.
+  ImageType::Pointer GetLevel(const std::string& imageKey, ImageType* image, const int subsampling[3]);
+
+  /// Remove all the cached levels
+  void Clear();
+
+  /// Build a resolution level (Gaussian anti-aliasing and subsampling) without caching it
+  static ImageType::Pointer BuildLevel(ImageType* image, const int subsampling[3]);
+
+protected:
+  /// Cached resolution level
+  struct Level
+  {
+    ImageType::Pointer Image;
+    unsigned long long Size;
+    unsigned long long LastAccess;
+  };
+
+  /// Get the key identifying a level in the cache
+  static std::string GetLevelKey(const std::string& imageKey, const int subsampling[3]);
+
+  /// Insert a level in the cache and evict the least recently used levels exceeding the budget
+  void InsertLevel(const std::string& levelKey, ImageType* image);
+
+  /// Evict the least recently used levels until the memory budget is met
+  void EvictLevels();
+
+protected:
+  /// Cached levels
+  std::map<std::string, Level> Levels;
+
+  /// Memory budget (bytes), 0 means unlimited
+  unsigned long long MemoryBudget;
+
+  /// Memory (bytes) used by the cached levels
+  unsigned long long MemoryUsage;
+
+  /// Counter used to track the least recently used level
+  unsigned long long AccessCounter;
+
+private:
+  PlastimatchPyImagePyramid(const PlastimatchPyImagePyramid&); // Not implemented
+  void operator=(const PlastimatchPyImagePyramid&);            // Not implemented
+};
+
+#endif
@@ -0,0 +1,168 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "PlastimatchPyJobScheduler.h"
+
+// KWSys includes
+#include <itksys/SystemInformation.hxx>
+
+//----------------------------------------------------------------------------
+PlastimatchPyJobScheduler* PlastimatchPyJobScheduler::GetInstance()
+{
+  static PlastimatchPyJobScheduler instance;
+  return &instance;
+}
+
+//----------------------------------------------------------------------------
+PlastimatchPyJobScheduler::PlastimatchPyJobScheduler()
+{
+  this->AdmissionCondition = itk::ConditionVariable::New();
+  this->MemoryBudget = 0;
+  this->AdmittedMemory = 0;
+  this->NextJobId = 0;
+  this->NextJobIdToAdmit = 0;
+  this->NumberOfCompletedJobs = 0;
+  this->TotalPredictedMemory = 0;
+  this->TotalProcessMemoryIncrease = 0;
+}
+
+//----------------------------------------------------------------------------
+PlastimatchPyJobScheduler::~PlastimatchPyJobScheduler()
+{
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyJobScheduler::SetMemoryBudget(unsigned long long memoryBudget)
+{
+  this->Mutex.Lock();
+  this->MemoryBudget = memoryBudget;
+  this->Mutex.Unlock();
+
+  // A larger budget may admit waiting jobs
+  this->AdmissionCondition->Broadcast();
+}
+
+//----------------------------------------------------------------------------
+unsigned long long PlastimatchPyJobScheduler::GetMemoryBudget()
+{
+  this->Mutex.Lock();
+  unsigned long long memoryBudget = this->MemoryBudget;
+  this->Mutex.Unlock();
+  return memoryBudget;
+}
+
+//----------------------------------------------------------------------------
+long PlastimatchPyJobScheduler::Admit(unsigned long long predictedMemory)
+{
+  this->Mutex.Lock();
+  const long jobId = this->NextJobId++;
+
+  // Wait is called in a loop, as the condition variable may wake up the job before its turn
+  while (!((jobId == this->NextJobIdToAdmit) && (this->MemoryBudget == 0
+    || this->RunningJobs.empty() || this->AdmittedMemory + predictedMemory <= this->MemoryBudget)))
+    {
+    this->AdmissionCondition->Wait(&this->Mutex);
+    }
+  this->NextJobIdToAdmit++;
+  this->RunningJobs[jobId] = predictedMemory;
+  this->AdmittedMemory += predictedMemory;
+  this->Mutex.Unlock();
+
+  // The next job in line may fit in the remaining budget too
+  this->AdmissionCondition->Broadcast();
+  return jobId;
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyJobScheduler::Release(long jobId, unsigned long long processMemoryIncrease)
+{
+  this->Mutex.Lock();
+  std::map<long, unsigned long long>::iterator jobIt = this->RunningJobs.find(jobId);
+  if (jobIt != this->RunningJobs.end())
+    {
+    this->AdmittedMemory -= jobIt->second;
+    this->TotalPredictedMemory += jobIt->second;
+    this->TotalProcessMemoryIncrease += processMemoryIncrease;
+    this->NumberOfCompletedJobs++;
+    this->RunningJobs.erase(jobIt);
+    }
+  this->Mutex.Unlock();
+
+  this->AdmissionCondition->Broadcast();
+}
+
+//----------------------------------------------------------------------------
+int PlastimatchPyJobScheduler::GetQueueDepth()
+{
+  this->Mutex.Lock();
+  int queueDepth = (int) (this->NextJobId - this->NextJobIdToAdmit);
+  this->Mutex.Unlock();
+  return queueDepth;
+}
+
+//----------------------------------------------------------------------------
+int PlastimatchPyJobScheduler::GetNumberOfRunningJobs()
+{
+  this->Mutex.Lock();
+  int numberOfRunningJobs = (int) this->RunningJobs.size();
+  this->Mutex.Unlock();
+  return numberOfRunningJobs;
+}
+
+//----------------------------------------------------------------------------
+unsigned long long PlastimatchPyJobScheduler::GetAdmittedMemory()
+{
+  this->Mutex.Lock();
+  unsigned long long admittedMemory = this->AdmittedMemory;
+  this->Mutex.Unlock();
+  return admittedMemory;
+}
+
+//----------------------------------------------------------------------------
+long PlastimatchPyJobScheduler::GetNumberOfCompletedJobs()
+{
+  this->Mutex.Lock();
+  long numberOfCompletedJobs = this->NumberOfCompletedJobs;
+  this->Mutex.Unlock();
+  return numberOfCompletedJobs;
+}
+
+//----------------------------------------------------------------------------
+unsigned long long PlastimatchPyJobScheduler::GetTotalPredictedMemory()
+{
+  this->Mutex.Lock();
+  unsigned long long totalPredictedMemory = this->TotalPredictedMemory;
+  this->Mutex.Unlock();
+  return totalPredictedMemory;
+}
+
+//----------------------------------------------------------------------------
+unsigned long long PlastimatchPyJobScheduler::GetTotalProcessMemoryIncrease()
+{
+  this->Mutex.Lock();
+  unsigned long long totalProcessMemoryIncrease = this->TotalProcessMemoryIncrease;
+  this->Mutex.Unlock();
+  return totalProcessMemoryIncrease;
+}
+
+//----------------------------------------------------------------------------
+unsigned long long PlastimatchPyJobScheduler::GetProcessMemoryUsage()
+{
+  itksys::SystemInformation systemInformation;
+  const long long processMemoryUsed = systemInformation.GetProcMemoryUsed(); // KiB
+  return processMemoryUsed > 0 ? (unsigned long long) processMemoryUsed * 1024 : 0;
+}
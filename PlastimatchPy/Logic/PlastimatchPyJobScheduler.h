@@ -0,0 +1,118 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME PlastimatchPyJobScheduler - memory-aware admission control of concurrent registrations
+// .SECTION Description
+// Registrations run in the same process declare their predicted peak memory before
+// starting. A job is admitted only while the predicted memory of the running jobs fits
+// the memory budget; the other jobs wait in first-in first-out order. A job larger than
+// the whole budget is admitted alone. Waiting jobs sleep on a condition variable that is
+// signaled when a job is released or the budget changes. The scheduler is shared by all
+// the logic instances of the process and can be used from any thread.
+
+#ifndef __PlastimatchPyJobScheduler_h
+#define __PlastimatchPyJobScheduler_h
+
+// ITK includes
+#include "itkConditionVariable.h"
+#include "itkSimpleMutexLock.h"
+
+// STD includes
+#include <map>
+
+class PlastimatchPyJobScheduler
+{
+public:
+  /// Get the scheduler shared by the whole process
+  static PlastimatchPyJobScheduler* GetInstance();
+
+  /// Set the maximum predicted memory (bytes) of the jobs running at the same time. 0 means unlimited.
+  void SetMemoryBudget(unsigned long long memoryBudget);
+  /// Get the maximum predicted memory (bytes) of the jobs running at the same time.
+  unsigned long long GetMemoryBudget();
+
+  /// Wait until the job fits in the memory budget and admit it. Returns the identifier of the job.
+  long Admit(unsigned long long predictedMemory);
+
+  /// Release the memory of a finished job and wake up the waiting jobs.
+  /// The increase of the process memory measured during the job is only recorded: as it is sampled on
+  /// the whole process, it also includes the allocations of the other jobs running at the same time.
+  void Release(long jobId, unsigned long long processMemoryIncrease);
+
+  /// Get the number of jobs waiting for admission
+  int GetQueueDepth();
+
+  /// Get the number of admitted jobs not yet released
+  int GetNumberOfRunningJobs();
+
+  /// Get the predicted memory (bytes) of the running jobs
+  unsigned long long GetAdmittedMemory();
+
+  /// Get the number of released jobs
+  long GetNumberOfCompletedJobs();
+
+  /// Get the sum of the predicted memory (bytes) of the released jobs
+  unsigned long long GetTotalPredictedMemory();
+
+  /// Get the sum of the process memory increases (bytes) measured during the released jobs.
+  /// Jobs that ran at the same time count each other's allocations, so this overestimates their own use.
+  unsigned long long GetTotalProcessMemoryIncrease();
+
+  /// Get the memory (bytes) currently used by the process, or 0 if it cannot be measured
+  static unsigned long long GetProcessMemoryUsage();
+
+protected:
+  PlastimatchPyJobScheduler();
+  virtual ~PlastimatchPyJobScheduler();
+
+protected:
+  /// Lock protecting all the members
+  itk::SimpleMutexLock Mutex;
+
+  /// Signaled when a job is released or the memory budget changes, so that waiting jobs retry their admission
+  itk::ConditionVariable::Pointer AdmissionCondition;
+
+  /// Memory budget (bytes), 0 means unlimited
+  unsigned long long MemoryBudget;
+
+  /// Predicted memory of the running jobs, by job identifier
+  std::map<long, unsigned long long> RunningJobs;
+
+  /// Predicted memory (bytes) of the running jobs
+  unsigned long long AdmittedMemory;
+
+  /// Identifier given to the next job asking for admission
+  long NextJobId;
+
+  /// Identifier of the next job to admit, so that jobs are admitted in order
+  long NextJobIdToAdmit;
+
+  /// Number of released jobs
+  long NumberOfCompletedJobs;
+
+  /// Sum of the predicted memory (bytes) of the released jobs
+  unsigned long long TotalPredictedMemory;
+
+  /// Sum of the process memory increases (bytes) measured during the released jobs
+  unsigned long long TotalProcessMemoryIncrease;
+
+private:
+  PlastimatchPyJobScheduler(const PlastimatchPyJobScheduler&); // Not implemented
+  void operator=(const PlastimatchPyJobScheduler&);            // Not implemented
+};
+
+#endif
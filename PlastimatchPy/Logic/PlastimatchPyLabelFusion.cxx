@@ -0,0 +1,443 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "PlastimatchPyLabelFusion.h"
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+  typedef PlastimatchPyLabelFusion::LabelImageType LabelImageType;
+
+  /// Offset mapping a short label to an index of the label tables
+  const int LABEL_TABLE_OFFSET = 32768;
+  const int LABEL_TABLE_SIZE = 65536;
+
+  //----------------------------------------------------------------------------
+  /// Allocate the fused labelmap on the grid of the atlases. Returns NULL if the atlas sizes differ.
+  LabelImageType::Pointer AllocateFusedLabels(const std::vector<LabelImageType::Pointer>& atlasLabels)
+  {
+    if (atlasLabels.empty() || !atlasLabels[0])
+      {
+      return NULL;
+      }
+    const LabelImageType::RegionType& region = atlasLabels[0]->GetBufferedRegion();
+    for (unsigned int atlasIndex=1; atlasIndex < atlasLabels.size(); atlasIndex++)
+      {
+      if (!atlasLabels[atlasIndex] || atlasLabels[atlasIndex]->GetBufferedRegion().GetSize() != region.GetSize())
+        {
+        return NULL;
+        }
+      }
+
+    LabelImageType::Pointer fusedLabels = LabelImageType::New();
+    fusedLabels->SetRegions(region);
+    fusedLabels->SetOrigin(atlasLabels[0]->GetOrigin());
+    fusedLabels->SetSpacing(atlasLabels[0]->GetSpacing());
+    fusedLabels->SetDirection(atlasLabels[0]->GetDirection());
+    fusedLabels->Allocate();
+    return fusedLabels;
+  }
+
+  //----------------------------------------------------------------------------
+  /// Find the labels present in the atlases and give them compact indices, ordered by label value
+  void BuildLabelTable(const std::vector<const short*>& atlasBuffers, long numberOfVoxels,
+    std::vector<int>& labelToIndex, std::vector<short>& indexToLabel)
+  {
+    const int numberOfAtlases = (int) atlasBuffers.size();
+    std::vector<char> labelPresent(LABEL_TABLE_SIZE, 0);
+
+#pragma omp parallel
+    {
+    std::vector<char> threadLabelPresent(LABEL_TABLE_SIZE, 0);
+#pragma omp for
+    for (long i=0; i < numberOfVoxels; i++)
+      {
+      for (int k=0; k < numberOfAtlases; k++)
+        {
+        threadLabelPresent[atlasBuffers[k][i] + LABEL_TABLE_OFFSET] = 1;
+        }
+      }
+#pragma omp critical
+    {
+    for (int j=0; j < LABEL_TABLE_SIZE; j++)
+      {
+      labelPresent[j] |= threadLabelPresent[j];
+      }
+    }
+    }
+
+    labelToIndex.assign(LABEL_TABLE_SIZE, -1);
+    indexToLabel.clear();
+    for (int j=0; j < LABEL_TABLE_SIZE; j++)
+      {
+      if (labelPresent[j])
+        {
+        labelToIndex[j] = (int) indexToLabel.size();
+        indexToLabel.push_back((short) (j - LABEL_TABLE_OFFSET));
+        }
+      }
+  }
+
+  //----------------------------------------------------------------------------
+  /// Compute the STAPLE posterior of the labels voted at a voxel. Only the voted labels are candidates.
+  /// Returns the sum of the unnormalized weights.
+  double ComputeStapleWeights(const std::vector<const short*>& atlasBuffers, long voxelIndex,
+    const std::vector<int>& labelToIndex, const std::vector<double>& confusionMatrices,
+    const std::vector<double>& prior, int numberOfLabels,
+    std::vector<int>& atlasVotes, std::vector<int>& candidates, std::vector<double>& weights)
+  {
+    const int numberOfAtlases = (int) atlasBuffers.size();
+    candidates.clear();
+    for (int k=0; k < numberOfAtlases; k++)
+      {
+      atlasVotes[k] = labelToIndex[atlasBuffers[k][voxelIndex] + LABEL_TABLE_OFFSET];
+      bool newCandidate = true;
+      for (unsigned int c=0; c < candidates.size() && newCandidate; c++)
+        {
+        newCandidate = (candidates[c] != atlasVotes[k]);
+        }
+      if (newCandidate)
+        {
+        candidates.push_back(atlasVotes[k]);
+        }
+      }
+
+    double sumOfWeights = 0.0;
+    for (unsigned int c=0; c < candidates.size(); c++)
+      {
+      const int t = candidates[c];
+      double weight = prior[t];
+      for (int k=0; k < numberOfAtlases; k++)
+        {
+        weight *= confusionMatrices[((long) k * numberOfLabels + t) * numberOfLabels + atlasVotes[k]];
+        }
+      weights[t] = weight;
+      sumOfWeights += weight;
+      }
+
+    // All candidates impossible under the current estimate, fall back to an uninformed vote
+    if (sumOfWeights <= 0.0)
+      {
+      for (unsigned int c=0; c < candidates.size(); c++)
+        {
+        weights[candidates[c]] = 1.0;
+        }
+      sumOfWeights = (double) candidates.size();
+      }
+    return sumOfWeights;
+  }
+}
+
+//----------------------------------------------------------------------------
+PlastimatchPyLabelFusion::LabelImageType::Pointer PlastimatchPyLabelFusion::ConvertToLabelImage(const ImageType* image)
+{
+  LabelImageType::Pointer labelImage = LabelImageType::New();
+  labelImage->SetRegions(image->GetBufferedRegion());
+  labelImage->SetOrigin(image->GetOrigin());
+  labelImage->SetSpacing(image->GetSpacing());
+  labelImage->SetDirection(image->GetDirection());
+  labelImage->Allocate();
+
+  const ImageType::SizeType size = image->GetBufferedRegion().GetSize();
+  const long numberOfVoxels = (long) (size[0] * size[1] * size[2]);
+  const float* imageBuffer = image->GetBufferPointer();
+  short* labelBuffer = labelImage->GetBufferPointer();
+  for (long i=0; i < numberOfVoxels; i++)
+    {
+    const float label = std::max(-32768.0f, std::min(32767.0f, imageBuffer[i]));
+    labelBuffer[i] = (short) floor(label + 0.5f);
+    }
+
+  return labelImage;
+}
+
+//----------------------------------------------------------------------------
+PlastimatchPyLabelFusion::LabelImageType::Pointer PlastimatchPyLabelFusion::FuseMajorityVote(
+  const std::vector<LabelImageType::Pointer>& atlasLabels)
+{
+  LabelImageType::Pointer fusedLabels = AllocateFusedLabels(atlasLabels);
+  if (!fusedLabels)
+    {
+    return NULL;
+    }
+
+  const int numberOfAtlases = (int) atlasLabels.size();
+  const LabelImageType::SizeType size = fusedLabels->GetBufferedRegion().GetSize();
+  const long numberOfVoxels = (long) (size[0] * size[1] * size[2]);
+  std::vector<const short*> atlasBuffers(numberOfAtlases);
+  for (int k=0; k < numberOfAtlases; k++)
+    {
+    atlasBuffers[k] = atlasLabels[k]->GetBufferPointer();
+    }
+
+  std::vector<int> labelToIndex;
+  std::vector<short> indexToLabel;
+  BuildLabelTable(atlasBuffers, numberOfVoxels, labelToIndex, indexToLabel);
+  const int numberOfLabels = (int) indexToLabel.size();
+  short* fusedBuffer = fusedLabels->GetBufferPointer();
+
+#pragma omp parallel
+  {
+  // Only the entries touched by the current voxel are reset, so the cost per voxel does not depend on the number of labels
+  std::vector<int> votes(numberOfLabels, 0);
+#pragma omp for
+  for (long i=0; i < numberOfVoxels; i++)
+    {
+    for (int k=0; k < numberOfAtlases; k++)
+      {
+      votes[labelToIndex[atlasBuffers[k][i] + LABEL_TABLE_OFFSET]]++;
+      }
+    int bestLabelIndex = -1;
+    for (int k=0; k < numberOfAtlases; k++)
+      {
+      const int labelIndex = labelToIndex[atlasBuffers[k][i] + LABEL_TABLE_OFFSET];
+      if (bestLabelIndex < 0 || votes[labelIndex] > votes[bestLabelIndex]
+        || (votes[labelIndex] == votes[bestLabelIndex] && labelIndex < bestLabelIndex))
+        {
+        bestLabelIndex = labelIndex;
+        }
+      }
+    for (int k=0; k < numberOfAtlases; k++)
+      {
+      votes[labelToIndex[atlasBuffers[k][i] + LABEL_TABLE_OFFSET]] = 0;
+      }
+    fusedBuffer[i] = indexToLabel[bestLabelIndex];
+    }
+  }
+
+  return fusedLabels;
+}
+
+//----------------------------------------------------------------------------
+PlastimatchPyLabelFusion::LabelImageType::Pointer PlastimatchPyLabelFusion::FuseStaple(
+  const std::vector<LabelImageType::Pointer>& atlasLabels, int maximumNumberOfIterations, double tolerance, int& numberOfIterations)
+{
+  numberOfIterations = 0;
+  LabelImageType::Pointer fusedLabels = AllocateFusedLabels(atlasLabels);
+  if (!fusedLabels)
+    {
+    return NULL;
+    }
+
+  const int numberOfAtlases = (int) atlasLabels.size();
+  const LabelImageType::SizeType size = fusedLabels->GetBufferedRegion().GetSize();
+  const long numberOfVoxels = (long) (size[0] * size[1] * size[2]);
+  std::vector<const short*> atlasBuffers(numberOfAtlases);
+  for (int k=0; k < numberOfAtlases; k++)
+    {
+    atlasBuffers[k] = atlasLabels[k]->GetBufferPointer();
+    }
+
+  std::vector<int> labelToIndex;
+  std::vector<short> indexToLabel;
+  BuildLabelTable(atlasBuffers, numberOfVoxels, labelToIndex, indexToLabel);
+  const int numberOfLabels = (int) indexToLabel.size();
+  short* fusedBuffer = fusedLabels->GetBufferPointer();
+
+  // Consensus voxels take their label directly and are only counted per label, the disagreement voxels
+  // are flagged in a bit mask (one bit per voxel, each byte being written by a single thread).
+  // The label prior is the frequency of each label over all the atlases.
+  const long numberOfMaskBytes = (numberOfVoxels + 7) / 8;
+  std::vector<unsigned char> disagreementMask(numberOfMaskBytes, 0);
+  std::vector<double> consensusCounts(numberOfLabels, 0.0);
+  std::vector<double> prior(numberOfLabels, 0.0);
+  long numberOfDisagreementVoxels = 0;
+#pragma omp parallel
+  {
+  std::vector<double> threadConsensusCounts(numberOfLabels, 0.0);
+  std::vector<double> threadPrior(numberOfLabels, 0.0);
+#pragma omp for reduction(+:numberOfDisagreementVoxels)
+  for (long b=0; b < numberOfMaskBytes; b++)
+    {
+    const long lastVoxel = std::min(8 * b + 8, numberOfVoxels);
+    for (long i=8*b; i < lastVoxel; i++)
+      {
+      bool consensus = true;
+      for (int k=0; k < numberOfAtlases; k++)
+        {
+        threadPrior[labelToIndex[atlasBuffers[k][i] + LABEL_TABLE_OFFSET]] += 1.0;
+        consensus = consensus && (atlasBuffers[k][i] == atlasBuffers[0][i]);
+        }
+      if (consensus)
+        {
+        fusedBuffer[i] = atlasBuffers[0][i];
+        threadConsensusCounts[labelToIndex[atlasBuffers[0][i] + LABEL_TABLE_OFFSET]] += 1.0;
+        }
+      else
+        {
+        disagreementMask[b] |= (unsigned char) (1 << (i - 8 * b));
+        numberOfDisagreementVoxels++;
+        }
+      }
+    }
+#pragma omp critical
+  {
+  for (int t=0; t < numberOfLabels; t++)
+    {
+    consensusCounts[t] += threadConsensusCounts[t];
+    prior[t] += threadPrior[t];
+    }
+  }
+  }
+
+  if (numberOfDisagreementVoxels == 0)
+    {
+    return fusedLabels;
+    }
+  for (int t=0; t < numberOfLabels; t++)
+    {
+    prior[t] /= (double) numberOfVoxels * numberOfAtlases;
+    }
+
+  // Confusion matrix of each atlas: P(atlas label s | true label t), initialized with a dominant diagonal
+  const long confusionMatricesSize = (long) numberOfAtlases * numberOfLabels * numberOfLabels;
+  std::vector<double> confusionMatrices(confusionMatricesSize);
+  const double initialDiagonal = 0.9;
+  for (int k=0; k < numberOfAtlases; k++)
+    {
+    for (int t=0; t < numberOfLabels; t++)
+      {
+      for (int s=0; s < numberOfLabels; s++)
+        {
+        confusionMatrices[((long) k * numberOfLabels + t) * numberOfLabels + s] =
+          (s == t) ? initialDiagonal : (1.0 - initialDiagonal) / (numberOfLabels - 1);
+        }
+      }
+    }
+
+  // Expectation-maximization, each iteration is one pass over the disagreement voxels.
+  // A consensus voxel with label t is true label t with every atlas voting t, so it adds its weight of 1
+  // to the diagonal of every confusion matrix: its contribution is the same at each iteration.
+  while (numberOfIterations < maximumNumberOfIterations)
+    {
+    std::vector<double> numerators(confusionMatricesSize, 0.0);
+    std::vector<double> denominators(consensusCounts);
+    for (int k=0; k < numberOfAtlases; k++)
+      {
+      for (int t=0; t < numberOfLabels; t++)
+        {
+        numerators[((long) k * numberOfLabels + t) * numberOfLabels + t] = consensusCounts[t];
+        }
+      }
+
+#pragma omp parallel
+    {
+    std::vector<double> threadNumerators(confusionMatricesSize, 0.0);
+    std::vector<double> threadDenominators(numberOfLabels, 0.0);
+    std::vector<double> weights(numberOfLabels, 0.0);
+    std::vector<int> atlasVotes(numberOfAtlases);
+    std::vector<int> candidates;
+    candidates.reserve(numberOfAtlases);
+#pragma omp for schedule(dynamic, 1024)
+    for (long b=0; b < numberOfMaskBytes; b++)
+      {
+      for (int bit=0; disagreementMask[b] && bit < 8; bit++)
+        {
+        if (!(disagreementMask[b] & (1 << bit)))
+          {
+          continue;
+          }
+        const double sumOfWeights = ComputeStapleWeights(atlasBuffers, 8 * b + bit, labelToIndex,
+          confusionMatrices, prior, numberOfLabels, atlasVotes, candidates, weights);
+        for (unsigned int c=0; c < candidates.size(); c++)
+          {
+          const int t = candidates[c];
+          const double weight = weights[t] / sumOfWeights;
+          threadDenominators[t] += weight;
+          for (int k=0; k < numberOfAtlases; k++)
+            {
+            threadNumerators[((long) k * numberOfLabels + t) * numberOfLabels + atlasVotes[k]] += weight;
+            }
+          }
+        }
+      }
+#pragma omp critical
+    {
+    for (long m=0; m < confusionMatricesSize; m++)
+      {
+      numerators[m] += threadNumerators[m];
+      }
+    for (int t=0; t < numberOfLabels; t++)
+      {
+      denominators[t] += threadDenominators[t];
+      }
+    }
+    }
+
+    double maximumChange = 0.0;
+    for (int k=0; k < numberOfAtlases; k++)
+      {
+      for (int t=0; t < numberOfLabels; t++)
+        {
+        if (denominators[t] <= 0.0)
+          {
+          continue;
+          }
+        for (int s=0; s < numberOfLabels; s++)
+          {
+          const long m = ((long) k * numberOfLabels + t) * numberOfLabels + s;
+          const double estimate = numerators[m] / denominators[t];
+          maximumChange = std::max(maximumChange, fabs(estimate - confusionMatrices[m]));
+          confusionMatrices[m] = estimate;
+          }
+        }
+      }
+    numberOfIterations++;
+    if (maximumChange < tolerance)
+      {
+      break;
+      }
+    }
+
+  // Maximum a posteriori label of the disagreement voxels
+#pragma omp parallel
+  {
+  std::vector<double> weights(numberOfLabels, 0.0);
+  std::vector<int> atlasVotes(numberOfAtlases);
+  std::vector<int> candidates;
+  candidates.reserve(numberOfAtlases);
+#pragma omp for schedule(dynamic, 1024)
+  for (long b=0; b < numberOfMaskBytes; b++)
+    {
+    for (int bit=0; disagreementMask[b] && bit < 8; bit++)
+      {
+      if (!(disagreementMask[b] & (1 << bit)))
+        {
+        continue;
+        }
+      const long voxelIndex = 8 * b + bit;
+      ComputeStapleWeights(atlasBuffers, voxelIndex, labelToIndex,
+        confusionMatrices, prior, numberOfLabels, atlasVotes, candidates, weights);
+      int bestLabelIndex = candidates[0];
+      for (unsigned int c=1; c < candidates.size(); c++)
+        {
+        const int t = candidates[c];
+        if (weights[t] > weights[bestLabelIndex] || (weights[t] == weights[bestLabelIndex] && t < bestLabelIndex))
+          {
+          bestLabelIndex = t;
+          }
+        }
+      fusedBuffer[voxelIndex] = indexToLabel[bestLabelIndex];
+      }
+    }
+  }
+
+  return fusedLabels;
+}
@@ -0,0 +1,63 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME PlastimatchPyLabelFusion - fusion of the labelmaps of several registered atlases
+// .SECTION Description
+// Fuses labelmaps defined on the same grid into one labelmap, either by majority vote
+// or by a multi-label STAPLE estimation of the performance of each atlas. Voxels are
+// streamed in parallel; only the vote counts of the current voxel are kept per thread,
+// so no per-label probability volume is allocated.
+
+#ifndef __PlastimatchPyLabelFusion_h
+#define __PlastimatchPyLabelFusion_h
+
+// ITK includes
+#include "itkImage.h"
+
+// STD includes
+#include <vector>
+
+class PlastimatchPyLabelFusion
+{
+public:
+  typedef itk::Image< short, 3 >  LabelImageType;
+  typedef itk::Image< float, 3 >  ImageType;
+
+public:
+  /// Round an image warped with nearest neighbor interpolation to a labelmap
+  static LabelImageType::Pointer ConvertToLabelImage(const ImageType* image);
+
+  /// Fuse the labelmaps by majority vote in a single pass. Ties are resolved in favor of the lowest label.
+  /// Returns NULL if the labelmaps do not have the same size.
+  static LabelImageType::Pointer FuseMajorityVote(
+    const std::vector<LabelImageType::Pointer>& atlasLabels /*!< Warped atlas labelmaps, on the same grid */
+    );
+
+  /// Fuse the labelmaps with multi-label STAPLE. The confusion matrix of each atlas is estimated by
+  /// expectation-maximization on the voxels where the atlases disagree, the other voxels take the consensus label
+  /// and enter the estimation through their count per label. Each iteration is a single parallel pass over the
+  /// disagreement voxels, which are flagged in a bit mask.
+  /// Returns NULL if the labelmaps do not have the same size.
+  static LabelImageType::Pointer FuseStaple(
+    const std::vector<LabelImageType::Pointer>& atlasLabels, /*!< Warped atlas labelmaps, on the same grid */
+    int maximumNumberOfIterations,                           /*!< Maximum number of EM iterations */
+    double tolerance,                                        /*!< Convergence threshold on the confusion matrices */
+    int& numberOfIterations                                  /*!< Output number of EM iterations run */
+    );
+};
+
+#endif
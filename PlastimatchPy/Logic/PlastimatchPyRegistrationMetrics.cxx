@@ -0,0 +1,317 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "PlastimatchPyRegistrationMetrics.h"
+#include "PlastimatchPyTransformEvaluator.h"
+
+// STD includes
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+//----------------------------------------------------------------------------
+PlastimatchPyRegistrationMetrics::Result::Result()
+{
+  this->Valid = false;
+  this->NumberOfVoxels = 0;
+  this->MeanSquaredError = 0.0;
+  this->NormalizedCrossCorrelation = 0.0;
+  this->MutualInformation = 0.0;
+  this->JacobianDeterminantMinimum = 1.0;
+  this->JacobianDeterminantMaximum = 1.0;
+  this->JacobianDeterminantMean = 1.0;
+  this->JacobianDeterminantStandardDeviation = 0.0;
+  this->NumberOfFoldingVoxels = 0;
+  this->NumberOfLandmarks = 0;
+  this->TargetRegistrationErrorMean = 0.0;
+  this->TargetRegistrationErrorMaximum = 0.0;
+}
+
+//----------------------------------------------------------------------------
+namespace
+{
+  /// Jacobian determinant of x + u(x) from central differences of a vector field at a voxel
+  inline float ComputeVectorFieldJacobianDeterminant(const PlastimatchPyRegistrationMetrics::VectorType* field,
+    const long size[3], const double spacing[3], long x, long y, long z)
+  {
+    const long position[3] = {x, y, z};
+    const long stride[3] = {1, size[0], size[0] * size[1]};
+    const long voxelIndex = z * stride[2] + y * stride[1] + x;
+
+    float gradient[3][3];
+    for (int d=0; d < 3; d++)
+      {
+      const long previous = position[d] > 0 ? 1 : 0;
+      const long next = position[d] < size[d] - 1 ? 1 : 0;
+      const float distance = (previous + next) * (float) spacing[d];
+      for (int c=0; c < 3; c++)
+        {
+        gradient[c][d] = (distance > 0.0f)
+          ? (field[voxelIndex + next * stride[d]][c] - field[voxelIndex - previous * stride[d]][c]) / distance
+          : 0.0f;
+        }
+      }
+    for (int c=0; c < 3; c++)
+      {
+      gradient[c][c] += 1.0f;
+      }
+    return gradient[0][0] * (gradient[1][1] * gradient[2][2] - gradient[1][2] * gradient[2][1])
+      - gradient[0][1] * (gradient[1][0] * gradient[2][2] - gradient[1][2] * gradient[2][0])
+      + gradient[0][2] * (gradient[1][0] * gradient[2][1] - gradient[1][1] * gradient[2][0]);
+  }
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyRegistrationMetrics::ComputeVoxelMetrics(const ImageType* fixedImage, const ImageType* warpedImage,
+  const Bspline_xform* bsplineTransformation, const DeformationFieldType* vectorField,
+  int numberOfHistogramBins, float histogramMinimum, float histogramMaximum, Result& result)
+{
+  result.Valid = false;
+
+  const ImageType::SizeType imageSize = fixedImage->GetBufferedRegion().GetSize();
+  if (imageSize != warpedImage->GetBufferedRegion().GetSize())
+    {
+    return;
+    }
+  if (vectorField && vectorField->GetBufferedRegion().GetSize() != imageSize)
+    {
+    vectorField = NULL;
+    }
+  const bool computeJacobian = (bsplineTransformation || vectorField);
+
+  const long size[3] = {(long) imageSize[0], (long) imageSize[1], (long) imageSize[2]};
+  const double spacing[3] = {fixedImage->GetSpacing()[0], fixedImage->GetSpacing()[1], fixedImage->GetSpacing()[2]};
+  const ImageType::IndexType start = fixedImage->GetBufferedRegion().GetIndex();
+  const float* fixedBuffer = fixedImage->GetBufferPointer();
+  const float* warpedBuffer = warpedImage->GetBufferPointer();
+  const VectorType* fieldBuffer = vectorField ? vectorField->GetBufferPointer() : NULL;
+
+  if (numberOfHistogramBins < 2)
+    {
+    numberOfHistogramBins = 2;
+    }
+  const float binScale = (histogramMaximum > histogramMinimum)
+    ? numberOfHistogramBins / (histogramMaximum - histogramMinimum) : 0.0f;
+
+  // Global accumulators
+  double sumFixed = 0.0, sumWarped = 0.0, sumFixedSquared = 0.0, sumWarpedSquared = 0.0, sumProduct = 0.0, sumSquaredDifference = 0.0;
+  double sumJacobian = 0.0, sumJacobianSquared = 0.0;
+  double minimumJacobian = DBL_MAX, maximumJacobian = -DBL_MAX;
+  long numberOfFoldingVoxels = 0;
+  std::vector<double> jointHistogram(numberOfHistogramBins * numberOfHistogramBins, 0.0);
+
+#pragma omp parallel
+  {
+  // Per-thread accumulators, merged once at the end
+  double localSumFixed = 0.0, localSumWarped = 0.0, localSumFixedSquared = 0.0, localSumWarpedSquared = 0.0;
+  double localSumProduct = 0.0, localSumSquaredDifference = 0.0;
+  double localSumJacobian = 0.0, localSumJacobianSquared = 0.0;
+  double localMinimumJacobian = DBL_MAX, localMaximumJacobian = -DBL_MAX;
+  long localNumberOfFoldingVoxels = 0;
+  std::vector<double> localJointHistogram(numberOfHistogramBins * numberOfHistogramBins, 0.0);
+
+#pragma omp for
+  for (long z=0; z < size[2]; z++)
+    {
+    ImageType::IndexType index;
+    ImageType::PointType physicalPoint;
+    index[2] = start[2] + z;
+    for (long y=0; y < size[1]; y++)
+      {
+      index[1] = start[1] + y;
+      const long rowOffset = (z * size[1] + y) * size[0];
+      for (long x=0; x < size[0]; x++)
+        {
+        // Similarity
+        const double fixedValue = fixedBuffer[rowOffset + x];
+        const double warpedValue = warpedBuffer[rowOffset + x];
+        localSumFixed += fixedValue;
+        localSumWarped += warpedValue;
+        localSumFixedSquared += fixedValue * fixedValue;
+        localSumWarpedSquared += warpedValue * warpedValue;
+        localSumProduct += fixedValue * warpedValue;
+        localSumSquaredDifference += (fixedValue - warpedValue) * (fixedValue - warpedValue);
+
+        int fixedBin = (int) ((fixedValue - histogramMinimum) * binScale);
+        int warpedBin = (int) ((warpedValue - histogramMinimum) * binScale);
+        fixedBin = fixedBin < 0 ? 0 : (fixedBin >= numberOfHistogramBins ? numberOfHistogramBins - 1 : fixedBin);
+        warpedBin = warpedBin < 0 ? 0 : (warpedBin >= numberOfHistogramBins ? numberOfHistogramBins - 1 : warpedBin);
+        localJointHistogram[fixedBin * numberOfHistogramBins + warpedBin] += 1.0;
+
+        // Jacobian
+        if (!computeJacobian)
+          {
+          continue;
+          }
+        float jacobianDeterminant = 1.0f;
+        if (bsplineTransformation)
+          {
+          index[0] = start[0] + x;
+          fixedImage->TransformIndexToPhysicalPoint(index, physicalPoint);
+          const float point[3] = { (float) physicalPoint[0], (float) physicalPoint[1], (float) physicalPoint[2] };
+          PlastimatchPyTransformEvaluator::EvaluateBsplineJacobianDeterminant(bsplineTransformation, point, jacobianDeterminant);
+          }
+        else
+          {
+          jacobianDeterminant = ComputeVectorFieldJacobianDeterminant(fieldBuffer, size, spacing, x, y, z);
+          }
+        localSumJacobian += jacobianDeterminant;
+        localSumJacobianSquared += (double) jacobianDeterminant * jacobianDeterminant;
+        localMinimumJacobian = jacobianDeterminant < localMinimumJacobian ? jacobianDeterminant : localMinimumJacobian;
+        localMaximumJacobian = jacobianDeterminant > localMaximumJacobian ? jacobianDeterminant : localMaximumJacobian;
+        if (jacobianDeterminant <= 0.0f)
+          {
+          localNumberOfFoldingVoxels++;
+          }
+        }
+      }
+    }
+
+#pragma omp critical
+  {
+  sumFixed += localSumFixed;
+  sumWarped += localSumWarped;
+  sumFixedSquared += localSumFixedSquared;
+  sumWarpedSquared += localSumWarpedSquared;
+  sumProduct += localSumProduct;
+  sumSquaredDifference += localSumSquaredDifference;
+  sumJacobian += localSumJacobian;
+  sumJacobianSquared += localSumJacobianSquared;
+  minimumJacobian = localMinimumJacobian < minimumJacobian ? localMinimumJacobian : minimumJacobian;
+  maximumJacobian = localMaximumJacobian > maximumJacobian ? localMaximumJacobian : maximumJacobian;
+  numberOfFoldingVoxels += localNumberOfFoldingVoxels;
+  for (unsigned int bin=0; bin < jointHistogram.size(); bin++)
+    {
+    jointHistogram[bin] += localJointHistogram[bin];
+    }
+  }
+  }
+
+  const long numberOfVoxels = size[0] * size[1] * size[2];
+  if (numberOfVoxels == 0)
+    {
+    return;
+    }
+  const double n = (double) numberOfVoxels;
+  result.NumberOfVoxels = numberOfVoxels;
+  result.MeanSquaredError = sumSquaredDifference / n;
+
+  const double meanFixed = sumFixed / n;
+  const double meanWarped = sumWarped / n;
+  const double covariance = sumProduct - n * meanFixed * meanWarped;
+  const double fixedVariance = sumFixedSquared - n * meanFixed * meanFixed;
+  const double warpedVariance = sumWarpedSquared - n * meanWarped * meanWarped;
+  result.NormalizedCrossCorrelation = (fixedVariance > 0.0 && warpedVariance > 0.0)
+    ? covariance / sqrt(fixedVariance * warpedVariance) : 0.0;
+
+  // Mutual information from the joint histogram and its marginals
+  std::vector<double> fixedHistogram(numberOfHistogramBins, 0.0);
+  std::vector<double> warpedHistogram(numberOfHistogramBins, 0.0);
+  for (int fixedBin=0; fixedBin < numberOfHistogramBins; fixedBin++)
+    {
+    for (int warpedBin=0; warpedBin < numberOfHistogramBins; warpedBin++)
+      {
+      const double count = jointHistogram[fixedBin * numberOfHistogramBins + warpedBin];
+      fixedHistogram[fixedBin] += count;
+      warpedHistogram[warpedBin] += count;
+      }
+    }
+  double mutualInformation = 0.0;
+  for (int fixedBin=0; fixedBin < numberOfHistogramBins; fixedBin++)
+    {
+    for (int warpedBin=0; warpedBin < numberOfHistogramBins; warpedBin++)
+      {
+      const double count = jointHistogram[fixedBin * numberOfHistogramBins + warpedBin];
+      if (count > 0.0)
+        {
+        mutualInformation += (count / n) * log(count * n / (fixedHistogram[fixedBin] * warpedHistogram[warpedBin]));
+        }
+      }
+    }
+  result.MutualInformation = mutualInformation;
+
+  if (computeJacobian)
+    {
+    result.JacobianDeterminantMinimum = minimumJacobian;
+    result.JacobianDeterminantMaximum = maximumJacobian;
+    result.JacobianDeterminantMean = sumJacobian / n;
+    const double jacobianVariance = sumJacobianSquared / n - result.JacobianDeterminantMean * result.JacobianDeterminantMean;
+    result.JacobianDeterminantStandardDeviation = jacobianVariance > 0.0 ? sqrt(jacobianVariance) : 0.0;
+    result.NumberOfFoldingVoxels = numberOfFoldingVoxels;
+    }
+
+  result.Valid = true;
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyRegistrationMetrics::ComputeTargetRegistrationError(const Labeled_pointset* fixedLandmarks,
+  const Labeled_pointset* movingLandmarks, const Bspline_xform* bsplineTransformation,
+  const DeformationFieldType* vectorField, const double linearTransformationMatrix[3][4], Result& result)
+{
+  result.NumberOfLandmarks = 0;
+  result.TargetRegistrationErrorMean = 0.0;
+  result.TargetRegistrationErrorMaximum = 0.0;
+  if (!fixedLandmarks || !movingLandmarks || (!bsplineTransformation && !vectorField))
+    {
+    return;
+    }
+
+  const int numberOfLandmarks = (int) std::min(fixedLandmarks->point_list.size(), movingLandmarks->point_list.size());
+  double sumError = 0.0;
+  for (int i=0; i < numberOfLandmarks; i++)
+    {
+    const float fixedPoint[3] = { fixedLandmarks->point_list[i].p[0], fixedLandmarks->point_list[i].p[1], fixedLandmarks->point_list[i].p[2] };
+    float displacement[3];
+    if (bsplineTransformation)
+      {
+      PlastimatchPyTransformEvaluator::EvaluateBspline(bsplineTransformation, fixedPoint, displacement);
+      }
+    else
+      {
+      PlastimatchPyTransformEvaluator::EvaluateVectorField(vectorField, fixedPoint, displacement);
+      }
+
+    double mappedPoint[3];
+    for (int d=0; d < 3; d++)
+      {
+      mappedPoint[d] = fixedPoint[d] + displacement[d];
+      }
+    if (linearTransformationMatrix)
+      {
+      const double deformedPoint[3] = { mappedPoint[0], mappedPoint[1], mappedPoint[2] };
+      for (int d=0; d < 3; d++)
+        {
+        mappedPoint[d] = linearTransformationMatrix[d][0] * deformedPoint[0] + linearTransformationMatrix[d][1] * deformedPoint[1]
+          + linearTransformationMatrix[d][2] * deformedPoint[2] + linearTransformationMatrix[d][3];
+        }
+      }
+
+    double squaredError = 0.0;
+    for (int d=0; d < 3; d++)
+      {
+      const double difference = mappedPoint[d] - movingLandmarks->point_list[i].p[d];
+      squaredError += difference * difference;
+      }
+    const double error = sqrt(squaredError);
+    sumError += error;
+    result.TargetRegistrationErrorMaximum = error > result.TargetRegistrationErrorMaximum ? error : result.TargetRegistrationErrorMaximum;
+    }
+
+  result.NumberOfLandmarks = numberOfLandmarks;
+  result.TargetRegistrationErrorMean = numberOfLandmarks > 0 ? sumError / numberOfLandmarks : 0.0;
+}
@@ -0,0 +1,108 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME PlastimatchPyRegistrationMetrics - quality metrics of a registration result
+// .SECTION Description
+// Computes similarity (MSE, NCC, mutual information) between the fixed image and the
+// warped moving image, Jacobian determinant statistics of the deformation and the
+// landmark target registration error. All the voxel metrics are accumulated in a
+// single multi-threaded pass, with a per-thread reduction.
+
+#ifndef __PlastimatchPyRegistrationMetrics_h
+#define __PlastimatchPyRegistrationMetrics_h
+
+// ITK includes
+#include "itkImage.h"
+
+// Plastimatch includes
+#include "bspline_xform.h"
+#include "pointset.h"
+
+class PlastimatchPyRegistrationMetrics
+{
+public:
+  typedef itk::Image< float, 3 >  ImageType;
+  typedef itk::Vector< float, 3 >  VectorType;
+  typedef itk::Image< VectorType, 3 >  DeformationFieldType;
+
+  /// Registration quality metrics
+  struct Result
+  {
+    Result();
+
+    /// True if the metrics have been computed
+    bool Valid;
+
+    /// Number of voxels the similarity metrics are computed on
+    long NumberOfVoxels;
+    /// Mean squared error between fixed and warped image
+    double MeanSquaredError;
+    /// Normalized cross correlation between fixed and warped image
+    double NormalizedCrossCorrelation;
+    /// Mutual information (nats) between fixed and warped image
+    double MutualInformation;
+
+    /// Minimum of the determinant of the Jacobian of the deformation
+    double JacobianDeterminantMinimum;
+    /// Maximum of the determinant of the Jacobian of the deformation
+    double JacobianDeterminantMaximum;
+    /// Mean of the determinant of the Jacobian of the deformation
+    double JacobianDeterminantMean;
+    /// Standard deviation of the determinant of the Jacobian of the deformation
+    double JacobianDeterminantStandardDeviation;
+    /// Number of voxels where the deformation folds (determinant not positive)
+    long NumberOfFoldingVoxels;
+
+    /// Number of landmark pairs the target registration error is computed on
+    int NumberOfLandmarks;
+    /// Mean target registration error (mm)
+    double TargetRegistrationErrorMean;
+    /// Maximum target registration error (mm)
+    double TargetRegistrationErrorMaximum;
+  };
+
+public:
+  /// Compute the image and Jacobian metrics in a single pass over the fixed image grid.
+  /// The Jacobian is computed analytically if bsplineTransformation is given, otherwise by
+  /// central differences of vectorField (defined on the fixed image grid). If neither is
+  /// given, Jacobian statistics are not computed.
+  /// Intensities are binned in [histogramMinimum, histogramMaximum] for the mutual information.
+  static void ComputeVoxelMetrics(
+    const ImageType* fixedImage,                /*!< Fixed image */
+    const ImageType* warpedImage,               /*!< Warped moving image, on the fixed image grid */
+    const Bspline_xform* bsplineTransformation, /*!< B-spline transformation (optional) */
+    const DeformationFieldType* vectorField,    /*!< Vector field on the fixed image grid (optional) */
+    int numberOfHistogramBins,                  /*!< Number of bins per image of the joint histogram */
+    float histogramMinimum,                     /*!< Lower bound of the intensities of the joint histogram */
+    float histogramMaximum,                     /*!< Upper bound of the intensities of the joint histogram */
+    Result& result                              /*!< Output metrics */
+    );
+
+  /// Compute the target registration error of the fixed landmarks mapped into the moving image space.
+  /// If the moving image has been pre-aligned, the deformed landmarks are mapped by the linear transformation
+  /// of the pre-alignment before being compared to the moving landmarks.
+  static void ComputeTargetRegistrationError(
+    const Labeled_pointset* fixedLandmarks,         /*!< Fixed landmarks (LPS) */
+    const Labeled_pointset* movingLandmarks,        /*!< Moving landmarks (LPS) */
+    const Bspline_xform* bsplineTransformation,     /*!< B-spline transformation (optional) */
+    const DeformationFieldType* vectorField,        /*!< Vector field, used if no B-spline transformation is given */
+    const double linearTransformationMatrix[3][4],  /*!< Linear part and translation (LPS) of the pre-alignment (optional) */
+    Result& result                                  /*!< Output metrics */
+    );
+};
+
+#endif
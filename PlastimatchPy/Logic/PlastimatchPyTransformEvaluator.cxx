@@ -0,0 +1,289 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "PlastimatchPyTransformEvaluator.h"
+
+// STD includes
+#include <cmath>
+
+//----------------------------------------------------------------------------
+namespace
+{
+  /// Compute the four cubic B-spline basis weights for the local coordinate u in [0,1)
+  inline void ComputeBsplineBasis(float u, float basis[4])
+  {
+    const float oneMinusU = 1.0f - u;
+    const float u2 = u * u;
+    const float u3 = u2 * u;
+    basis[0] = oneMinusU * oneMinusU * oneMinusU / 6.0f;
+    basis[1] = (3.0f * u3 - 6.0f * u2 + 4.0f) / 6.0f;
+    basis[2] = (-3.0f * u3 + 3.0f * u2 + 3.0f * u + 1.0f) / 6.0f;
+    basis[3] = u3 / 6.0f;
+  }
+
+  /// Compute the derivatives of the four cubic B-spline basis weights for the local coordinate u in [0,1)
+  inline void ComputeBsplineBasisDerivative(float u, float basisDerivative[4])
+  {
+    const float oneMinusU = 1.0f - u;
+    const float u2 = u * u;
+    basisDerivative[0] = -0.5f * oneMinusU * oneMinusU;
+    basisDerivative[1] = (3.0f * u2 - 4.0f * u) / 2.0f;
+    basisDerivative[2] = (-3.0f * u2 + 2.0f * u + 1.0f) / 2.0f;
+    basisDerivative[3] = 0.5f * u2;
+  }
+
+  /// Locate the B-spline region containing a physical point and compute its local coordinates.
+  /// Returns false if the point lies outside of the B-spline region of interest.
+  inline bool LocateBsplineRegion(const Bspline_xform* bsplineTransformation, const float point[3],
+    long region[3], float localCoordinate[3])
+  {
+    for (int d=0; d < 3; d++)
+      {
+      // Continuous voxel index inside the B-spline region of interest
+      float index = (point[d] - bsplineTransformation->img_origin[d]) / bsplineTransformation->img_spacing[d]
+        - (float) bsplineTransformation->roi_offset[d];
+      if (index < 0.0f || index > (float) (bsplineTransformation->roi_dim[d] - 1))
+        {
+        return false;
+        }
+
+      float regionCoordinate = index / (float) bsplineTransformation->vox_per_rgn[d];
+      region[d] = (long) floorf(regionCoordinate);
+      if (region[d] > (long) bsplineTransformation->rdims[d] - 1)
+        {
+        region[d] = (long) bsplineTransformation->rdims[d] - 1;
+        }
+      localCoordinate[d] = regionCoordinate - (float) region[d];
+      }
+    return true;
+  }
+}
+
+//----------------------------------------------------------------------------
+bool PlastimatchPyTransformEvaluator::EvaluateBspline(
+  const Bspline_xform* bsplineTransformation, const float point[3], float displacement[3])
+{
+  displacement[0] = displacement[1] = displacement[2] = 0.0f;
+
+  long region[3];
+  float localCoordinate[3];
+  if (!LocateBsplineRegion(bsplineTransformation, point, region, localCoordinate))
+    {
+    return false;
+    }
+  float basis[3][4];
+  for (int d=0; d < 3; d++)
+    {
+    ComputeBsplineBasis(localCoordinate[d], basis[d]);
+    }
+
+  // Accumulate the contribution of the 4x4x4 control points supporting the region
+  const float* coefficients = bsplineTransformation->coeff;
+  const long cdimX = (long) bsplineTransformation->cdims[0];
+  const long cdimY = (long) bsplineTransformation->cdims[1];
+  for (int k=0; k < 4; k++)
+    {
+    for (int j=0; j < 4; j++)
+      {
+      const float weightJK = basis[2][k] * basis[1][j];
+      const long rowIndex = ((region[2] + k) * cdimY + (region[1] + j)) * cdimX + region[0];
+      const float* controlPoint = coefficients + 3 * rowIndex;
+      for (int i=0; i < 4; i++)
+        {
+        const float weight = weightJK * basis[0][i];
+        displacement[0] += weight * controlPoint[3*i];
+        displacement[1] += weight * controlPoint[3*i+1];
+        displacement[2] += weight * controlPoint[3*i+2];
+        }
+      }
+    }
+
+  return true;
+}
+
+//----------------------------------------------------------------------------
+bool PlastimatchPyTransformEvaluator::EvaluateBsplineJacobianDeterminant(
+  const Bspline_xform* bsplineTransformation, const float point[3], float& jacobianDeterminant)
+{
+  jacobianDeterminant = 1.0f;
+
+  long region[3];
+  float localCoordinate[3];
+  if (!LocateBsplineRegion(bsplineTransformation, point, region, localCoordinate))
+    {
+    return false;
+    }
+
+  // Derivatives are scaled by the control point spacing to be expressed per mm
+  float basis[3][4];
+  float basisDerivative[3][4];
+  for (int d=0; d < 3; d++)
+    {
+    ComputeBsplineBasis(localCoordinate[d], basis[d]);
+    ComputeBsplineBasisDerivative(localCoordinate[d], basisDerivative[d]);
+    const float gridSpacing = bsplineTransformation->vox_per_rgn[d] * bsplineTransformation->img_spacing[d];
+    for (int n=0; n < 4; n++)
+      {
+      basisDerivative[d][n] /= gridSpacing;
+      }
+    }
+
+  // gradient[c][d] = d u_c / d x_d
+  float gradient[3][3] = { {0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.0f} };
+  const float* coefficients = bsplineTransformation->coeff;
+  const long cdimX = (long) bsplineTransformation->cdims[0];
+  const long cdimY = (long) bsplineTransformation->cdims[1];
+  for (int k=0; k < 4; k++)
+    {
+    for (int j=0; j < 4; j++)
+      {
+      const long rowIndex = ((region[2] + k) * cdimY + (region[1] + j)) * cdimX + region[0];
+      const float* controlPoint = coefficients + 3 * rowIndex;
+      for (int i=0; i < 4; i++)
+        {
+        const float weightX = basisDerivative[0][i] * basis[1][j] * basis[2][k];
+        const float weightY = basis[0][i] * basisDerivative[1][j] * basis[2][k];
+        const float weightZ = basis[0][i] * basis[1][j] * basisDerivative[2][k];
+        for (int c=0; c < 3; c++)
+          {
+          gradient[c][0] += weightX * controlPoint[3*i+c];
+          gradient[c][1] += weightY * controlPoint[3*i+c];
+          gradient[c][2] += weightZ * controlPoint[3*i+c];
+          }
+        }
+      }
+    }
+
+  // Jacobian of x + u(x) is the identity plus the gradient of the displacement
+  for (int c=0; c < 3; c++)
+    {
+    gradient[c][c] += 1.0f;
+    }
+  jacobianDeterminant =
+      gradient[0][0] * (gradient[1][1] * gradient[2][2] - gradient[1][2] * gradient[2][1])
+    - gradient[0][1] * (gradient[1][0] * gradient[2][2] - gradient[1][2] * gradient[2][0])
+    + gradient[0][2] * (gradient[1][0] * gradient[2][1] - gradient[1][1] * gradient[2][0]);
+
+  return true;
+}
+
+//----------------------------------------------------------------------------
+bool PlastimatchPyTransformEvaluator::EvaluateVectorField(
+  const DeformationFieldType* vectorField, const float point[3], float displacement[3])
+{
+  displacement[0] = displacement[1] = displacement[2] = 0.0f;
+
+  DeformationFieldType::PointType physicalPoint;
+  physicalPoint[0] = point[0];
+  physicalPoint[1] = point[1];
+  physicalPoint[2] = point[2];
+  itk::ContinuousIndex<double, 3> continuousIndex;
+  vectorField->TransformPhysicalPointToContinuousIndex(physicalPoint, continuousIndex);
+
+  const DeformationFieldType::RegionType& region = vectorField->GetBufferedRegion();
+  const DeformationFieldType::SizeType& size = region.GetSize();
+  const DeformationFieldType::IndexType& start = region.GetIndex();
+
+  long baseIndex[3];
+  float fraction[3];
+  for (int d=0; d < 3; d++)
+    {
+    double index = continuousIndex[d] - (double) start[d];
+    if (index < 0.0 || index > (double) (size[d] - 1))
+      {
+      return false;
+      }
+    baseIndex[d] = (long) floor(index);
+    if (baseIndex[d] >= (long) size[d] - 1)
+      {
+      baseIndex[d] = (long) size[d] - 2 >= 0 ? (long) size[d] - 2 : 0;
+      }
+    fraction[d] = (float) (index - (double) baseIndex[d]);
+    }
+
+  const VectorType* buffer = vectorField->GetBufferPointer();
+  const long strideY = (long) size[0];
+  const long strideZ = (long) (size[0] * size[1]);
+  for (int k=0; k < 2; k++)
+    {
+    const long z = (size[2] > 1) ? baseIndex[2] + k : baseIndex[2];
+    const float weightZ = k ? fraction[2] : 1.0f - fraction[2];
+    for (int j=0; j < 2; j++)
+      {
+      const long y = (size[1] > 1) ? baseIndex[1] + j : baseIndex[1];
+      const float weightYZ = weightZ * (j ? fraction[1] : 1.0f - fraction[1]);
+      for (int i=0; i < 2; i++)
+        {
+        const long x = (size[0] > 1) ? baseIndex[0] + i : baseIndex[0];
+        const float weight = weightYZ * (i ? fraction[0] : 1.0f - fraction[0]);
+        const VectorType& vector = buffer[z * strideZ + y * strideY + x];
+        displacement[0] += weight * vector[0];
+        displacement[1] += weight * vector[1];
+        displacement[2] += weight * vector[2];
+        }
+      }
+    }
+
+  return true;
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyTransformEvaluator::TransformPointsWithBspline(
+  const Bspline_xform* bsplineTransformation, const float* inputPoints, float* outputPoints, long numberOfPoints)
+{
+#pragma omp parallel for
+  for (long i=0; i < numberOfPoints; i++)
+    {
+    float displacement[3];
+    EvaluateBspline(bsplineTransformation, inputPoints + 3*i, displacement);
+    outputPoints[3*i]   = inputPoints[3*i]   + displacement[0];
+    outputPoints[3*i+1] = inputPoints[3*i+1] + displacement[1];
+    outputPoints[3*i+2] = inputPoints[3*i+2] + displacement[2];
+    }
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyTransformEvaluator::TransformPointsWithVectorField(
+  const DeformationFieldType* vectorField, const float* inputPoints, float* outputPoints, long numberOfPoints)
+{
+#pragma omp parallel for
+  for (long i=0; i < numberOfPoints; i++)
+    {
+    float displacement[3];
+    EvaluateVectorField(vectorField, inputPoints + 3*i, displacement);
+    outputPoints[3*i]   = inputPoints[3*i]   + displacement[0];
+    outputPoints[3*i+1] = inputPoints[3*i+1] + displacement[1];
+    outputPoints[3*i+2] = inputPoints[3*i+2] + displacement[2];
+    }
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyTransformEvaluator::TransformPointsWithLinearTransformation(
+  const double matrix[3][4], const float* inputPoints, float* outputPoints, long numberOfPoints)
+{
+#pragma omp parallel for
+  for (long i=0; i < numberOfPoints; i++)
+    {
+    const double x = inputPoints[3*i];
+    const double y = inputPoints[3*i+1];
+    const double z = inputPoints[3*i+2];
+    for (int r=0; r < 3; r++)
+      {
+      outputPoints[3*i+r] = (float) (matrix[r][0] * x + matrix[r][1] * y + matrix[r][2] * z + matrix[r][3]);
+      }
+    }
+}
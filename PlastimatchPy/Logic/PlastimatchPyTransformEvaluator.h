@@ -0,0 +1,93 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME PlastimatchPyTransformEvaluator - evaluates Plastimatch transformations at arbitrary points
+// .SECTION Description
+// Stateless helper functions used by the PlastimatchPy logic to map large
+// point sets through a registration result. All functions work on caller
+// owned, preallocated buffers and are safe to call from multiple threads.
+
+#ifndef __PlastimatchPyTransformEvaluator_h
+#define __PlastimatchPyTransformEvaluator_h
+
+// ITK includes
+#include "itkImage.h"
+
+// Plastimatch includes
+#include "bspline_xform.h"
+
+class PlastimatchPyTransformEvaluator
+{
+public:
+  typedef itk::Vector< float, 3 >  VectorType;
+  typedef itk::Image< VectorType, 3 >  DeformationFieldType;
+
+  /// Evaluate the B-spline displacement at a physical point (LPS).
+  /// The cubic B-spline basis is computed analytically from the coefficient grid, no dense field is needed.
+  /// Returns false (and a zero displacement) if the point lies outside of the B-spline region of interest.
+  static bool EvaluateBspline(
+    const Bspline_xform* bsplineTransformation, /*!< B-spline coefficients as Bspline_xform pointer */
+    const float point[3],                       /*!< Input point (LPS, mm) */
+    float displacement[3]                       /*!< Output displacement (mm) */
+    );
+
+  /// Evaluate the determinant of the Jacobian of the B-spline transformation x + u(x) at a physical point (LPS).
+  /// Derivatives of the cubic B-spline basis are computed analytically.
+  /// Returns false (and a determinant of 1) if the point lies outside of the B-spline region of interest.
+  static bool EvaluateBsplineJacobianDeterminant(
+    const Bspline_xform* bsplineTransformation, /*!< B-spline coefficients as Bspline_xform pointer */
+    const float point[3],                       /*!< Input point (LPS, mm) */
+    float& jacobianDeterminant                  /*!< Output determinant of the Jacobian */
+    );
+
+  /// Evaluate a dense vector field at a physical point (LPS) using trilinear interpolation.
+  /// Returns false (and a zero displacement) if the point lies outside of the vector field.
+  static bool EvaluateVectorField(
+    const DeformationFieldType* vectorField, /*!< Vector field as DeformationFieldType pointer */
+    const float point[3],                    /*!< Input point (LPS, mm) */
+    float displacement[3]                    /*!< Output displacement (mm) */
+    );
+
+  /// Transform a packed array of points (x0 y0 z0 x1 y1 z1 ...) through a B-spline transformation.
+  /// Points are processed in parallel; input and output buffers must hold 3*numberOfPoints floats.
+  static void TransformPointsWithBspline(
+    const Bspline_xform* bsplineTransformation, /*!< B-spline coefficients as Bspline_xform pointer */
+    const float* inputPoints,                   /*!< Packed input points (LPS, mm) */
+    float* outputPoints,                        /*!< Packed output points (LPS, mm), preallocated */
+    long numberOfPoints                         /*!< Number of points */
+    );
+
+  /// Transform a packed array of points (x0 y0 z0 x1 y1 z1 ...) through a dense vector field.
+  /// Points are processed in parallel; input and output buffers must hold 3*numberOfPoints floats.
+  static void TransformPointsWithVectorField(
+    const DeformationFieldType* vectorField, /*!< Vector field as DeformationFieldType pointer */
+    const float* inputPoints,                /*!< Packed input points (LPS, mm) */
+    float* outputPoints,                     /*!< Packed output points (LPS, mm), preallocated */
+    long numberOfPoints                      /*!< Number of points */
+    );
+
+  /// Transform a packed array of points (x0 y0 z0 x1 y1 z1 ...) through a linear transformation.
+  /// Points are processed in parallel; input and output buffers must hold 3*numberOfPoints floats.
+  static void TransformPointsWithLinearTransformation(
+    const double matrix[3][4],  /*!< Linear part (3x3) and translation (last column) of the transformation (LPS) */
+    const float* inputPoints,   /*!< Packed input points (LPS, mm) */
+    float* outputPoints,        /*!< Packed output points (LPS, mm), preallocated */
+    long numberOfPoints         /*!< Number of points */
+    );
+};
+
+#endif
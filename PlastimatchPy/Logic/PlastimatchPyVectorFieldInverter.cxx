@@ -0,0 +1,206 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+#include "PlastimatchPyVectorFieldInverter.h"
+#include "PlastimatchPyTransformEvaluator.h"
+
+//----------------------------------------------------------------------------
+namespace
+{
+  /// Forward transformation evaluated from B-spline coefficients
+  struct BsplineForwardTransformation
+  {
+    const Bspline_xform* Transformation;
+    void operator()(const float point[3], float displacement[3]) const
+    {
+      PlastimatchPyTransformEvaluator::EvaluateBspline(this->Transformation, point, displacement);
+    }
+  };
+
+  /// Forward transformation evaluated from a dense vector field
+  struct VectorFieldForwardTransformation
+  {
+    const PlastimatchPyVectorFieldInverter::DeformationFieldType* Field;
+    void operator()(const float point[3], float displacement[3]) const
+    {
+      PlastimatchPyTransformEvaluator::EvaluateVectorField(this->Field, point, displacement);
+    }
+  };
+
+  //----------------------------------------------------------------------------
+  template <class TForwardTransformation>
+  long InvertField(const TForwardTransformation& forwardTransformation,
+    PlastimatchPyVectorFieldInverter::DeformationFieldType* inverseField, int maximumNumberOfIterations, float tolerance)
+  {
+    typedef PlastimatchPyVectorFieldInverter::DeformationFieldType DeformationFieldType;
+
+    const DeformationFieldType::SizeType size = inverseField->GetBufferedRegion().GetSize();
+    const DeformationFieldType::IndexType start = inverseField->GetBufferedRegion().GetIndex();
+    DeformationFieldType::PixelType* buffer = inverseField->GetBufferPointer();
+    const float squaredTolerance = tolerance * tolerance;
+
+    long numberOfNotConvergedVoxels = 0;
+#pragma omp parallel for reduction(+:numberOfNotConvergedVoxels)
+    for (long z=0; z < (long) size[2]; z++)
+      {
+      DeformationFieldType::IndexType index;
+      DeformationFieldType::PointType physicalPoint;
+      index[2] = start[2] + z;
+      for (long y=0; y < (long) size[1]; y++)
+        {
+        index[1] = start[1] + y;
+        for (long x=0; x < (long) size[0]; x++)
+          {
+          index[0] = start[0] + x;
+          inverseField->TransformIndexToPhysicalPoint(index, physicalPoint);
+          const float point[3] = { (float) physicalPoint[0], (float) physicalPoint[1], (float) physicalPoint[2] };
+
+          // Initial guess w0(y) = -u(y)
+          float inverse[3];
+          forwardTransformation(point, inverse);
+          inverse[0] = -inverse[0];
+          inverse[1] = -inverse[1];
+          inverse[2] = -inverse[2];
+
+          bool converged = false;
+          for (int iteration=0; iteration < maximumNumberOfIterations && !converged; iteration++)
+            {
+            // w_{n+1}(y) = -u(y + w_n(y))
+            const float displacedPoint[3] = { point[0] + inverse[0], point[1] + inverse[1], point[2] + inverse[2] };
+            float forward[3];
+            forwardTransformation(displacedPoint, forward);
+            const float dx = -forward[0] - inverse[0];
+            const float dy = -forward[1] - inverse[1];
+            const float dz = -forward[2] - inverse[2];
+            inverse[0] = -forward[0];
+            inverse[1] = -forward[1];
+            inverse[2] = -forward[2];
+            converged = (dx*dx + dy*dy + dz*dz < squaredTolerance);
+            }
+          if (!converged)
+            {
+            numberOfNotConvergedVoxels++;
+            }
+
+          DeformationFieldType::PixelType& voxel = buffer[(z * size[1] + y) * size[0] + x];
+          voxel[0] = inverse[0];
+          voxel[1] = inverse[1];
+          voxel[2] = inverse[2];
+          }
+        }
+      }
+
+    inverseField->Modified();
+    return numberOfNotConvergedVoxels;
+  }
+}
+
+//----------------------------------------------------------------------------
+PlastimatchPyVectorFieldInverter::DeformationFieldType::Pointer PlastimatchPyVectorFieldInverter::AllocateField(
+  const ImageType* referenceImage, int subsamplingFactor)
+{
+  if (subsamplingFactor < 1)
+    {
+    subsamplingFactor = 1;
+    }
+
+  const ImageType::RegionType& referenceRegion = referenceImage->GetLargestPossibleRegion();
+  DeformationFieldType::SizeType size;
+  DeformationFieldType::SpacingType spacing;
+  itk::ContinuousIndex<double, 3> firstVoxelCenter;
+  for (int d=0; d < 3; d++)
+    {
+    size[d] = (referenceRegion.GetSize()[d] + subsamplingFactor - 1) / subsamplingFactor;
+    spacing[d] = referenceImage->GetSpacing()[d] * subsamplingFactor;
+    // Center the coarse voxels on the reference voxels they cover
+    firstVoxelCenter[d] = referenceRegion.GetIndex()[d] + 0.5 * (subsamplingFactor - 1);
+    }
+  DeformationFieldType::PointType origin;
+  referenceImage->TransformContinuousIndexToPhysicalPoint(firstVoxelCenter, origin);
+
+  DeformationFieldType::RegionType region;
+  region.SetSize(size);
+
+  DeformationFieldType::Pointer field = DeformationFieldType::New();
+  field->SetRegions(region);
+  field->SetOrigin(origin);
+  field->SetSpacing(spacing);
+  field->SetDirection(referenceImage->GetDirection());
+  field->Allocate();
+  return field;
+}
+
+//----------------------------------------------------------------------------
+long PlastimatchPyVectorFieldInverter::InvertBspline(const Bspline_xform* bsplineTransformation,
+  DeformationFieldType* inverseField, int maximumNumberOfIterations, float tolerance)
+{
+  BsplineForwardTransformation forwardTransformation;
+  forwardTransformation.Transformation = bsplineTransformation;
+  return InvertField(forwardTransformation, inverseField, maximumNumberOfIterations, tolerance);
+}
+
+//----------------------------------------------------------------------------
+long PlastimatchPyVectorFieldInverter::InvertVectorField(const DeformationFieldType* vectorField,
+  DeformationFieldType* inverseField, int maximumNumberOfIterations, float tolerance)
+{
+  VectorFieldForwardTransformation forwardTransformation;
+  forwardTransformation.Field = vectorField;
+  return InvertField(forwardTransformation, inverseField, maximumNumberOfIterations, tolerance);
+}
+
+//----------------------------------------------------------------------------
+void PlastimatchPyVectorFieldInverter::ComposeWithLinearTransformation(const double matrix[3][4],
+  const DeformationFieldType* field, DeformationFieldType* composedField)
+{
+  const DeformationFieldType::SizeType size = composedField->GetBufferedRegion().GetSize();
+  const DeformationFieldType::IndexType start = composedField->GetBufferedRegion().GetIndex();
+  DeformationFieldType::PixelType* buffer = composedField->GetBufferPointer();
+
+#pragma omp parallel for
+  for (long z=0; z < (long) size[2]; z++)
+    {
+    DeformationFieldType::IndexType index;
+    DeformationFieldType::PointType physicalPoint;
+    index[2] = start[2] + z;
+    for (long y=0; y < (long) size[1]; y++)
+      {
+      index[1] = start[1] + y;
+      for (long x=0; x < (long) size[0]; x++)
+        {
+        index[0] = start[0] + x;
+        composedField->TransformIndexToPhysicalPoint(index, physicalPoint);
+
+        float linearPoint[3];
+        for (int r=0; r < 3; r++)
+          {
+          linearPoint[r] = (float) (matrix[r][0] * physicalPoint[0] + matrix[r][1] * physicalPoint[1]
+            + matrix[r][2] * physicalPoint[2] + matrix[r][3]);
+          }
+        float displacement[3];
+        PlastimatchPyTransformEvaluator::EvaluateVectorField(field, linearPoint, displacement);
+
+        DeformationFieldType::PixelType& voxel = buffer[(z * size[1] + y) * size[0] + x];
+        for (int r=0; r < 3; r++)
+          {
+          voxel[r] = (float) (linearPoint[r] + displacement[r] - physicalPoint[r]);
+          }
+        }
+      }
+    }
+
+  composedField->Modified();
+}
@@ -0,0 +1,75 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+// .NAME PlastimatchPyVectorFieldInverter - computes the inverse of a registration result
+// .SECTION Description
+// Given a transformation T(x) = x + u(x), the inverse field w is the solution of
+// w(y) = -u(y + w(y)). It is computed voxel by voxel with a fixed-point iteration,
+// in parallel over the slices of the output grid.
+
+#ifndef __PlastimatchPyVectorFieldInverter_h
+#define __PlastimatchPyVectorFieldInverter_h
+
+// ITK includes
+#include "itkImage.h"
+
+// Plastimatch includes
+#include "bspline_xform.h"
+
+class PlastimatchPyVectorFieldInverter
+{
+public:
+  typedef itk::Image< float, 3 >  ImageType;
+  typedef itk::Vector< float, 3 >  VectorType;
+  typedef itk::Image< VectorType, 3 >  DeformationFieldType;
+
+  /// Create an empty vector field covering the same physical region of referenceImage,
+  /// with the voxel size multiplied by subsamplingFactor (1 keeps the reference grid).
+  static DeformationFieldType::Pointer AllocateField(
+    const ImageType* referenceImage, /*!< Image defining the geometry of the output field */
+    int subsamplingFactor            /*!< Integer subsampling factor of the output grid */
+    );
+
+  /// Invert a B-spline transformation on the grid of inverseField.
+  /// Returns the number of voxels that did not reach the tolerance within maximumNumberOfIterations.
+  static long InvertBspline(
+    const Bspline_xform* bsplineTransformation, /*!< Forward transformation as Bspline_xform pointer */
+    DeformationFieldType* inverseField,         /*!< Output inverse field, already allocated (\sa AllocateField) */
+    int maximumNumberOfIterations,              /*!< Maximum number of fixed-point iterations per voxel */
+    float tolerance                             /*!< Convergence tolerance (mm) */
+    );
+
+  /// Invert a dense vector field on the grid of inverseField.
+  /// Returns the number of voxels that did not reach the tolerance within maximumNumberOfIterations.
+  static long InvertVectorField(
+    const DeformationFieldType* vectorField, /*!< Forward transformation as DeformationFieldType pointer */
+    DeformationFieldType* inverseField,      /*!< Output inverse field, already allocated (\sa AllocateField) */
+    int maximumNumberOfIterations,           /*!< Maximum number of fixed-point iterations per voxel */
+    float tolerance                          /*!< Convergence tolerance (mm) */
+    );
+
+  /// Compose a linear transformation L with a vector field: composedField(z) = L(z) + field(L(z)) - z,
+  /// on the grid of composedField. Used to map through the inverse of an initial linear transformation
+  /// followed by an inverse field.
+  static void ComposeWithLinearTransformation(
+    const double matrix[3][4],            /*!< Linear part (3x3) and translation (last column) of L (LPS) */
+    const DeformationFieldType* field,    /*!< Vector field applied after L */
+    DeformationFieldType* composedField   /*!< Output field, already allocated (\sa AllocateField) */
+    );
+};
+
+#endif
@@ -0,0 +1,223 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+
+// PlastimatchPy Logic includes
+#include "PlastimatchPyCompactVectorField.h"
+
+// STD includes
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+//----------------------------------------------------------------------------
+namespace
+{
+  typedef PlastimatchPyCompactVectorField::DeformationFieldType DeformationFieldType;
+
+  //----------------------------------------------------------------------------
+  bool CheckHalf(float value, unsigned short expectedHalf)
+  {
+    const unsigned short half = PlastimatchPyCompactVectorField::FloatToHalf(value);
+    const float roundTrip = PlastimatchPyCompactVectorField::HalfToFloat(half);
+    if (half != expectedHalf || roundTrip != value)
+      {
+      std::cerr << "Invalid half float conversion of " << value << ": " << std::hex << half << std::dec
+        << " converted back to " << roundTrip << std::endl;
+      return false;
+      }
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  /// Field spanning several tiles along x and y, with partial tiles at the upper borders
+  DeformationFieldType::Pointer CreateField()
+  {
+    DeformationFieldType::Pointer vectorField = DeformationFieldType::New();
+    DeformationFieldType::SizeType size;
+    size[0] = 40;
+    size[1] = 35;
+    size[2] = 6;
+    DeformationFieldType::RegionType region;
+    region.SetSize(size);
+    vectorField->SetRegions(region);
+    DeformationFieldType::SpacingType spacing;
+    spacing[0] = 1.5;
+    spacing[1] = 1.5;
+    spacing[2] = 3.0;
+    vectorField->SetSpacing(spacing);
+    DeformationFieldType::PointType origin;
+    origin[0] = -30.0;
+    origin[1] = 12.0;
+    origin[2] = 100.0;
+    vectorField->SetOrigin(origin);
+    vectorField->Allocate();
+
+    DeformationFieldType::VectorType* buffer = vectorField->GetBufferPointer();
+    for (long z=0; z < (long) size[2]; z++)
+      {
+      for (long y=0; y < (long) size[1]; y++)
+        {
+        for (long x=0; x < (long) size[0]; x++)
+          {
+          DeformationFieldType::VectorType& vector = buffer[(z * size[1] + y) * size[0] + x];
+          vector[0] = (float) (5.0 * sin(x / 7.0));
+          vector[1] = (float) (0.1 * y - 1.0);
+          vector[2] = (float) (0.5 * z * cos(y / 5.0));
+          }
+        }
+      }
+    return vectorField;
+  }
+
+  //----------------------------------------------------------------------------
+  /// Compress and decompress the field, and check that each component is restored within its tolerance
+  bool CheckRoundTrip(const DeformationFieldType* vectorField, PlastimatchPyCompactVectorField::EncodingType encoding,
+    const float absoluteTolerance[3], float relativeTolerance)
+  {
+    PlastimatchPyCompactVectorField compactField;
+    if (!compactField.IsEmpty())
+      {
+      std::cerr << "Field is not empty before compression" << std::endl;
+      return false;
+      }
+    compactField.Compress(vectorField, encoding);
+    if (compactField.IsEmpty())
+      {
+      std::cerr << "Field is empty after compression" << std::endl;
+      return false;
+      }
+
+    const DeformationFieldType::SizeType size = vectorField->GetBufferedRegion().GetSize();
+    const long numberOfVoxels = (long) (size[0] * size[1] * size[2]);
+    if (compactField.GetMemorySize() >= (unsigned long long) numberOfVoxels * sizeof(DeformationFieldType::VectorType))
+      {
+      std::cerr << "Compressed field uses " << compactField.GetMemorySize() << " bytes, not less than the original field" << std::endl;
+      return false;
+      }
+
+    DeformationFieldType::Pointer decompressedField = compactField.Decompress();
+    if (decompressedField->GetBufferedRegion() != vectorField->GetBufferedRegion()
+      || decompressedField->GetOrigin() != vectorField->GetOrigin() || decompressedField->GetSpacing() != vectorField->GetSpacing())
+      {
+      std::cerr << "Geometry of the decompressed field differs from the original field" << std::endl;
+      return false;
+      }
+
+    const DeformationFieldType::VectorType* originalBuffer = vectorField->GetBufferPointer();
+    const DeformationFieldType::VectorType* decompressedBuffer = decompressedField->GetBufferPointer();
+    for (long z=0; z < (long) size[2]; z++)
+      {
+      for (long y=0; y < (long) size[1]; y++)
+        {
+        for (long x=0; x < (long) size[0]; x++)
+          {
+          const long voxelIndex = (z * size[1] + y) * size[0] + x;
+          float vector[3];
+          compactField.GetVector(x, y, z, vector);
+          for (int c=0; c < 3; c++)
+            {
+            const float original = originalBuffer[voxelIndex][c];
+            const float tolerance = absoluteTolerance[c] + relativeTolerance * (float) fabs(original);
+            if (fabs(decompressedBuffer[voxelIndex][c] - original) > tolerance || vector[c] != decompressedBuffer[voxelIndex][c])
+              {
+              std::cerr << "Invalid component " << c << " of voxel (" << x << ", " << y << ", " << z << "): decompressed "
+                << decompressedBuffer[voxelIndex][c] << ", read " << vector[c] << " (expected " << original << ")" << std::endl;
+              return false;
+              }
+            }
+          }
+        }
+      }
+
+    // Interpolation at a voxel center gives the stored vector
+    DeformationFieldType::IndexType index;
+    index[0] = 33;
+    index[1] = 17;
+    index[2] = 4;
+    DeformationFieldType::PointType physicalPoint;
+    vectorField->TransformIndexToPhysicalPoint(index, physicalPoint);
+    const float point[3] = { (float) physicalPoint[0], (float) physicalPoint[1], (float) physicalPoint[2] };
+    float displacement[3];
+    float vector[3];
+    compactField.GetVector(index[0], index[1], index[2], vector);
+    if (!compactField.EvaluateVectorField(point, displacement))
+      {
+      std::cerr << "Voxel center is reported outside of the compressed field" << std::endl;
+      return false;
+      }
+    for (int c=0; c < 3; c++)
+      {
+      if (fabs(displacement[c] - vector[c]) > 1e-4)
+        {
+        std::cerr << "Invalid interpolated component " << c << ": " << displacement[c] << " (expected " << vector[c] << ")" << std::endl;
+        return false;
+        }
+      }
+    return true;
+  }
+}
+
+//----------------------------------------------------------------------------
+int PlastimatchPyCompactVectorFieldTest1(int, char*[])
+{
+  bool success = true;
+
+  // Values exactly representable in half precision convert back without error
+  success &= CheckHalf(0.0f, 0x0000);
+  success &= CheckHalf(1.0f, 0x3C00);
+  success &= CheckHalf(-2.0f, 0xC000);
+  success &= CheckHalf(0.5f, 0x3800);
+  success &= CheckHalf(65504.0f, 0x7BFF);
+
+  DeformationFieldType::Pointer vectorField = CreateField();
+
+  // Half floats keep 11 significant bits: the relative error of the rounding is at most 2^-11
+  const float halfAbsoluteTolerance[3] = {1e-6f, 1e-6f, 1e-6f};
+  if (!CheckRoundTrip(vectorField, PlastimatchPyCompactVectorField::HalfFloat, halfAbsoluteTolerance, 1.0f / 2048.0f))
+    {
+    std::cerr << "Half float round trip failed" << std::endl;
+    success = false;
+    }
+
+  // Quantization rounds to the nearest of 256 levels between the minimum and the maximum of a tile,
+  // so the error is at most half a step of the range of the component over the whole field
+  float minimum[3] = {1e30f, 1e30f, 1e30f};
+  float maximum[3] = {-1e30f, -1e30f, -1e30f};
+  const DeformationFieldType::SizeType size = vectorField->GetBufferedRegion().GetSize();
+  const DeformationFieldType::VectorType* buffer = vectorField->GetBufferPointer();
+  for (long i=0; i < (long) (size[0] * size[1] * size[2]); i++)
+    {
+    for (int c=0; c < 3; c++)
+      {
+      minimum[c] = buffer[i][c] < minimum[c] ? buffer[i][c] : minimum[c];
+      maximum[c] = buffer[i][c] > maximum[c] ? buffer[i][c] : maximum[c];
+      }
+    }
+  float quantizedAbsoluteTolerance[3];
+  for (int c=0; c < 3; c++)
+    {
+    quantizedAbsoluteTolerance[c] = 1.01f * (maximum[c] - minimum[c]) / 510.0f + 1e-6f;
+    }
+  if (!CheckRoundTrip(vectorField, PlastimatchPyCompactVectorField::Quantized8Bit, quantizedAbsoluteTolerance, 0.0f))
+    {
+    std::cerr << "8 bit quantization round trip failed" << std::endl;
+    success = false;
+    }
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
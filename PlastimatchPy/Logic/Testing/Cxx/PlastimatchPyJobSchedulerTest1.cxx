@@ -0,0 +1,208 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+
+// PlastimatchPy Logic includes
+#include "PlastimatchPyJobScheduler.h"
+
+// ITK includes
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
+#include <itksys/SystemTools.hxx>
+
+// STD includes
+#include <cstdlib>
+#include <iostream>
+
+//----------------------------------------------------------------------------
+namespace
+{
+  /// Job run on a separate thread, so that the main thread can observe it waiting for admission
+  struct WaitingJob
+  {
+    unsigned long long PredictedMemory;
+    itk::SimpleFastMutexLock Mutex;
+    bool Admitted;
+    bool ReleaseRequested;
+  };
+
+  //----------------------------------------------------------------------------
+  bool GetAdmitted(WaitingJob* job)
+  {
+    job->Mutex.Lock();
+    bool admitted = job->Admitted;
+    job->Mutex.Unlock();
+    return admitted;
+  }
+
+  //----------------------------------------------------------------------------
+  ITK_THREAD_RETURN_TYPE RunWaitingJob(void* arg)
+  {
+    WaitingJob* job = static_cast<WaitingJob*>(static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg)->UserData);
+    PlastimatchPyJobScheduler* scheduler = PlastimatchPyJobScheduler::GetInstance();
+    const long jobId = scheduler->Admit(job->PredictedMemory);
+    job->Mutex.Lock();
+    job->Admitted = true;
+    job->Mutex.Unlock();
+
+    // Keep the job running until the main thread has checked the admitted memory
+    bool releaseRequested = false;
+    while (!releaseRequested)
+      {
+      itksys::SystemTools::Delay(1);
+      job->Mutex.Lock();
+      releaseRequested = job->ReleaseRequested;
+      job->Mutex.Unlock();
+      }
+    scheduler->Release(jobId, 7);
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+  //----------------------------------------------------------------------------
+  /// Poll a condition for up to 10 seconds
+  template <class TCondition>
+  bool WaitFor(TCondition condition)
+  {
+    for (int i=0; i < 1000; i++)
+      {
+      if (condition())
+        {
+        return true;
+        }
+      itksys::SystemTools::Delay(10);
+      }
+    return condition();
+  }
+
+  struct QueueDepthIsOne
+  {
+    bool operator()() const { return PlastimatchPyJobScheduler::GetInstance()->GetQueueDepth() == 1; }
+  };
+
+  struct JobIsAdmitted
+  {
+    WaitingJob* Job;
+    bool operator()() const { return GetAdmitted(this->Job); }
+  };
+}
+
+//----------------------------------------------------------------------------
+int PlastimatchPyJobSchedulerTest1(int, char*[])
+{
+  PlastimatchPyJobScheduler* scheduler = PlastimatchPyJobScheduler::GetInstance();
+  if (scheduler != PlastimatchPyJobScheduler::GetInstance())
+    {
+    std::cerr << "The scheduler is not shared" << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // Without budget every job is admitted at once
+  scheduler->SetMemoryBudget(0);
+  const long unlimitedJob1 = scheduler->Admit(1000000);
+  const long unlimitedJob2 = scheduler->Admit(2000000);
+  if (scheduler->GetNumberOfRunningJobs() != 2 || scheduler->GetAdmittedMemory() != 3000000)
+    {
+    std::cerr << "Jobs are not admitted without memory budget" << std::endl;
+    return EXIT_FAILURE;
+    }
+  scheduler->Release(unlimitedJob1, 10);
+  scheduler->Release(unlimitedJob2, 20);
+
+  // A job larger than the whole budget is admitted when nothing else runs
+  scheduler->SetMemoryBudget(100);
+  if (scheduler->GetMemoryBudget() != 100)
+    {
+    std::cerr << "Invalid memory budget: " << scheduler->GetMemoryBudget() << std::endl;
+    return EXIT_FAILURE;
+    }
+  const long largeJob = scheduler->Admit(500);
+  scheduler->Release(largeJob, 0);
+
+  // A job that does not fit next to the running one waits until it is released
+  const long runningJob = scheduler->Admit(60);
+  WaitingJob waitingJob;
+  waitingJob.PredictedMemory = 60;
+  waitingJob.Admitted = false;
+  waitingJob.ReleaseRequested = false;
+  itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+  const itk::ThreadIdType threadId = threader->SpawnThread(RunWaitingJob, &waitingJob);
+
+  bool success = true;
+  if (!WaitFor(QueueDepthIsOne()))
+    {
+    std::cerr << "The second job is not queued" << std::endl;
+    success = false;
+    }
+  if (GetAdmitted(&waitingJob) || scheduler->GetNumberOfRunningJobs() != 1 || scheduler->GetAdmittedMemory() != 60)
+    {
+    std::cerr << "The second job is admitted beyond the memory budget" << std::endl;
+    success = false;
+    }
+
+  scheduler->Release(runningJob, 0);
+  JobIsAdmitted jobIsAdmitted;
+  jobIsAdmitted.Job = &waitingJob;
+  if (!WaitFor(jobIsAdmitted))
+    {
+    std::cerr << "The second job is not admitted after the first one is released" << std::endl;
+    success = false;
+    }
+  if (scheduler->GetQueueDepth() != 0 || scheduler->GetNumberOfRunningJobs() != 1 || scheduler->GetAdmittedMemory() != 60)
+    {
+    std::cerr << "Invalid state after the second job is admitted" << std::endl;
+    success = false;
+    }
+
+  waitingJob.Mutex.Lock();
+  waitingJob.ReleaseRequested = true;
+  waitingJob.Mutex.Unlock();
+  // Nothing else runs, so the second job is admitted even if it was not yet, and the thread ends
+  threader->TerminateThread(threadId);
+
+  // Released jobs are accounted with their predicted memory and the measured process memory increase
+  if (scheduler->GetNumberOfRunningJobs() != 0 || scheduler->GetAdmittedMemory() != 0)
+    {
+    std::cerr << "Jobs are still running after their release" << std::endl;
+    success = false;
+    }
+  if (scheduler->GetNumberOfCompletedJobs() != 5)
+    {
+    std::cerr << "Invalid number of completed jobs: " << scheduler->GetNumberOfCompletedJobs() << std::endl;
+    success = false;
+    }
+  if (scheduler->GetTotalPredictedMemory() != 3000000 + 500 + 60 + 60)
+    {
+    std::cerr << "Invalid total predicted memory: " << scheduler->GetTotalPredictedMemory() << std::endl;
+    success = false;
+    }
+  if (scheduler->GetTotalProcessMemoryIncrease() != 10 + 20 + 7)
+    {
+    std::cerr << "Invalid total process memory increase: " << scheduler->GetTotalProcessMemoryIncrease() << std::endl;
+    success = false;
+    }
+
+  // Releasing an unknown job has no effect
+  scheduler->Release(12345, 1000);
+  if (scheduler->GetNumberOfCompletedJobs() != 5)
+    {
+    std::cerr << "Unknown job is counted as completed" << std::endl;
+    success = false;
+    }
+
+  scheduler->SetMemoryBudget(0);
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,189 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+
+// PlastimatchPy Logic includes
+#include "PlastimatchPyLabelFusion.h"
+
+// STD includes
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+//----------------------------------------------------------------------------
+namespace
+{
+  typedef PlastimatchPyLabelFusion::LabelImageType LabelImageType;
+  typedef PlastimatchPyLabelFusion::ImageType ImageType;
+
+  const long LabelImageSize[3] = {12, 12, 3};
+
+  //----------------------------------------------------------------------------
+  LabelImageType::Pointer CreateLabelImage(long sizeX)
+  {
+    LabelImageType::Pointer labelImage = LabelImageType::New();
+    LabelImageType::SizeType size;
+    size[0] = sizeX;
+    size[1] = LabelImageSize[1];
+    size[2] = LabelImageSize[2];
+    LabelImageType::RegionType region;
+    region.SetSize(size);
+    labelImage->SetRegions(region);
+    labelImage->Allocate();
+    labelImage->FillBuffer(0);
+    return labelImage;
+  }
+
+  //----------------------------------------------------------------------------
+  /// Labels 0, 1 and 2 in blocks of 4x4 voxels. Every seventh voxel gets the next label if noisy is set.
+  LabelImageType::Pointer CreateAtlas(bool noisy)
+  {
+    LabelImageType::Pointer labelImage = CreateLabelImage(LabelImageSize[0]);
+    short* buffer = labelImage->GetBufferPointer();
+    long voxelIndex = 0;
+    for (long z=0; z < LabelImageSize[2]; z++)
+      {
+      for (long y=0; y < LabelImageSize[1]; y++)
+        {
+        for (long x=0; x < LabelImageSize[0]; x++, voxelIndex++)
+          {
+          short label = (short) ((x / 4 + y / 4) % 3);
+          if (noisy && voxelIndex % 7 == 0)
+            {
+            label = (short) ((label + 1) % 3);
+            }
+          buffer[voxelIndex] = label;
+          }
+        }
+      }
+    return labelImage;
+  }
+
+  //----------------------------------------------------------------------------
+  bool CheckLabels(const LabelImageType* labels, const LabelImageType* expectedLabels, const char* name)
+  {
+    if (!labels)
+      {
+      std::cerr << "No " << name << " labelmap" << std::endl;
+      return false;
+      }
+    const long numberOfVoxels = LabelImageSize[0] * LabelImageSize[1] * LabelImageSize[2];
+    for (long i=0; i < numberOfVoxels; i++)
+      {
+      if (labels->GetBufferPointer()[i] != expectedLabels->GetBufferPointer()[i])
+        {
+        std::cerr << "Invalid " << name << " label at voxel " << i << ": " << labels->GetBufferPointer()[i]
+          << " (expected " << expectedLabels->GetBufferPointer()[i] << ")" << std::endl;
+        return false;
+        }
+      }
+    return true;
+  }
+}
+
+//----------------------------------------------------------------------------
+int PlastimatchPyLabelFusionTest1(int, char*[])
+{
+  bool success = true;
+
+  // Rounding of labels warped with nearest neighbor interpolation
+  ImageType::Pointer image = ImageType::New();
+  ImageType::SizeType imageSize;
+  imageSize[0] = 4;
+  imageSize[1] = 1;
+  imageSize[2] = 1;
+  ImageType::RegionType imageRegion;
+  imageRegion.SetSize(imageSize);
+  image->SetRegions(imageRegion);
+  image->Allocate();
+  const float values[4] = {1.4f, 1.6f, -0.6f, 40000.0f};
+  const short expectedRoundedLabels[4] = {1, 2, -1, 32767};
+  for (int i=0; i < 4; i++)
+    {
+    image->GetBufferPointer()[i] = values[i];
+    }
+  LabelImageType::Pointer roundedLabels = PlastimatchPyLabelFusion::ConvertToLabelImage(image);
+  for (int i=0; i < 4; i++)
+    {
+    if (roundedLabels->GetBufferPointer()[i] != expectedRoundedLabels[i])
+      {
+      std::cerr << "Invalid rounding of " << values[i] << ": " << roundedLabels->GetBufferPointer()[i] << std::endl;
+      success = false;
+      }
+    }
+
+  // Majority vote of two exact atlases and a noisy one gives the exact labels
+  LabelImageType::Pointer exactLabels = CreateAtlas(false);
+  std::vector<LabelImageType::Pointer> atlasLabels;
+  atlasLabels.push_back(CreateAtlas(false));
+  atlasLabels.push_back(CreateAtlas(true));
+  atlasLabels.push_back(CreateAtlas(false));
+  success &= CheckLabels(PlastimatchPyLabelFusion::FuseMajorityVote(atlasLabels), exactLabels, "majority vote");
+
+  // Ties are resolved in favor of the lowest label
+  std::vector<LabelImageType::Pointer> tiedAtlasLabels;
+  for (int k=0; k < 4; k++)
+    {
+    tiedAtlasLabels.push_back(CreateLabelImage(LabelImageSize[0]));
+    }
+  const short tiedVotes[2][4] = { {5, 2, 5, 2}, {7, 1, 7, 3} };
+  const short expectedTiedLabels[2] = {2, 7};
+  for (int k=0; k < 4; k++)
+    {
+    tiedAtlasLabels[k]->GetBufferPointer()[0] = tiedVotes[0][k];
+    tiedAtlasLabels[k]->GetBufferPointer()[1] = tiedVotes[1][k];
+    }
+  LabelImageType::Pointer tiedLabels = PlastimatchPyLabelFusion::FuseMajorityVote(tiedAtlasLabels);
+  if (!tiedLabels || tiedLabels->GetBufferPointer()[0] != expectedTiedLabels[0] || tiedLabels->GetBufferPointer()[1] != expectedTiedLabels[1]
+    || tiedLabels->GetBufferPointer()[2] != 0)
+    {
+    std::cerr << "Invalid majority vote of tied labels" << std::endl;
+    success = false;
+    }
+
+  // Labelmaps of different sizes are not fused
+  std::vector<LabelImageType::Pointer> mismatchedAtlasLabels(atlasLabels);
+  mismatchedAtlasLabels.push_back(CreateLabelImage(LabelImageSize[0] + 1));
+  int numberOfIterations = -1;
+  if (PlastimatchPyLabelFusion::FuseMajorityVote(mismatchedAtlasLabels)
+    || PlastimatchPyLabelFusion::FuseStaple(mismatchedAtlasLabels, 10, 1e-4, numberOfIterations))
+    {
+    std::cerr << "Labelmaps of different sizes are fused" << std::endl;
+    success = false;
+    }
+
+  // STAPLE of identical atlases takes the consensus without iterating
+  std::vector<LabelImageType::Pointer> identicalAtlasLabels;
+  identicalAtlasLabels.push_back(CreateAtlas(false));
+  identicalAtlasLabels.push_back(CreateAtlas(false));
+  success &= CheckLabels(PlastimatchPyLabelFusion::FuseStaple(identicalAtlasLabels, 10, 1e-4, numberOfIterations), exactLabels, "consensus STAPLE");
+  if (numberOfIterations != 0)
+    {
+    std::cerr << "STAPLE of identical atlases ran " << numberOfIterations << " iterations" << std::endl;
+    success = false;
+    }
+
+  // STAPLE estimates that the noisy atlas is the least reliable, and follows the exact ones
+  success &= CheckLabels(PlastimatchPyLabelFusion::FuseStaple(atlasLabels, 50, 1e-6, numberOfIterations), exactLabels, "STAPLE");
+  if (numberOfIterations < 1 || numberOfIterations > 50)
+    {
+    std::cerr << "Invalid number of STAPLE iterations: " << numberOfIterations << std::endl;
+    success = false;
+    }
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,207 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+
+// PlastimatchPy Logic includes
+#include "PlastimatchPyRegistrationMetrics.h"
+
+// STD includes
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+//----------------------------------------------------------------------------
+namespace
+{
+  typedef PlastimatchPyRegistrationMetrics::ImageType ImageType;
+  typedef PlastimatchPyRegistrationMetrics::DeformationFieldType DeformationFieldType;
+
+  const long ImageSize[3] = {8, 8, 4};
+
+  //----------------------------------------------------------------------------
+  bool CheckClose(double actual, double expected, double tolerance, const char* name)
+  {
+    if (fabs(actual - expected) > tolerance)
+      {
+      std::cerr << "Invalid " << name << ": " << actual << " (expected " << expected << ")" << std::endl;
+      return false;
+      }
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  /// Create an image of intensities a * f(x, y, z) + b, where f is 1 in the upper half of the given axis and 0 elsewhere
+  ImageType::Pointer CreateBinaryImage(int axis, float a, float b)
+  {
+    ImageType::Pointer image = ImageType::New();
+    ImageType::SizeType size;
+    for (int d=0; d < 3; d++)
+      {
+      size[d] = ImageSize[d];
+      }
+    ImageType::RegionType region;
+    region.SetSize(size);
+    image->SetRegions(region);
+    image->Allocate();
+
+    float* buffer = image->GetBufferPointer();
+    for (long z=0; z < ImageSize[2]; z++)
+      {
+      for (long y=0; y < ImageSize[1]; y++)
+        {
+        for (long x=0; x < ImageSize[0]; x++)
+          {
+          const long index[3] = {x, y, z};
+          const float f = (index[axis] >= ImageSize[axis] / 2) ? 1.0f : 0.0f;
+          buffer[(z * ImageSize[1] + y) * ImageSize[0] + x] = a * f + b;
+          }
+        }
+      }
+    return image;
+  }
+
+  //----------------------------------------------------------------------------
+  bool CheckSimilarity(const ImageType* fixedImage, const ImageType* warpedImage, double expectedMeanSquaredError,
+    double expectedNormalizedCrossCorrelation, double expectedMutualInformation, const char* name)
+  {
+    PlastimatchPyRegistrationMetrics::Result result;
+    PlastimatchPyRegistrationMetrics::ComputeVoxelMetrics(fixedImage, warpedImage, NULL, NULL, 2, 0.0f, 100.0f, result);
+    bool success = result.Valid;
+    success &= (result.NumberOfVoxels == ImageSize[0] * ImageSize[1] * ImageSize[2]);
+    success &= CheckClose(result.MeanSquaredError, expectedMeanSquaredError, 1e-6, "mean squared error");
+    success &= CheckClose(result.NormalizedCrossCorrelation, expectedNormalizedCrossCorrelation, 1e-6, "normalized cross correlation");
+    success &= CheckClose(result.MutualInformation, expectedMutualInformation, 1e-6, "mutual information");
+    if (!success)
+      {
+      std::cerr << "Similarity metrics of " << name << " images failed" << std::endl;
+      }
+    return success;
+  }
+}
+
+//----------------------------------------------------------------------------
+int PlastimatchPyRegistrationMetricsTest1(int, char*[])
+{
+  bool success = true;
+
+  // Half of the voxels are 0 and half are 100, so the entropy of each image is ln 2
+  const double ln2 = log(2.0);
+  ImageType::Pointer fixedImage = CreateBinaryImage(0, 100.0f, 0.0f);
+  success &= CheckSimilarity(fixedImage, fixedImage, 0.0, 1.0, ln2, "identical");
+  success &= CheckSimilarity(fixedImage, CreateBinaryImage(0, -100.0f, 100.0f), 10000.0, -1.0, ln2, "inverted");
+  success &= CheckSimilarity(fixedImage, CreateBinaryImage(0, 100.0f, 10.0f), 100.0, 1.0, ln2, "shifted");
+  // Splitting along another axis gives independent images
+  success &= CheckSimilarity(fixedImage, CreateBinaryImage(1, 100.0f, 0.0f), 5000.0, 0.0, 0.0, "independent");
+
+  // Images of different sizes are not compared
+  ImageType::Pointer smallImage = ImageType::New();
+  ImageType::SizeType smallSize;
+  smallSize.Fill(2);
+  ImageType::RegionType smallRegion;
+  smallRegion.SetSize(smallSize);
+  smallImage->SetRegions(smallRegion);
+  smallImage->Allocate();
+  smallImage->FillBuffer(0.0f);
+  PlastimatchPyRegistrationMetrics::Result mismatchResult;
+  PlastimatchPyRegistrationMetrics::ComputeVoxelMetrics(fixedImage, smallImage, NULL, NULL, 2, 0.0f, 100.0f, mismatchResult);
+  if (mismatchResult.Valid)
+    {
+    std::cerr << "Metrics of images of different sizes are reported valid" << std::endl;
+    success = false;
+    }
+
+  // The finite differences of a linear field u(x) = A x are exact, so the Jacobian determinant is det(I + A) everywhere
+  const float gradient[3][3] = { {0.2f, 0.0f, 0.0f}, {0.0f, 0.0f, 0.1f}, {0.0f, 0.0f, -0.5f} };
+  const double expectedJacobianDeterminant = 1.2 * 1.0 * 0.5;
+  DeformationFieldType::Pointer vectorField = DeformationFieldType::New();
+  vectorField->SetRegions(fixedImage->GetBufferedRegion());
+  ImageType::SpacingType spacing;
+  spacing[0] = 1.0;
+  spacing[1] = 2.0;
+  spacing[2] = 3.0;
+  vectorField->SetSpacing(spacing);
+  fixedImage->SetSpacing(spacing);
+  vectorField->Allocate();
+  DeformationFieldType::VectorType* fieldBuffer = vectorField->GetBufferPointer();
+  for (long z=0; z < ImageSize[2]; z++)
+    {
+    for (long y=0; y < ImageSize[1]; y++)
+      {
+      for (long x=0; x < ImageSize[0]; x++)
+        {
+        const double position[3] = {x * spacing[0], y * spacing[1], z * spacing[2]};
+        DeformationFieldType::VectorType& vector = fieldBuffer[(z * ImageSize[1] + y) * ImageSize[0] + x];
+        for (int c=0; c < 3; c++)
+          {
+          vector[c] = (float) (gradient[c][0] * position[0] + gradient[c][1] * position[1] + gradient[c][2] * position[2]);
+          }
+        }
+      }
+    }
+  PlastimatchPyRegistrationMetrics::Result jacobianResult;
+  PlastimatchPyRegistrationMetrics::ComputeVoxelMetrics(fixedImage, fixedImage, NULL, vectorField, 2, 0.0f, 100.0f, jacobianResult);
+  success &= jacobianResult.Valid;
+  success &= CheckClose(jacobianResult.JacobianDeterminantMinimum, expectedJacobianDeterminant, 1e-5, "minimum Jacobian determinant");
+  success &= CheckClose(jacobianResult.JacobianDeterminantMaximum, expectedJacobianDeterminant, 1e-5, "maximum Jacobian determinant");
+  success &= CheckClose(jacobianResult.JacobianDeterminantMean, expectedJacobianDeterminant, 1e-5, "mean Jacobian determinant");
+  success &= CheckClose(jacobianResult.JacobianDeterminantStandardDeviation, 0.0, 1e-3, "standard deviation of the Jacobian determinant");
+  success &= (jacobianResult.NumberOfFoldingVoxels == 0);
+
+  // Mirroring x folds every voxel
+  for (long i=0; i < ImageSize[0] * ImageSize[1] * ImageSize[2]; i++)
+    {
+    const long x = i % ImageSize[0];
+    fieldBuffer[i][0] = (float) (-2.0 * x * spacing[0]);
+    fieldBuffer[i][1] = 0.0f;
+    fieldBuffer[i][2] = 0.0f;
+    }
+  PlastimatchPyRegistrationMetrics::Result foldingResult;
+  PlastimatchPyRegistrationMetrics::ComputeVoxelMetrics(fixedImage, fixedImage, NULL, vectorField, 2, 0.0f, 100.0f, foldingResult);
+  success &= CheckClose(foldingResult.JacobianDeterminantMean, -1.0, 1e-5, "Jacobian determinant of a mirroring");
+  if (foldingResult.NumberOfFoldingVoxels != ImageSize[0] * ImageSize[1] * ImageSize[2])
+    {
+    std::cerr << "Invalid number of folding voxels: " << foldingResult.NumberOfFoldingVoxels << std::endl;
+    success = false;
+    }
+
+  // Target registration error of landmarks mapped by a translation field
+  for (long i=0; i < ImageSize[0] * ImageSize[1] * ImageSize[2]; i++)
+    {
+    fieldBuffer[i][0] = 1.0f;
+    fieldBuffer[i][1] = 2.0f;
+    fieldBuffer[i][2] = -1.0f;
+    }
+  Labeled_pointset fixedLandmarks;
+  Labeled_pointset movingLandmarks;
+  fixedLandmarks.insert_lps("a", 1.0f, 2.0f, 3.0f);
+  movingLandmarks.insert_lps("a", 2.0f, 4.0f, 2.0f);   // Exactly mapped
+  fixedLandmarks.insert_lps("b", 4.0f, 10.0f, 6.0f);
+  movingLandmarks.insert_lps("b", 8.0f, 16.0f, 5.0f);  // Mapped 3-4-0 mm off, error 5 mm
+  PlastimatchPyRegistrationMetrics::Result landmarkResult;
+  PlastimatchPyRegistrationMetrics::ComputeTargetRegistrationError(&fixedLandmarks, &movingLandmarks, NULL, vectorField, NULL, landmarkResult);
+  success &= (landmarkResult.NumberOfLandmarks == 2);
+  success &= CheckClose(landmarkResult.TargetRegistrationErrorMean, 2.5, 1e-5, "mean target registration error");
+  success &= CheckClose(landmarkResult.TargetRegistrationErrorMaximum, 5.0, 1e-5, "maximum target registration error");
+
+  // The pre-alignment is applied after the deformation: the translation moves the error from the second landmark to the first
+  const double translation[3][4] = { {1.0, 0.0, 0.0, 3.0}, {0.0, 1.0, 0.0, 4.0}, {0.0, 0.0, 1.0, 0.0} };
+  PlastimatchPyRegistrationMetrics::ComputeTargetRegistrationError(&fixedLandmarks, &movingLandmarks, NULL, vectorField, translation, landmarkResult);
+  success &= CheckClose(landmarkResult.TargetRegistrationErrorMean, 2.5, 1e-5, "mean target registration error after pre-alignment");
+  success &= CheckClose(landmarkResult.TargetRegistrationErrorMaximum, 5.0, 1e-5, "maximum target registration error after pre-alignment");
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,275 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+
+// PlastimatchPy Logic includes
+#include "PlastimatchPyTransformEvaluator.h"
+
+// STD includes
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+//----------------------------------------------------------------------------
+namespace
+{
+  typedef PlastimatchPyTransformEvaluator::DeformationFieldType DeformationFieldType;
+
+  /// Gradient of the linear displacement u(x) = A (x - origin) + b reproduced by the B-spline and the vector field
+  const float DisplacementGradient[3][3] = { {0.1f, 0.02f, 0.0f}, {0.0f, -0.05f, 0.0f}, {0.01f, 0.0f, 0.2f} };
+  const float DisplacementOffset[3] = {1.0f, 2.0f, -3.0f};
+
+  //----------------------------------------------------------------------------
+  void ComputeLinearDisplacement(const float origin[3], const float point[3], float displacement[3])
+  {
+    for (int c=0; c < 3; c++)
+      {
+      displacement[c] = DisplacementOffset[c];
+      for (int d=0; d < 3; d++)
+        {
+        displacement[c] += DisplacementGradient[c][d] * (point[d] - origin[d]);
+        }
+      }
+  }
+
+  //----------------------------------------------------------------------------
+  bool CheckClose(float actual, float expected, float tolerance, const char* name)
+  {
+    if (fabs(actual - expected) > tolerance)
+      {
+      std::cerr << "Invalid " << name << ": " << actual << " (expected " << expected << ")" << std::endl;
+      return false;
+      }
+    return true;
+  }
+
+  //----------------------------------------------------------------------------
+  /// Create a B-spline on a 16x16x8 voxel region with 4 voxels per region. Its control points are set to
+  /// the linear displacement at their position, which the cubic B-spline basis reproduces exactly.
+  Bspline_xform* CreateLinearBspline(const float origin[3], const float spacing[3])
+  {
+    Bspline_xform* bsplineTransformation = new Bspline_xform();
+    const long roiDimension[3] = {16, 16, 8};
+    for (int d=0; d < 3; d++)
+      {
+      bsplineTransformation->img_origin[d] = origin[d];
+      bsplineTransformation->img_spacing[d] = spacing[d];
+      bsplineTransformation->roi_offset[d] = 0;
+      bsplineTransformation->roi_dim[d] = roiDimension[d];
+      bsplineTransformation->vox_per_rgn[d] = 4;
+      bsplineTransformation->rdims[d] = roiDimension[d] / 4;
+      bsplineTransformation->cdims[d] = bsplineTransformation->rdims[d] + 3;
+      }
+    const long numberOfControlPoints = (long) (bsplineTransformation->cdims[0] * bsplineTransformation->cdims[1] * bsplineTransformation->cdims[2]);
+    bsplineTransformation->num_coeff = (int) (3 * numberOfControlPoints);
+    // Freed by the destructor of Bspline_xform
+    bsplineTransformation->coeff = (float*) malloc(3 * numberOfControlPoints * sizeof(float));
+
+    // The control point i of an axis lies (i-1) control point spacings from the origin of the region of interest
+    long controlPointIndex = 0;
+    for (long k=0; k < (long) bsplineTransformation->cdims[2]; k++)
+      {
+      for (long j=0; j < (long) bsplineTransformation->cdims[1]; j++)
+        {
+        for (long i=0; i < (long) bsplineTransformation->cdims[0]; i++, controlPointIndex++)
+          {
+          const long index[3] = {i, j, k};
+          float controlPointPosition[3];
+          for (int d=0; d < 3; d++)
+            {
+            controlPointPosition[d] = origin[d] + (index[d] - 1) * 4 * spacing[d];
+            }
+          ComputeLinearDisplacement(origin, controlPointPosition, bsplineTransformation->coeff + 3 * controlPointIndex);
+          }
+        }
+      }
+    return bsplineTransformation;
+  }
+}
+
+//----------------------------------------------------------------------------
+int PlastimatchPyTransformEvaluatorTest1(int, char*[])
+{
+  const float origin[3] = {10.0f, -20.0f, 5.0f};
+  const float spacing[3] = {2.0f, 2.0f, 3.0f};
+  const float tolerance = 1e-3f;
+
+  // The Jacobian of x + A x + b is det(I + A)
+  float expectedJacobianDeterminant = 0.0f;
+  {
+    const float m[3][3] = {
+      {1.0f + DisplacementGradient[0][0], DisplacementGradient[0][1], DisplacementGradient[0][2]},
+      {DisplacementGradient[1][0], 1.0f + DisplacementGradient[1][1], DisplacementGradient[1][2]},
+      {DisplacementGradient[2][0], DisplacementGradient[2][1], 1.0f + DisplacementGradient[2][2]} };
+    expectedJacobianDeterminant = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+      - m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+      + m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+  }
+
+  // Points inside the region of interest, including its corners and points between control points
+  const float relativePoints[5][3] = { {0.0f, 0.0f, 0.0f}, {30.0f, 30.0f, 21.0f}, {7.3f, 12.9f, 4.4f}, {16.0f, 3.5f, 11.99f}, {29.1f, 0.7f, 20.5f} };
+
+  // B-spline displacement and Jacobian determinant
+  Bspline_xform* bsplineTransformation = CreateLinearBspline(origin, spacing);
+  bool success = true;
+  for (int p=0; p < 5; p++)
+    {
+    float point[3];
+    for (int d=0; d < 3; d++)
+      {
+      point[d] = origin[d] + relativePoints[p][d];
+      }
+    float expectedDisplacement[3];
+    ComputeLinearDisplacement(origin, point, expectedDisplacement);
+
+    float displacement[3];
+    if (!PlastimatchPyTransformEvaluator::EvaluateBspline(bsplineTransformation, point, displacement))
+      {
+      std::cerr << "Point " << p << " is reported outside of the B-spline region" << std::endl;
+      success = false;
+      continue;
+      }
+    for (int c=0; c < 3; c++)
+      {
+      success &= CheckClose(displacement[c], expectedDisplacement[c], tolerance, "B-spline displacement");
+      }
+
+    float jacobianDeterminant = 0.0f;
+    if (!PlastimatchPyTransformEvaluator::EvaluateBsplineJacobianDeterminant(bsplineTransformation, point, jacobianDeterminant))
+      {
+      std::cerr << "Point " << p << " is reported outside of the B-spline region by the Jacobian" << std::endl;
+      success = false;
+      continue;
+      }
+    success &= CheckClose(jacobianDeterminant, expectedJacobianDeterminant, tolerance, "B-spline Jacobian determinant");
+    }
+
+  // Points outside of the region of interest give a zero displacement and an identity Jacobian
+  const float outsidePoint[3] = {origin[0] - 1.0f, origin[1] + 1.0f, origin[2] + 1.0f};
+  float outsideDisplacement[3] = {1.0f, 1.0f, 1.0f};
+  float outsideJacobianDeterminant = 0.0f;
+  if (PlastimatchPyTransformEvaluator::EvaluateBspline(bsplineTransformation, outsidePoint, outsideDisplacement)
+    || PlastimatchPyTransformEvaluator::EvaluateBsplineJacobianDeterminant(bsplineTransformation, outsidePoint, outsideJacobianDeterminant))
+    {
+    std::cerr << "Point outside of the B-spline region is reported inside" << std::endl;
+    success = false;
+    }
+  for (int c=0; c < 3; c++)
+    {
+    success &= CheckClose(outsideDisplacement[c], 0.0f, 0.0f, "B-spline displacement outside of the region");
+    }
+  success &= CheckClose(outsideJacobianDeterminant, 1.0f, 0.0f, "B-spline Jacobian determinant outside of the region");
+
+  // Transforming a point set gives the same result as the point by point evaluation
+  float inputPoints[15];
+  float outputPoints[15];
+  for (int p=0; p < 5; p++)
+    {
+    for (int d=0; d < 3; d++)
+      {
+      inputPoints[3*p+d] = origin[d] + relativePoints[p][d];
+      }
+    }
+  PlastimatchPyTransformEvaluator::TransformPointsWithBspline(bsplineTransformation, inputPoints, outputPoints, 5);
+  for (int p=0; p < 5; p++)
+    {
+    float expectedDisplacement[3];
+    ComputeLinearDisplacement(origin, inputPoints + 3*p, expectedDisplacement);
+    for (int d=0; d < 3; d++)
+      {
+      success &= CheckClose(outputPoints[3*p+d], inputPoints[3*p+d] + expectedDisplacement[d], tolerance, "B-spline transformed point");
+      }
+    }
+  delete bsplineTransformation;
+
+  // A linear vector field is reproduced exactly by the trilinear interpolation
+  DeformationFieldType::Pointer vectorField = DeformationFieldType::New();
+  DeformationFieldType::SizeType size;
+  size[0] = 16;
+  size[1] = 16;
+  size[2] = 8;
+  DeformationFieldType::RegionType region;
+  region.SetSize(size);
+  vectorField->SetRegions(region);
+  DeformationFieldType::PointType fieldOrigin;
+  DeformationFieldType::SpacingType fieldSpacing;
+  for (int d=0; d < 3; d++)
+    {
+    fieldOrigin[d] = origin[d];
+    fieldSpacing[d] = spacing[d];
+    }
+  vectorField->SetOrigin(fieldOrigin);
+  vectorField->SetSpacing(fieldSpacing);
+  vectorField->Allocate();
+  DeformationFieldType::VectorType* buffer = vectorField->GetBufferPointer();
+  for (long z=0; z < (long) size[2]; z++)
+    {
+    for (long y=0; y < (long) size[1]; y++)
+      {
+      for (long x=0; x < (long) size[0]; x++)
+        {
+        const float voxelPosition[3] = {origin[0] + x * spacing[0], origin[1] + y * spacing[1], origin[2] + z * spacing[2]};
+        float displacement[3];
+        ComputeLinearDisplacement(origin, voxelPosition, displacement);
+        DeformationFieldType::VectorType& vector = buffer[(z * size[1] + y) * size[0] + x];
+        vector[0] = displacement[0];
+        vector[1] = displacement[1];
+        vector[2] = displacement[2];
+        }
+      }
+    }
+  for (int p=0; p < 5; p++)
+    {
+    float point[3];
+    for (int d=0; d < 3; d++)
+      {
+      point[d] = origin[d] + relativePoints[p][d];
+      }
+    float expectedDisplacement[3];
+    ComputeLinearDisplacement(origin, point, expectedDisplacement);
+    float displacement[3];
+    if (!PlastimatchPyTransformEvaluator::EvaluateVectorField(vectorField, point, displacement))
+      {
+      std::cerr << "Point " << p << " is reported outside of the vector field" << std::endl;
+      success = false;
+      continue;
+      }
+    for (int c=0; c < 3; c++)
+      {
+      success &= CheckClose(displacement[c], expectedDisplacement[c], tolerance, "vector field displacement");
+      }
+    }
+  float fieldOutsideDisplacement[3];
+  if (PlastimatchPyTransformEvaluator::EvaluateVectorField(vectorField, outsidePoint, fieldOutsideDisplacement))
+    {
+    std::cerr << "Point outside of the vector field is reported inside" << std::endl;
+    success = false;
+    }
+
+  // Linear transformation of a point set
+  const double matrix[3][4] = { {0.0, -1.0, 0.0, 5.0}, {1.0, 0.0, 0.0, -2.0}, {0.0, 0.0, 2.0, 1.0} };
+  PlastimatchPyTransformEvaluator::TransformPointsWithLinearTransformation(matrix, inputPoints, outputPoints, 5);
+  for (int p=0; p < 5; p++)
+    {
+    const float* inputPoint = inputPoints + 3*p;
+    success &= CheckClose(outputPoints[3*p], -inputPoint[1] + 5.0f, tolerance, "linearly transformed point");
+    success &= CheckClose(outputPoints[3*p+1], inputPoint[0] - 2.0f, tolerance, "linearly transformed point");
+    success &= CheckClose(outputPoints[3*p+2], 2.0f * inputPoint[2] + 1.0f, tolerance, "linearly transformed point");
+    }
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
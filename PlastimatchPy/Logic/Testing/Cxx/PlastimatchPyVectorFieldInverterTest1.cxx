@@ -0,0 +1,186 @@
+/*==============================================================================
+
+  Program: 3D Slicer
+
+  Portions (c) Copyright Brigham and Women's Hospital (BWH) All Rights Reserved.
+
+  See COPYRIGHT.txt
+  or http://www.slicer.org/copyright/copyright.txt for details.
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+
+==============================================================================*/
+
+
+// PlastimatchPy Logic includes
+#include "PlastimatchPyTransformEvaluator.h"
+#include "PlastimatchPyVectorFieldInverter.h"
+
+// STD includes
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+//----------------------------------------------------------------------------
+namespace
+{
+  typedef PlastimatchPyVectorFieldInverter::ImageType ImageType;
+  typedef PlastimatchPyVectorFieldInverter::DeformationFieldType DeformationFieldType;
+
+  const double Pi = 3.14159265358979323846;
+  const long ReferenceSize = 24;
+
+  //----------------------------------------------------------------------------
+  /// Smooth forward field whose gradient is small enough for the fixed-point iteration to converge
+  DeformationFieldType::Pointer CreateForwardField(const ImageType* referenceImage)
+  {
+    DeformationFieldType::Pointer forwardField = PlastimatchPyVectorFieldInverter::AllocateField(referenceImage, 1);
+    DeformationFieldType::VectorType* buffer = forwardField->GetBufferPointer();
+    for (long z=0; z < ReferenceSize; z++)
+      {
+      for (long y=0; y < ReferenceSize; y++)
+        {
+        for (long x=0; x < ReferenceSize; x++)
+          {
+          DeformationFieldType::VectorType& vector = buffer[(z * ReferenceSize + y) * ReferenceSize + x];
+          vector[0] = (float) (0.6 * sin(2.0 * Pi * y / ReferenceSize));
+          vector[1] = (float) (0.5 * sin(2.0 * Pi * z / ReferenceSize));
+          vector[2] = (float) (0.4 * cos(2.0 * Pi * x / ReferenceSize));
+          }
+        }
+      }
+    return forwardField;
+  }
+
+  //----------------------------------------------------------------------------
+  /// Check that y + w(y) + u(y + w(y)) = y on the grid of the inverse field. The outer layer of voxels is skipped:
+  /// there the displaced point may leave the forward field, where the displacement drops to zero.
+  bool CheckComposition(const DeformationFieldType* forwardField, const DeformationFieldType* inverseField, float tolerance)
+  {
+    const DeformationFieldType::SizeType size = inverseField->GetBufferedRegion().GetSize();
+    const DeformationFieldType::VectorType* buffer = inverseField->GetBufferPointer();
+    float maximumError = 0.0f;
+    DeformationFieldType::IndexType index;
+    DeformationFieldType::PointType physicalPoint;
+    for (long z=1; z < (long) size[2] - 1; z++)
+      {
+      index[2] = z;
+      for (long y=1; y < (long) size[1] - 1; y++)
+        {
+        index[1] = y;
+        for (long x=1; x < (long) size[0] - 1; x++)
+          {
+          index[0] = x;
+          inverseField->TransformIndexToPhysicalPoint(index, physicalPoint);
+          const DeformationFieldType::VectorType& inverse = buffer[(z * size[1] + y) * size[0] + x];
+          const float displacedPoint[3] = { (float) physicalPoint[0] + inverse[0], (float) physicalPoint[1] + inverse[1],
+            (float) physicalPoint[2] + inverse[2] };
+          float forward[3];
+          if (!PlastimatchPyTransformEvaluator::EvaluateVectorField(forwardField, displacedPoint, forward))
+            {
+            // The displacements are smaller than the distance of the inner voxels to the border of the field
+            std::cerr << "Voxel (" << x << ", " << y << ", " << z << ") of the inverse field is mapped out of the forward field" << std::endl;
+            return false;
+            }
+          for (int c=0; c < 3; c++)
+            {
+            const float error = (float) fabs(inverse[c] + forward[c]);
+            maximumError = error > maximumError ? error : maximumError;
+            }
+          }
+        }
+      }
+
+    if (maximumError > tolerance)
+      {
+      std::cerr << "Composition of the inverse and the forward field differs from the identity by " << maximumError << " mm" << std::endl;
+      return false;
+      }
+    return true;
+  }
+}
+
+//----------------------------------------------------------------------------
+int PlastimatchPyVectorFieldInverterTest1(int, char*[])
+{
+  ImageType::Pointer referenceImage = ImageType::New();
+  ImageType::SizeType size;
+  size.Fill(ReferenceSize);
+  ImageType::RegionType region;
+  region.SetSize(size);
+  referenceImage->SetRegions(region);
+  ImageType::PointType origin;
+  origin[0] = -12.0;
+  origin[1] = 4.0;
+  origin[2] = 30.0;
+  referenceImage->SetOrigin(origin);
+
+  DeformationFieldType::Pointer forwardField = CreateForwardField(referenceImage);
+  bool success = true;
+
+  // The subsampled grid covers the reference region with voxels twice as large
+  DeformationFieldType::Pointer subsampledField = PlastimatchPyVectorFieldInverter::AllocateField(referenceImage, 2);
+  for (int d=0; d < 3; d++)
+    {
+    if (subsampledField->GetLargestPossibleRegion().GetSize()[d] != (unsigned long) (ReferenceSize / 2)
+      || fabs(subsampledField->GetSpacing()[d] - 2.0) > 1e-6 || fabs(subsampledField->GetOrigin()[d] - (origin[d] + 0.5)) > 1e-6)
+      {
+      std::cerr << "Invalid geometry of the subsampled field along axis " << d << std::endl;
+      success = false;
+      }
+    }
+
+  // Inverting on the reference grid and on the subsampled grid
+  const float tolerance = 1e-4f;
+  for (int subsamplingFactor=1; subsamplingFactor <= 2; subsamplingFactor++)
+    {
+    DeformationFieldType::Pointer inverseField = PlastimatchPyVectorFieldInverter::AllocateField(referenceImage, subsamplingFactor);
+    PlastimatchPyVectorFieldInverter::InvertVectorField(forwardField, inverseField, 50, tolerance);
+    if (!CheckComposition(forwardField, inverseField, tolerance))
+      {
+      std::cerr << "Inversion failed with subsampling factor " << subsamplingFactor << std::endl;
+      success = false;
+      }
+    }
+
+  // Composing a translation with the field: composed(z) = t + u(z + t)
+  const double matrix[3][4] = { {1.0, 0.0, 0.0, 1.0}, {0.0, 1.0, 0.0, -2.0}, {0.0, 0.0, 1.0, 0.5} };
+  DeformationFieldType::Pointer composedField = PlastimatchPyVectorFieldInverter::AllocateField(referenceImage, 1);
+  PlastimatchPyVectorFieldInverter::ComposeWithLinearTransformation(matrix, forwardField, composedField);
+  const DeformationFieldType::VectorType* composedBuffer = composedField->GetBufferPointer();
+  DeformationFieldType::IndexType index;
+  DeformationFieldType::PointType physicalPoint;
+  for (long z=0; z < ReferenceSize; z++)
+    {
+    index[2] = z;
+    for (long y=0; y < ReferenceSize; y++)
+      {
+      index[1] = y;
+      for (long x=0; x < ReferenceSize; x++)
+        {
+        index[0] = x;
+        composedField->TransformIndexToPhysicalPoint(index, physicalPoint);
+        const float translatedPoint[3] = { (float) (physicalPoint[0] + matrix[0][3]), (float) (physicalPoint[1] + matrix[1][3]),
+          (float) (physicalPoint[2] + matrix[2][3]) };
+        float displacement[3];
+        PlastimatchPyTransformEvaluator::EvaluateVectorField(forwardField, translatedPoint, displacement);
+        const DeformationFieldType::VectorType& composed = composedBuffer[(z * ReferenceSize + y) * ReferenceSize + x];
+        for (int c=0; c < 3; c++)
+          {
+          if (fabs(composed[c] - (matrix[c][3] + displacement[c])) > 1e-4)
+            {
+            std::cerr << "Invalid composed displacement at voxel (" << x << ", " << y << ", " << z << "): "
+              << composed[c] << " (expected " << matrix[c][3] + displacement[c] << ")" << std::endl;
+            return EXIT_FAILURE;
+            }
+          }
+        }
+      }
+    }
+
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -19,21 +19,34 @@
 
 // PlastimatchPy Logic includes
 #include "vtkSlicerPlastimatchPyModuleLogic.h"
+#include "PlastimatchPyCompactVectorField.h"
+#include "PlastimatchPyImagePyramid.h"
+#include "PlastimatchPyJobScheduler.h"
+#include "PlastimatchPyLabelFusion.h"
+#include "PlastimatchPyTransformEvaluator.h"
+#include "PlastimatchPyVectorFieldInverter.h"
 
 // MRML includes
 #include <vtkMRMLAnnotationFiducialNode.h>
 #include <vtkMRMLScalarVolumeNode.h>
 #include <vtkMRMLLinearTransformNode.h>
+#include <vtkMRMLVectorVolumeNode.h>
 
 // ITK includes
 #include <itkAffineTransform.h>
 #include <itkArray.h>
 #include <itkImageRegionIteratorWithIndex.h>
+#include <itkMutexLockHolder.h>
+#include <itkSimpleFastMutexLock.h>
 
 // VTK includes
+#include <vtkDataArray.h>
+#include <vtkImageData.h>
 #include <vtkNew.h>
 #include <vtkSmartPointer.h>
 #include <vtkMatrix4x4.h>
+#include <vtkPointData.h>
+#include <vtkPolyData.h>
 
 // Plastimatch includes
 #include "bspline_interpolate.h"
@@ -47,6 +60,101 @@
 #include "raw_pointset.h"
 #include "volume.h"
 
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace
+{
+  /// Lock serializing the scene accesses of the logic instances of the process. It is not recursive and it is
+  /// never held while nodes are modified or events are invoked, so that observers can call back into the logic.
+  /// It does not serialize against the main thread, that owns the scene: the scene is only accessed by the
+  /// functions documented to be called from the main thread (\sa PrepareRegistration, ApplyRegistrationResult).
+  itk::SimpleFastMutexLock SceneMutex;
+
+  /// Lock protecting the results of the logic instances waiting to be applied to the scene, that are written by
+  /// the thread running the registration and read by the main thread
+  itk::SimpleFastMutexLock PendingResultMutex;
+
+  /// Lock serializing the Plastimatch registration calls of the process, which are not known to be reentrant
+  /// (logging, static state of the optimizers). Warps, pyramid levels and fusion run concurrently.
+  itk::SimpleFastMutexLock PlastimatchRegistrationMutex;
+
+  /// Delete a registration data together with the images and landmarks it points to
+  void DeleteRegistrationData(Registration_data* registrationData)
+  {
+    if (!registrationData)
+      {
+      return;
+      }
+
+    // The images and landmarks are cleared once released, as the destructor of the registration data deletes them too
+    delete registrationData->fixed_image;
+    registrationData->fixed_image = NULL;
+    delete registrationData->moving_image;
+    registrationData->moving_image = NULL;
+    delete registrationData->fixed_landmarks;
+    registrationData->fixed_landmarks = NULL;
+    delete registrationData->moving_landmarks;
+    registrationData->moving_landmarks = NULL;
+
+    delete registrationData;
+  }
+
+  /// Get the coordinates of the fixed landmarks followed by the ones of the moving landmarks
+  void GetLandmarkCoordinates(const Registration_data* registrationData, std::vector<float>& coordinates)
+  {
+    coordinates.clear();
+    const Labeled_pointset* landmarks[2] = { registrationData->fixed_landmarks, registrationData->moving_landmarks };
+    for (int set=0; set < 2; set++)
+      {
+      if (!landmarks[set])
+        {
+        continue;
+        }
+      for (unsigned int i=0; i < landmarks[set]->point_list.size(); i++)
+        {
+        coordinates.insert(coordinates.end(), landmarks[set]->point_list[i].p, landmarks[set]->point_list[i].p + 3);
+        }
+      }
+  }
+
+  /// Get the linear part and the translation (LPS) of a linear Plastimatch transformation, or of its inverse.
+  /// Returns false if the inverse is requested and the transformation cannot be inverted.
+  bool GetLinearTransformationMatrix(Xform* linearTransformation, bool inverse, double matrix[3][4])
+  {
+    typedef itk::AffineTransform<double, 3> AffineTransformType;
+    AffineTransformType::Pointer affineTransformation = linearTransformation->get_aff();
+    if (inverse)
+      {
+      AffineTransformType::Pointer inverseTransformation = AffineTransformType::New();
+      if (!affineTransformation->GetInverse(inverseTransformation))
+        {
+        return false;
+        }
+      affineTransformation = inverseTransformation;
+      }
+
+    for (int row=0; row < 3; row++)
+      {
+      for (int column=0; column < 3; column++)
+        {
+        matrix[row][column] = affineTransformation->GetMatrix()[row][column];
+        }
+      matrix[row][3] = affineTransformation->GetOffset()[row];
+      }
+    return true;
+  }
+}
+
 //----------------------------------------------------------------------------
 vtkStandardNewMacro(vtkSlicerPlastimatchPyModuleLogic);
 
@@ -59,6 +167,7 @@ vtkSlicerPlastimatchPyModuleLogic::vtkSlicerPlastimatchPyModuleLogic()
   this->MovingLandmarksFileName = NULL;
   this->InitializationLinearTransformationID = NULL;
   this->OutputVolumeID = NULL;
+  this->PreviewVolumeID = NULL;
 
   this->FixedLandmarks = NULL;
   this->MovingLandmarks = NULL;
@@ -67,161 +176,1885 @@ vtkSlicerPlastimatchPyModuleLogic::vtkSlicerPlastimatchPyModuleLogic()
   vtkSmartPointer<vtkPoints> warpedLandmarks = vtkSmartPointer<vtkPoints>::New();
   this->SetWarpedLandmarks(warpedLandmarks);
 
+  this->MovingImageToFixedImageTransformation = NULL;
+  this->MovingImageToFixedImageVectorField = NULL;
+  this->CompactMovingImageToFixedImageVectorField = NULL;
+  this->VectorFieldStorageMode = VectorFieldStorageNone;
+
+  this->FixedImageToMovingImageVectorField = NULL;
+  this->InverseVectorFieldSubsamplingFactor = 1;
+  this->InverseVectorFieldMaximumNumberOfIterations = 20;
+  this->InverseVectorFieldTolerance = 0.01;
+
+  this->UseImagePyramid = false;
+  this->ImagePyramidMemoryBudget = 1024;
+  this->ImagePyramid = new PlastimatchPyImagePyramid();
+
+  this->ProgressivePreview = false;
+  this->PreviewSubsamplingFactor = 2;
+  this->AbortRegistration = false;
+
+  this->IncrementalRegistration = false;
+  this->IncrementalMaximumNumberOfIterations = 20;
+  this->LastRegistrationIncremental = false;
+  this->ConvertedFixedImage = NULL;
+  this->ConvertedMovingImage = NULL;
+  this->ConvertedMovingImageGrid = NULL;
+  this->InputImagesUnchanged = false;
+  this->LastRegistrationChangedInputs = 0;
+  this->InitializationLinearTransformation = NULL;
+
+  this->ComputeQualityMetrics = false;
+  this->MutualInformationNumberOfBins = 64;
+  this->MutualInformationIntensityRange[0] = -1200.0;
+  this->MutualInformationIntensityRange[1] = 3000.0;
+
+  this->AdaptiveConvergence = false;
+  this->ConvergenceCheckInterval = 10;
+  this->ConvergenceWindowSize = 30;
+  this->ConvergenceRelativeImprovement = 0.005;
+  this->NumberOfIterationsSaved = 0;
+
+  this->LastRegistrationPredictedMemory = 0;
+  this->LastRegistrationProcessMemoryIncrease = 0;
+  this->RegistrationStartMemory = 0;
+  this->RegistrationPeakMemory = 0;
+  this->RegistrationPrepared = false;
+  this->SceneUpdatesDeferred = false;
+  this->PendingWarpedImage = NULL;
+  this->PendingPreviewImage = NULL;
+
+  this->LabelFusionMethod = LabelFusionMajorityVote;
+  this->NumberOfConcurrentAtlasWarps = 0;
+  this->StapleMaximumNumberOfIterations = 30;
+  this->StapleTolerance = 1e-4;
+
+  this->RegistrationParameters = new Registration_parms();
+  this->RegistrationData = new Registration_data();
+}
+
+//----------------------------------------------------------------------------
+vtkSlicerPlastimatchPyModuleLogic::~vtkSlicerPlastimatchPyModuleLogic()
+{
+  this->SetFixedImageID(NULL);
+  this->SetMovingImageID(NULL);
+  this->SetFixedLandmarksFileName(NULL);
+  this->SetMovingLandmarksFileName(NULL);
+  this->SetInitializationLinearTransformationID(NULL);
+  this->SetOutputVolumeID(NULL);
+  this->SetPreviewVolumeID(NULL);
+
+  this->SetFixedLandmarks(NULL);
+  this->SetMovingLandmarks(NULL);
+  this->SetWarpedLandmarks(NULL);
+
+  if (this->MovingImageToFixedImageTransformation)
+    {
+    delete this->MovingImageToFixedImageTransformation;
+    this->MovingImageToFixedImageTransformation = NULL;
+    }
   this->MovingImageToFixedImageVectorField = NULL;
+  if (this->CompactMovingImageToFixedImageVectorField)
+    {
+    delete this->CompactMovingImageToFixedImageVectorField;
+    this->CompactMovingImageToFixedImageVectorField = NULL;
+    }
+  this->FixedImageToMovingImageVectorField = NULL;
+  this->ConvertedFixedImage = NULL;
+  this->ConvertedMovingImage = NULL;
+  this->ConvertedMovingImageGrid = NULL;
+  delete this->PendingWarpedImage;
+  this->PendingWarpedImage = NULL;
+  delete this->PendingPreviewImage;
+  this->PendingPreviewImage = NULL;
+
+  if (this->ImagePyramid)
+    {
+    delete this->ImagePyramid;
+    this->ImagePyramid = NULL;
+    }
+
+  if (this->InitializationLinearTransformation)
+    {
+    delete this->InitializationLinearTransformation;
+    this->InitializationLinearTransformation = NULL;
+    }
+  this->ReleaseRegistrationData();
+  if (this->RegistrationParameters)
+    {
+    delete this->RegistrationParameters;
+    this->RegistrationParameters = NULL;
+    }
+}
+
+//----------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::PrintSelf(ostream& os, vtkIndent indent)
+{
+  this->Superclass::PrintSelf(os, indent);
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::SetMRMLSceneInternal(vtkMRMLScene * newScene)
+{
+  vtkNew<vtkIntArray> events;
+  events->InsertNextValue(vtkMRMLScene::EndBatchProcessEvent);
+  this->SetAndObserveMRMLSceneEventsInternal(newScene, events.GetPointer());
+}
+
+//-----------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::RegisterNodes()
+{
+  if (!this->GetMRMLScene())
+    {
+    vtkErrorMacro("RegisterNodes: Invalid MRML Scene!");
+    return;
+    }
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::UpdateFromMRMLScene()
+{
+  if (!this->GetMRMLScene())
+    {
+    vtkErrorMacro("UpdateFromMRMLScene: Invalid MRML Scene!");
+    return;
+    }
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::AddStage()
+{
+  this->RegistrationParameters->append_stage();
+  this->StageParameters.push_back(StageParameterListType());
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::SetPar(char* key, char* value)
+{        
+  this->RegistrationParameters->set_key_val(key, value, 1);
+
+  // Keep track of the stage parameters, so that each stage can be run on its own
+  if (!this->StageParameters.empty() && key && value)
+    {
+    this->StageParameters.back().push_back(std::make_pair(std::string(key), std::string(value)));
+    }
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::ClearImagePyramid()
+{
+  this->ImagePyramid->Clear();
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::RunRegistration()
+{
+  // All the steps run on the calling thread, so the previews are applied to the scene as soon as they are computed
+  if (!this->PrepareRegistration())
+    {
+    return;
+    }
+  this->SceneUpdatesDeferred = false;
+  this->RunPreparedRegistration();
+  this->ApplyRegistrationResult();
+}
+
+//---------------------------------------------------------------------------
+bool vtkSlicerPlastimatchPyModuleLogic::PrepareRegistration()
+{
+  this->RegistrationPrepared = false;
+  if (!this->GetMRMLScene())
+    {
+    vtkErrorMacro("PrepareRegistration: Invalid MRML Scene!");
+    return false;
+    }
+
+  // The memory used by the imported images is part of the registration job, although they are
+  // imported before its admission: the admission may wait and must not block the main thread
+  this->RegistrationStartMemory = PlastimatchPyJobScheduler::GetProcessMemoryUsage();
+  this->RegistrationPeakMemory = this->RegistrationStartMemory;
+
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> sceneLock(SceneMutex);
+  this->LastRegistrationPredictedMemory = this->EstimateRegistrationMemory();
+  this->RegistrationPrepared = this->ImportRegistrationInputs();
+  return this->RegistrationPrepared;
+}
+
+//---------------------------------------------------------------------------
+bool vtkSlicerPlastimatchPyModuleLogic::ExecuteRegistration()
+{
+  // The previews are kept with the result until ApplyRegistrationResult() is called from the main thread
+  this->SceneUpdatesDeferred = true;
+  return this->RunPreparedRegistration();
+}
+
+//---------------------------------------------------------------------------
+bool vtkSlicerPlastimatchPyModuleLogic::RunPreparedRegistration()
+{
+  if (!this->RegistrationPrepared)
+    {
+    vtkErrorMacro("ExecuteRegistration: The inputs have not been imported, PrepareRegistration() must succeed first!");
+    return false;
+    }
+  this->RegistrationPrepared = false;
+
+  // The registration works on the buffers owned by this logic and does not access the scene
+  PlastimatchPyJobScheduler* scheduler = PlastimatchPyJobScheduler::GetInstance();
+  const long jobId = scheduler->Admit(this->LastRegistrationPredictedMemory);
+  Plm_image* warpedImage = this->ComputeRegistration();
+  this->SampleRegistrationMemory();
+
+  this->LastRegistrationProcessMemoryIncrease = this->RegistrationPeakMemory - this->RegistrationStartMemory;
+  scheduler->Release(jobId, this->LastRegistrationProcessMemoryIncrease);
+  vtkDebugMacro("ExecuteRegistration: Predicted memory " << this->GetPredictedRegistrationMemory()
+    << " MB, process memory increase " << this->GetRegistrationProcessMemoryIncrease() << " MB");
+
+  if (!warpedImage)
+    {
+    return false;
+    }
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> resultLock(PendingResultMutex);
+  delete this->PendingWarpedImage;
+  this->PendingWarpedImage = warpedImage;
+  return true;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::ApplyRegistrationResult()
+{
+  Plm_image* previewImage = NULL;
+  Plm_image* warpedImage = NULL;
+  {
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> resultLock(PendingResultMutex);
+  previewImage = this->PendingPreviewImage;
+  this->PendingPreviewImage = NULL;
+  warpedImage = this->PendingWarpedImage;
+  this->PendingWarpedImage = NULL;
+  }
+
+  if (previewImage)
+    {
+    this->SetImageInVolumeNode(previewImage, this->FixedImageID,
+      this->PreviewVolumeID ? this->PreviewVolumeID : this->OutputVolumeID);
+    delete previewImage;
+    }
+  if (warpedImage)
+    {
+    this->SetWarpedImageInVolumeNode(warpedImage);
+    delete warpedImage;
+    }
+}
+
+//---------------------------------------------------------------------------
+bool vtkSlicerPlastimatchPyModuleLogic::ImportRegistrationInputs()
+{
+  if (!this->GetMRMLScene())
+    {
+    vtkErrorMacro("ImportRegistrationInputs: Invalid MRML Scene!");
+    this->ClearRegistrationResult();
+    return false;
+    }
+
+  // Identify the image contents, so that converted and subsampled images can be reused by later registrations.
+  // The pre-aligned moving image is identified by the moving image and the values of the initial transformation.
+  const std::string fixedImageKey = this->GetVolumeNodeKey(this->FixedImageID);
+  const std::string movingImageNodeKey = this->GetVolumeNodeKey(this->MovingImageID);
+  const std::string initializationKey = this->GetLinearTransformationNodeKey(this->InitializationLinearTransformationID);
+
+  // Find out which inputs changed since the previous registration
+  int changedInputs = 0;
+  if (!this->ConvertedFixedImage || fixedImageKey != this->ConvertedFixedImageKey)
+    {
+    changedInputs |= FixedImageInput;
+    }
+  if (!this->ConvertedMovingImage || movingImageNodeKey + "|" + this->ConvertedInitializationKey != this->ConvertedMovingImageKey)
+    {
+    changedInputs |= MovingImageInput;
+    }
+  if (initializationKey != this->ConvertedInitializationKey)
+    {
+    changedInputs |= InitializationInput;
+    }
+  const bool inputImagesUnchanged = !(changedInputs & (FixedImageInput | MovingImageInput | InitializationInput));
+
+  // All the inputs are read into a new registration data first. The data of the previous registration
+  // is only replaced once everything has been read, so that a failure cannot mix old and new inputs.
+  Registration_data* registrationData = new Registration_data();
+
+  // Set input images
+  if (inputImagesUnchanged)
+    {
+    // Reuse the images converted (and pre-aligned) by the previous registration
+    registrationData->fixed_image = new Plm_image(this->ConvertedFixedImage);
+    registrationData->moving_image = new Plm_image(this->ConvertedMovingImage);
+    }
+  else
+    {
+    vtkMRMLVolumeNode* fixedVtkImage = vtkMRMLVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(this->FixedImageID));
+    vtkMRMLVolumeNode* movingVtkImage = vtkMRMLVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(this->MovingImageID));
+    if (!fixedVtkImage || !movingVtkImage)
+      {
+      vtkErrorMacro("ImportRegistrationInputs: Nodes containing the fixed and moving images cannot be retrieved!");
+      DeleteRegistrationData(registrationData);
+      this->ClearRegistrationResult();
+      return false;
+      }
+
+    itk::Image<float, 3>::Pointer fixedItkImage = itk::Image<float, 3>::New();
+    SlicerRtCommon::ConvertVolumeNodeToItkImageInLPS<float>(fixedVtkImage, fixedItkImage);
+    itk::Image<float, 3>::Pointer movingItkImage = itk::Image<float, 3>::New();
+    SlicerRtCommon::ConvertVolumeNodeToItkImageInLPS<float>(movingVtkImage, movingItkImage);
+
+    registrationData->fixed_image = new Plm_image(fixedItkImage);
+    registrationData->moving_image = new Plm_image(movingItkImage);
+    }
+
+  this->SampleRegistrationMemory();
+  
+  // Set landmarks 
+  bool landmarksImported = false;
+  if (this->FixedLandmarks && this->MovingLandmarks)
+    {
+    // From Slicer
+    landmarksImported = this->SetLandmarksFromSlicer(registrationData);
+    }
+  else if (this->FixedLandmarksFileName && this->MovingLandmarksFileName)
+    {
+    // From Files
+    landmarksImported = this->SetLandmarksFromFiles(registrationData);
+    }
+  else
+    {
+    vtkErrorMacro("RunRegistration: Unable to retrieve fixed and moving landmarks!");
+    }
+
+  // The initial transformation is read now and kept with the result. It is applied to the moving image
+  // by the registration, unless the pre-aligned image of the previous registration is reused.
+  Xform* initializationTransformation = NULL;
+  if (landmarksImported && this->InitializationLinearTransformationID)
+    {
+    initializationTransformation = this->ImportInitialLinearTransformation();
+    }
+  if (!landmarksImported || (this->InitializationLinearTransformationID && !initializationTransformation))
+    {
+    DeleteRegistrationData(registrationData);
+    this->ClearRegistrationResult();
+    return false;
+    }
+
+  std::vector<float> landmarkCoordinates;
+  GetLandmarkCoordinates(registrationData, landmarkCoordinates);
+  if (landmarkCoordinates != this->PreviousLandmarkCoordinates)
+    {
+    changedInputs |= LandmarksInput;
+    }
+
+  // Replace the inputs of the previous registration, its converted images stay cached
+  this->ReleaseRegistrationData();
+  this->RegistrationData = registrationData;
+  if (this->InitializationLinearTransformation)
+    {
+    delete this->InitializationLinearTransformation;
+    }
+  this->InitializationLinearTransformation = initializationTransformation;
+  this->FixedImageKey = fixedImageKey;
+  this->InitializationKey = initializationKey;
+  this->MovingImageKey = movingImageNodeKey + "|" + initializationKey;
+  this->LastRegistrationChangedInputs = changedInputs;
+  this->InputImagesUnchanged = inputImagesUnchanged;
+
+  return true;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::ClearRegistrationResult()
+{
+  // Without valid inputs, the previous result cannot be paired with the current images and landmarks
+  this->ReleaseRegistrationData();
+  if (this->MovingImageToFixedImageTransformation)
+    {
+    delete this->MovingImageToFixedImageTransformation;
+    this->MovingImageToFixedImageTransformation = NULL;
+    }
+  this->StoreMovingImageToFixedImageVectorField(NULL);
+  this->FixedImageToMovingImageVectorField = NULL;
+  if (this->InitializationLinearTransformation)
+    {
+    delete this->InitializationLinearTransformation;
+    this->InitializationLinearTransformation = NULL;
+    }
+  this->RegistrationQualityMetrics = PlastimatchPyRegistrationMetrics::Result();
+}
+
+//---------------------------------------------------------------------------
+Plm_image* vtkSlicerPlastimatchPyModuleLogic::ComputeRegistration()
+{
+  // The grid of the moving image is kept before the pre-alignment, the inverse is mapped back onto it
+  if (!this->InputImagesUnchanged)
+    {
+    itk::Image<float, 3>::Pointer movingImage = this->RegistrationData->moving_image->itk_float();
+    this->ConvertedMovingImageGrid = itk::Image<float, 3>::New();
+    this->ConvertedMovingImageGrid->CopyInformation(movingImage);
+    this->ConvertedMovingImageGrid->SetRegions(movingImage->GetLargestPossibleRegion());
+    }
+
+  // Set initial affine transformation
+  if (this->InitializationLinearTransformation && !this->InputImagesUnchanged)
+    {
+    this->ApplyInitialLinearTransformation(this->InitializationLinearTransformation);
+    this->SampleRegistrationMemory();
+    } 
+
+  this->ConvertedFixedImage = this->RegistrationData->fixed_image->itk_float();
+  this->ConvertedMovingImage = this->RegistrationData->moving_image->itk_float();
+  this->ConvertedFixedImageKey = this->FixedImageKey;
+  this->ConvertedMovingImageKey = this->MovingImageKey;
+  this->ConvertedInitializationKey = this->InitializationKey;
+
+  // If only the landmarks changed, restart from the previous result
+  if (this->StageParameters != this->PreviousStageParameters)
+    {
+    this->LastRegistrationChangedInputs |= StagesInput;
+    }
+  int incrementalStageIndex = -1;
+  if (this->IncrementalRegistration && this->MovingImageToFixedImageTransformation
+    && (this->LastRegistrationChangedInputs & ~LandmarksInput) == 0)
+    {
+    incrementalStageIndex = this->GetLastDeformableStageIndex();
+    }
+  this->PreviousStageParameters = this->StageParameters;
+  GetLandmarkCoordinates(this->RegistrationData, this->PreviousLandmarkCoordinates);
+
+  // Run registration and warp image
+  Xform* previousTransformation = this->MovingImageToFixedImageTransformation;
+  this->MovingImageToFixedImageTransformation = NULL;
+  this->StoreMovingImageToFixedImageVectorField(NULL);
+  this->FixedImageToMovingImageVectorField = NULL;
+  this->RegistrationQualityMetrics = PlastimatchPyRegistrationMetrics::Result();
+  this->LastRegistrationIncremental = (incrementalStageIndex >= 0);
+  this->AbortRegistration = false;
+  this->NumberOfIterationsSaved = 0;
+  this->StageNumberOfIterations.clear();
+  if (this->LastRegistrationIncremental)
+    {
+    std::ostringstream maximumNumberOfIterations;
+    maximumNumberOfIterations << this->IncrementalMaximumNumberOfIterations;
+    StageParameterListType incrementalParameters;
+    incrementalParameters.push_back(std::make_pair(std::string("max_its"), maximumNumberOfIterations.str()));
+    this->MovingImageToFixedImageTransformation =
+      this->RunStageWithIndex(incrementalStageIndex, incrementalParameters, previousTransformation);
+    }
+  else if (this->UseImagePyramid || this->ProgressivePreview || this->AdaptiveConvergence)
+    {
+    this->RunStages();
+    }
+  else
+    {
+    itk::MutexLockHolder<itk::SimpleFastMutexLock> registrationLock(PlastimatchRegistrationMutex);
+    do_registration_pure(&this->MovingImageToFixedImageTransformation, this->RegistrationData ,this->RegistrationParameters);
+    }
+  if (previousTransformation)
+    {
+    delete previousTransformation;
+    }
+  if (this->AbortRegistration)
+    {
+    vtkWarningMacro("RunRegistration: Registration aborted, the full resolution warp is skipped!");
+    return NULL;
+    }
+
+  // The dense vector field is only requested from the warp if it is kept, or needed by the metrics.
+  // The compact field of a B-spline result is generated tile by tile from the coefficients instead.
+  const bool bsplineResult = this->MovingImageToFixedImageTransformation
+    && this->MovingImageToFixedImageTransformation->m_type == XFORM_GPUIT_BSPLINE;
+  const bool compactStorage = this->VectorFieldStorageMode == VectorFieldStorageHalfFloat
+    || this->VectorFieldStorageMode == VectorFieldStorageQuantized;
+  const bool vectorFieldNeeded = this->VectorFieldStorageMode == VectorFieldStorageFloat
+    || (compactStorage && !bsplineResult) || (this->ComputeQualityMetrics && !bsplineResult);
+
+  Plm_image* warpedImage = new Plm_image();
+  DeformationFieldType::Pointer vectorField = NULL;
+  this->ApplyWarp(warpedImage, vectorFieldNeeded ? &vectorField : NULL, this->MovingImageToFixedImageTransformation,
+    this->RegistrationData->fixed_image, this->RegistrationData->moving_image, -1200, 0, 1);
+
+  this->SampleRegistrationMemory();
+
+  if (this->ComputeQualityMetrics)
+    {
+    this->ComputeRegistrationQualityMetrics(warpedImage, vectorField);
+    }
+  if (compactStorage && bsplineResult)
+    {
+    this->StoreMovingImageToFixedImageBspline();
+    }
+  else
+    {
+    this->StoreMovingImageToFixedImageVectorField(vectorField);
+    }
+  vectorField = NULL;
+
+  return warpedImage;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::ReleaseRegistrationData()
+{
+  DeleteRegistrationData(this->RegistrationData);
+  this->RegistrationData = NULL;
+}
+
+//---------------------------------------------------------------------------
+unsigned long long vtkSlicerPlastimatchPyModuleLogic::EstimateRegistrationMemory()
+{
+  const unsigned long long numberOfFixedVoxels = this->GetVolumeNodeNumberOfVoxels(this->FixedImageID);
+  const unsigned long long numberOfMovingVoxels = this->GetVolumeNodeNumberOfVoxels(this->MovingImageID);
+
+  // Converted fixed and moving images, and pre-aligned moving image resampled on the fixed grid
+  unsigned long long memory = (numberOfFixedVoxels + numberOfMovingVoxels) * sizeof(float);
+  if (this->InitializationLinearTransformationID)
+    {
+    memory += numberOfFixedVoxels * sizeof(float);
+    }
+
+  // Stages run one at a time; the pyramid keeps all their levels
+  unsigned long long stageMemory = 0;
+  for (unsigned int stageIndex=0; stageIndex < this->StageParameters.size(); stageIndex++)
+    {
+    stageMemory = std::max(stageMemory,
+      EstimateStageMemory(this->StageParameters[stageIndex], numberOfFixedVoxels, numberOfMovingVoxels));
+    int subsampling[3] = {1, 1, 1};
+    if (this->UseImagePyramid && GetStageSubsampling(this->StageParameters[stageIndex], subsampling))
+      {
+      memory += (numberOfFixedVoxels + numberOfMovingVoxels) * sizeof(float) / (subsampling[0] * subsampling[1] * subsampling[2]);
+      }
+    }
+  memory += stageMemory;
+
+  // Warped image and its copy in the output node
+  memory += 2 * numberOfFixedVoxels * sizeof(float);
+
+  // Dense vector field of the final warp, requested if it is kept or needed by the metrics of a non B-spline result
+  const bool bsplineResult = !this->StageParameters.empty()
+    && GetStageParameter(this->StageParameters.back(), "xform", "") == "bspline";
+  if (this->VectorFieldStorageMode != VectorFieldStorageNone || (this->ComputeQualityMetrics && !bsplineResult))
+    {
+    memory += numberOfFixedVoxels * sizeof(VectorType);
+    }
+  if (this->VectorFieldStorageMode == VectorFieldStorageHalfFloat)
+    {
+    memory += numberOfFixedVoxels * 3 * sizeof(unsigned short);
+    }
+  else if (this->VectorFieldStorageMode == VectorFieldStorageQuantized)
+    {
+    memory += numberOfFixedVoxels * 3 * sizeof(unsigned char);
+    }
+
+  return memory;
+}
+
+//---------------------------------------------------------------------------
+unsigned long long vtkSlicerPlastimatchPyModuleLogic::EstimateStageMemory(const StageParameterListType& stageParameters,
+  unsigned long long numberOfFixedVoxels, unsigned long long numberOfMovingVoxels)
+{
+  int subsampling[3] = {1, 1, 1};
+  GetStageSubsampling(stageParameters, subsampling);
+  const unsigned long long subsamplingFactor = (unsigned long long) subsampling[0] * subsampling[1] * subsampling[2];
+  const unsigned long long numberOfStageFixedVoxels = numberOfFixedVoxels / subsamplingFactor;
+  const unsigned long long numberOfStageMovingVoxels = numberOfMovingVoxels / subsamplingFactor;
+
+  // Subsampled images
+  unsigned long long memory = (numberOfStageFixedVoxels + numberOfStageMovingVoxels) * sizeof(float);
+
+  const std::string transformationType = GetStageParameter(stageParameters, "xform", "");
+  if (transformationType == "bspline")
+    {
+    // Moving image gradient and per-voxel derivatives of the metric
+    memory += (numberOfStageFixedVoxels + numberOfStageMovingVoxels) * sizeof(VectorType);
+    }
+  else if (transformationType == "vf")
+    {
+    // Demons field, its update and its smoothing buffer
+    memory += 3 * numberOfStageFixedVoxels * sizeof(VectorType);
+    }
+  else
+    {
+    // Linear transformations: resampled moving image of the ITK metric
+    memory += numberOfStageFixedVoxels * sizeof(float);
+    }
+
+  return memory;
+}
+
+//---------------------------------------------------------------------------
+unsigned long long vtkSlicerPlastimatchPyModuleLogic::GetVolumeNodeNumberOfVoxels(const char* volumeID)
+{
+  vtkMRMLVolumeNode* volumeNode = vtkMRMLVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(volumeID));
+  if (!volumeNode || !volumeNode->GetImageData())
+    {
+    return 0;
+    }
+  int dimensions[3] = {0, 0, 0};
+  volumeNode->GetImageData()->GetDimensions(dimensions);
+  return (unsigned long long) dimensions[0] * dimensions[1] * dimensions[2];
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::SampleRegistrationMemory()
+{
+  this->RegistrationPeakMemory = std::max(this->RegistrationPeakMemory, PlastimatchPyJobScheduler::GetProcessMemoryUsage());
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::SetJobMemoryBudget(int memoryBudget)
+{
+  PlastimatchPyJobScheduler::GetInstance()->SetMemoryBudget(
+    memoryBudget > 0 ? (unsigned long long) memoryBudget * 1024 * 1024 : 0);
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerPlastimatchPyModuleLogic::GetJobMemoryBudget()
+{
+  return (int) (PlastimatchPyJobScheduler::GetInstance()->GetMemoryBudget() / (1024 * 1024));
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerPlastimatchPyModuleLogic::GetJobQueueDepth()
+{
+  return PlastimatchPyJobScheduler::GetInstance()->GetQueueDepth();
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerPlastimatchPyModuleLogic::GetNumberOfRunningJobs()
+{
+  return PlastimatchPyJobScheduler::GetInstance()->GetNumberOfRunningJobs();
+}
+
+//---------------------------------------------------------------------------
+double vtkSlicerPlastimatchPyModuleLogic::GetAdmittedJobMemory()
+{
+  return (double) PlastimatchPyJobScheduler::GetInstance()->GetAdmittedMemory() / (1024.0 * 1024.0);
+}
+
+//---------------------------------------------------------------------------
+double vtkSlicerPlastimatchPyModuleLogic::GetTotalPredictedJobMemory()
+{
+  return (double) PlastimatchPyJobScheduler::GetInstance()->GetTotalPredictedMemory() / (1024.0 * 1024.0);
+}
+
+//---------------------------------------------------------------------------
+double vtkSlicerPlastimatchPyModuleLogic::GetTotalJobProcessMemoryIncrease()
+{
+  return (double) PlastimatchPyJobScheduler::GetInstance()->GetTotalProcessMemoryIncrease() / (1024.0 * 1024.0);
+}
+
+//---------------------------------------------------------------------------
+double vtkSlicerPlastimatchPyModuleLogic::GetEstimatedRegistrationMemory()
+{
+  if (!this->GetMRMLScene())
+    {
+    vtkErrorMacro("GetEstimatedRegistrationMemory: Invalid MRML Scene!");
+    return 0.0;
+    }
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> sceneLock(SceneMutex);
+  return (double) this->EstimateRegistrationMemory() / (1024.0 * 1024.0);
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::RunStages()
+{
+  itk::Image<float, 3>::Pointer fixedItkImage = this->RegistrationData->fixed_image->itk_float();
+  itk::Image<float, 3>::Pointer movingItkImage = this->RegistrationData->moving_image->itk_float();
+
+  // Build all the resolution levels needed by the stages at once, in parallel
+  std::vector<PlastimatchPyImagePyramid::LevelRequest> levelRequests;
+  for (unsigned int stageIndex=0; this->UseImagePyramid && stageIndex < this->StageParameters.size(); stageIndex++)
+    {
+    PlastimatchPyImagePyramid::LevelRequest fixedLevelRequest;
+    if (!GetStageSubsampling(this->StageParameters[stageIndex], fixedLevelRequest.Subsampling))
+      {
+      continue;
+      }
+    vtkDebugMacro("RunStages: Subsampling (res " << fixedLevelRequest.Subsampling[0] << " " << fixedLevelRequest.Subsampling[1]
+      << " " << fixedLevelRequest.Subsampling[2] << ") of stage " << stageIndex
+      << " is done by the image pyramid with anti-aliasing, Plastimatch runs the stage with res 1 1 1");
+    PlastimatchPyImagePyramid::LevelRequest movingLevelRequest = fixedLevelRequest;
+    fixedLevelRequest.ImageKey = this->FixedImageKey;
+    fixedLevelRequest.Image = fixedItkImage;
+    movingLevelRequest.ImageKey = this->MovingImageKey;
+    movingLevelRequest.Image = movingItkImage;
+    levelRequests.push_back(fixedLevelRequest);
+    levelRequests.push_back(movingLevelRequest);
+    }
+  this->ImagePyramid->SetMemoryBudget((unsigned long long) this->ImagePyramidMemoryBudget * 1024 * 1024);
+  this->ImagePyramid->BuildLevels(levelRequests);
+
+  // The metric of the adaptive convergence is evaluated on the images of the stage, so it needs them cached
+  const bool adaptiveConvergence = this->AdaptiveConvergence && this->UseImagePyramid;
+  if (this->AdaptiveConvergence && !this->UseImagePyramid)
+    {
+    vtkWarningMacro("RunStages: Adaptive convergence needs the image pyramid (UseImagePyramid), stages are run with their configured iterations!");
+    }
+
+  // Run the stages one by one, each one initialized by the result of the previous one
+  const StageParameterListType noParameters;
+  Xform* transformation = NULL;
+  int carriedNumberOfIterations = 0;
+  int totalConfiguredNumberOfIterations = 0;
+  int totalNumberOfIterations = 0;
+  for (unsigned int stageIndex=0; stageIndex < this->StageParameters.size(); stageIndex++)
+    {
+    Xform* stageTransformation = NULL;
+    if (adaptiveConvergence)
+      {
+      // Iterations left by the previous stage are only given to a finer stage of the same transformation type
+      if (stageIndex > 0 && !IsFinerStageOfSameType(this->StageParameters[stageIndex - 1], this->StageParameters[stageIndex]))
+        {
+        carriedNumberOfIterations = 0;
+        }
+      const int configuredNumberOfIterations =
+        atoi(GetStageParameter(this->StageParameters[stageIndex], "max_its", "25").c_str());
+      const int stageMaximumNumberOfIterations = configuredNumberOfIterations + carriedNumberOfIterations;
+      int stageNumberOfIterations = 0;
+      stageTransformation = this->RunStageWithConvergenceMonitoring(stageIndex,
+        stageMaximumNumberOfIterations, transformation, stageNumberOfIterations);
+      carriedNumberOfIterations = stageMaximumNumberOfIterations - stageNumberOfIterations;
+      totalConfiguredNumberOfIterations += configuredNumberOfIterations;
+      totalNumberOfIterations += stageNumberOfIterations;
+      this->StageNumberOfIterations.push_back(stageNumberOfIterations);
+      vtkDebugMacro("RunStages: Stage " << stageIndex << " run " << stageNumberOfIterations << " of "
+        << stageMaximumNumberOfIterations << " available iterations (" << configuredNumberOfIterations << " configured)");
+      }
+    else
+      {
+      stageTransformation = this->RunStageWithIndex(stageIndex, noParameters, transformation);
+      }
+    if (transformation)
+      {
+      delete transformation;
+      }
+    transformation = stageTransformation;
+
+    this->SampleRegistrationMemory();
+
+    if (this->ProgressivePreview && stageIndex + 1 < this->StageParameters.size())
+      {
+      this->UpdatePreview(transformation);
+      }
+    if (this->AbortRegistration)
+      {
+      break;
+      }
+    }
+
+  // Budget of the stages not run because of an abort is not counted as saved
+  this->NumberOfIterationsSaved = this->AbortRegistration ? 0
+    : std::max(0, totalConfiguredNumberOfIterations - totalNumberOfIterations);
+  this->MovingImageToFixedImageTransformation = transformation;
+}
+
+//---------------------------------------------------------------------------
+Xform* vtkSlicerPlastimatchPyModuleLogic::RunStageWithConvergenceMonitoring(unsigned int stageIndex,
+  int maximumNumberOfIterations, Xform* inputTransformation, int& numberOfIterations)
+{
+  numberOfIterations = 0;
+  const int checkInterval = std::max(1, this->ConvergenceCheckInterval);
+  const unsigned int windowSize = (unsigned int) std::max(1, this->ConvergenceWindowSize / checkInterval);
+
+  // Metric after each chunk of iterations
+  std::vector<double> metricValues;
+  Xform* transformation = NULL;
+  while (numberOfIterations < maximumNumberOfIterations)
+    {
+    const int chunkNumberOfIterations = std::min(checkInterval, maximumNumberOfIterations - numberOfIterations);
+    std::ostringstream chunkMaximumNumberOfIterations;
+    chunkMaximumNumberOfIterations << chunkNumberOfIterations;
+    StageParameterListType chunkParameters;
+    chunkParameters.push_back(std::make_pair(std::string("max_its"), chunkMaximumNumberOfIterations.str()));
+
+    Xform* chunkTransformation = this->RunStageWithIndex(stageIndex, chunkParameters,
+      transformation ? transformation : inputTransformation);
+    if (transformation)
+      {
+      delete transformation;
+      }
+    transformation = chunkTransformation;
+
+    // Plastimatch does not report the iterations a stage actually ran, so a chunk is counted as its "max_its".
+    // A chunk stopped earlier by the Plastimatch tolerances is over-counted, never by more than its own budget.
+    numberOfIterations += chunkNumberOfIterations;
+    if (!transformation || this->AbortRegistration || numberOfIterations >= maximumNumberOfIterations)
+      {
+      break;
+      }
+
+    // Relative improvement over the sliding window
+    metricValues.push_back(this->EvaluateStageMetric(stageIndex, transformation));
+    if (metricValues.size() > windowSize)
+      {
+      const double windowStartValue = metricValues[metricValues.size() - 1 - windowSize];
+      const double relativeImprovement = (windowStartValue - metricValues.back())
+        / std::max(fabs(windowStartValue), 1e-12);
+      if (relativeImprovement < this->ConvergenceRelativeImprovement)
+        {
+        break;
+        }
+      }
+    }
+
+  return transformation;
+}
+
+//---------------------------------------------------------------------------
+double vtkSlicerPlastimatchPyModuleLogic::EvaluateStageMetric(unsigned int stageIndex, Xform* transformation)
+{
+  // The metric is evaluated on the images the stage runs on, taken from the pyramid cache
+  itk::Image<float, 3>::Pointer fixedItkImage = NULL;
+  itk::Image<float, 3>::Pointer movingItkImage = NULL;
+  this->GetStageImages(stageIndex, fixedItkImage, movingItkImage);
+  Plm_image* fixedLevelImage = new Plm_image(fixedItkImage);
+  Plm_image* movingLevelImage = new Plm_image(movingItkImage);
+
+  Plm_image* warpedLevelImage = new Plm_image();
+  this->ApplyWarp(warpedLevelImage, NULL, transformation, fixedLevelImage, movingLevelImage, -1200, 0, 1);
+
+  PlastimatchPyRegistrationMetrics::Result metrics;
+  PlastimatchPyRegistrationMetrics::ComputeVoxelMetrics(fixedLevelImage->itk_float(), warpedLevelImage->itk_float(),
+    NULL, NULL, this->MutualInformationNumberOfBins,
+    this->MutualInformationIntensityRange[0], this->MutualInformationIntensityRange[1], metrics);
+
+  delete warpedLevelImage;
+  delete movingLevelImage;
+  delete fixedLevelImage;
+
+  // Lower is better, as for the Plastimatch optimizers
+  const std::string metric = GetStageParameter(this->StageParameters[stageIndex], "metric", "mse");
+  return (metric == "mse") ? metrics.MeanSquaredError : - metrics.MutualInformation;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerPlastimatchPyModuleLogic::GetStageNumberOfIterations(unsigned int stageIndex)
+{
+  if (stageIndex >= this->StageNumberOfIterations.size())
+    {
+    vtkErrorMacro("GetStageNumberOfIterations: Stage " << stageIndex << " has not been run with adaptive convergence!");
+    return 0;
+    }
+  return this->StageNumberOfIterations[stageIndex];
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::UpdatePreview(Xform* currentTransformation)
+{
+  if (!currentTransformation)
+    {
+    return;
+    }
+
+  // Preview grid is the fixed image grid, subsampled. Only its geometry is needed, so the grid image is not
+  // allocated; voxel centers of the subsampled grid are placed as the ones of the pyramid levels.
+  itk::Image<float, 3>::Pointer fixedItkImage = this->RegistrationData->fixed_image->itk_float();
+  const int subsampling = std::max(this->PreviewSubsamplingFactor, 1);
+  itk::Image<float, 3>::SizeType previewSize;
+  itk::Image<float, 3>::SpacingType previewSpacing;
+  itk::Image<float, 3>::PointType previewOrigin = fixedItkImage->GetOrigin();
+  for (int d=0; d < 3; d++)
+    {
+    previewSize[d] = std::max(fixedItkImage->GetLargestPossibleRegion().GetSize()[d] / subsampling, (itk::SizeValueType) 1);
+    previewSpacing[d] = fixedItkImage->GetSpacing()[d] * subsampling;
+    for (int row=0; row < 3; row++)
+      {
+      previewOrigin[row] += fixedItkImage->GetDirection()[row][d] * fixedItkImage->GetSpacing()[d] * 0.5 * (subsampling - 1);
+      }
+    }
+  itk::Image<float, 3>::Pointer previewGridImage = itk::Image<float, 3>::New();
+  previewGridImage->SetOrigin(previewOrigin);
+  previewGridImage->SetSpacing(previewSpacing);
+  previewGridImage->SetDirection(fixedItkImage->GetDirection());
+  previewGridImage->SetRegions(previewSize);
+  Plm_image_header* previewImageHeader = new Plm_image_header(previewGridImage);
+
+  Plm_image* previewImage = new Plm_image();
+  plm_warp(previewImage, NULL, currentTransformation, previewImageHeader,
+    this->RegistrationData->moving_image, -1200, 0, 1);
+
+  delete previewImageHeader;
+
+  // The preview replaces the one not applied yet. It is applied right away when the registration runs on the main
+  // thread, otherwise by the main thread calling ApplyRegistrationResult() (\sa PreviewUpdatedEvent)
+  {
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> resultLock(PendingResultMutex);
+  delete this->PendingPreviewImage;
+  this->PendingPreviewImage = previewImage;
+  }
+  if (!this->SceneUpdatesDeferred)
+    {
+    this->ApplyRegistrationResult();
+    }
+  this->InvokeEvent(vtkSlicerPlastimatchPyModuleLogic::PreviewUpdatedEvent);
+}
+
+//---------------------------------------------------------------------------
+Xform* vtkSlicerPlastimatchPyModuleLogic::RunStageWithIndex(unsigned int stageIndex,
+  const StageParameterListType& overriddenParameters, Xform* inputTransformation)
+{
+  itk::Image<float, 3>::Pointer fixedItkImage = NULL;
+  itk::Image<float, 3>::Pointer movingItkImage = NULL;
+
+  // Images already subsampled by the pyramid must not be subsampled again by Plastimatch
+  StageParameterListType stageOverriddenParameters;
+  if (this->GetStageImages(stageIndex, fixedItkImage, movingItkImage))
+    {
+    stageOverriddenParameters.push_back(std::make_pair(std::string("res"), std::string("1 1 1")));
+    }
+  stageOverriddenParameters.insert(stageOverriddenParameters.end(), overriddenParameters.begin(), overriddenParameters.end());
+
+  Plm_image* fixedStageImage = new Plm_image(fixedItkImage);
+  Plm_image* movingStageImage = new Plm_image(movingItkImage);
+
+  Xform* stageTransformation = this->RunStage(this->StageParameters[stageIndex], stageOverriddenParameters,
+    inputTransformation, fixedStageImage, movingStageImage,
+    this->RegistrationData->fixed_landmarks, this->RegistrationData->moving_landmarks);
+
+  delete fixedStageImage;
+  delete movingStageImage;
+  return stageTransformation;
+}
+
+//---------------------------------------------------------------------------
+bool vtkSlicerPlastimatchPyModuleLogic::GetStageImages(unsigned int stageIndex,
+  itk::Image<float, 3>::Pointer& fixedStageImage, itk::Image<float, 3>::Pointer& movingStageImage)
+{
+  fixedStageImage = this->RegistrationData->fixed_image->itk_float();
+  movingStageImage = this->RegistrationData->moving_image->itk_float();
+
+  int subsampling[3] = {1, 1, 1};
+  if (!this->UseImagePyramid || !GetStageSubsampling(this->StageParameters[stageIndex], subsampling))
+    {
+    return false;
+    }
+  fixedStageImage = this->ImagePyramid->GetLevel(this->FixedImageKey, fixedStageImage, subsampling);
+  movingStageImage = this->ImagePyramid->GetLevel(this->MovingImageKey, movingStageImage, subsampling);
+  return true;
+}
+
+//---------------------------------------------------------------------------
+bool vtkSlicerPlastimatchPyModuleLogic::IsFinerStageOfSameType(
+  const StageParameterListType& previousStageParameters, const StageParameterListType& stageParameters)
+{
+  if (GetStageParameter(previousStageParameters, "xform", "") != GetStageParameter(stageParameters, "xform", ""))
+    {
+    return false;
+    }
+
+  int previousSubsampling[3] = {1, 1, 1};
+  int subsampling[3] = {1, 1, 1};
+  GetStageSubsampling(previousStageParameters, previousSubsampling);
+  GetStageSubsampling(stageParameters, subsampling);
+  bool finer = false;
+  for (int d=0; d < 3; d++)
+    {
+    if (subsampling[d] > previousSubsampling[d])
+      {
+      return false;
+      }
+    finer = finer || (subsampling[d] < previousSubsampling[d]);
+    }
+  return finer;
+}
+
+//---------------------------------------------------------------------------
+int vtkSlicerPlastimatchPyModuleLogic::GetLastDeformableStageIndex()
+{
+  int lastDeformableStageIndex = -1;
+  for (unsigned int stageIndex=0; stageIndex < this->StageParameters.size(); stageIndex++)
+    {
+    for (StageParameterListType::const_iterator parameterIt = this->StageParameters[stageIndex].begin();
+      parameterIt != this->StageParameters[stageIndex].end(); ++parameterIt)
+      {
+      if (parameterIt->first == "xform" && parameterIt->second == "bspline")
+        {
+        lastDeformableStageIndex = (int) stageIndex;
+        }
+      }
+    }
+  return lastDeformableStageIndex;
+}
+
+//---------------------------------------------------------------------------
+Xform* vtkSlicerPlastimatchPyModuleLogic::RunStage(const StageParameterListType& stageParameters,
+  const StageParameterListType& overriddenParameters, Xform* inputTransformation, Plm_image* fixedImage, Plm_image* movingImage,
+  Labeled_pointset* fixedLandmarks, Labeled_pointset* movingLandmarks)
+{
+  Registration_parms* stageRegistrationParameters = new Registration_parms();
+  stageRegistrationParameters->append_stage();
+  for (StageParameterListType::const_iterator parameterIt = stageParameters.begin(); parameterIt != stageParameters.end(); ++parameterIt)
+    {
+    stageRegistrationParameters->set_key_val(parameterIt->first.c_str(), parameterIt->second.c_str(), 1);
+    }
+  for (StageParameterListType::const_iterator parameterIt = overriddenParameters.begin(); parameterIt != overriddenParameters.end(); ++parameterIt)
+    {
+    stageRegistrationParameters->set_key_val(parameterIt->first.c_str(), parameterIt->second.c_str(), 1);
+    }
+
+  Registration_data* stageRegistrationData = new Registration_data();
+  stageRegistrationData->fixed_image = fixedImage;
+  stageRegistrationData->moving_image = movingImage;
+  stageRegistrationData->fixed_landmarks = fixedLandmarks;
+  stageRegistrationData->moving_landmarks = movingLandmarks;
+
+  // The stage is run by the Plastimatch stage driver, that takes the initial transformation in memory
+  // (a stage without initial transformation starts from an empty one, as in do_registration_pure)
+  Xform* emptyTransformation = NULL;
+  if (!inputTransformation)
+    {
+    emptyTransformation = new Xform();
+    inputTransformation = emptyTransformation;
+    }
+  Xform* outputTransformation = new Xform();
+  {
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> registrationLock(PlastimatchRegistrationMutex);
+  do_registration_stage(stageRegistrationParameters, stageRegistrationData,
+    outputTransformation, inputTransformation, stageRegistrationParameters->stages[0]);
+  }
+  delete emptyTransformation;
+
+  // Images and landmarks are not owned by the stage
+  stageRegistrationData->fixed_image = NULL;
+  stageRegistrationData->moving_image = NULL;
+  stageRegistrationData->fixed_landmarks = NULL;
+  stageRegistrationData->moving_landmarks = NULL;
+  delete stageRegistrationData;
+  delete stageRegistrationParameters;
+
+  return outputTransformation;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::AddAtlas(char* atlasImageID, char* atlasLabelmapID)
+{
+  if (!atlasImageID || !atlasLabelmapID)
+    {
+    vtkErrorMacro("AddAtlas: Invalid atlas image or labelmap ID!");
+    return;
+    }
+  this->AtlasIDs.push_back(std::make_pair(std::string(atlasImageID), std::string(atlasLabelmapID)));
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::ClearAtlases()
+{
+  this->AtlasIDs.clear();
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::RunMultiAtlasSegmentation(char* targetVolumeID, char* outputLabelmapID)
+{
+  if (!this->GetMRMLScene())
+    {
+    vtkErrorMacro("RunMultiAtlasSegmentation: Invalid MRML Scene!");
+    return;
+    }
+  if (this->AtlasIDs.empty() || this->StageParameters.empty())
+    {
+    vtkErrorMacro("RunMultiAtlasSegmentation: At least one atlas and one registration stage are needed!");
+    return;
+    }
+
+  // All the images are read from the scene before the registrations, that run without accessing it
+  const int numberOfAtlases = (int) this->AtlasIDs.size();
+  itk::Image<float, 3>::Pointer targetItkImage = itk::Image<float, 3>::New();
+  std::vector< itk::Image<float, 3>::Pointer > atlasImages(numberOfAtlases);
+  std::vector< itk::Image<float, 3>::Pointer > atlasLabelmaps(numberOfAtlases);
+  std::vector<std::string> atlasImageKeys(numberOfAtlases);
+  std::string targetImageKey;
+  {
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> sceneLock(SceneMutex);
+  vtkMRMLVolumeNode* targetVolumeNode = vtkMRMLVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(targetVolumeID));
+  if (!targetVolumeNode)
+    {
+    vtkErrorMacro("RunMultiAtlasSegmentation: Node containing the target image cannot be retrieved!");
+    return;
+    }
+  SlicerRtCommon::ConvertVolumeNodeToItkImageInLPS<float>(targetVolumeNode, targetItkImage);
+  targetImageKey = this->GetVolumeNodeKey(targetVolumeID);
+
+  for (int atlasIndex=0; atlasIndex < numberOfAtlases; atlasIndex++)
+    {
+    vtkMRMLVolumeNode* atlasImageNode = vtkMRMLVolumeNode::SafeDownCast(
+      this->GetMRMLScene()->GetNodeByID(this->AtlasIDs[atlasIndex].first.c_str()));
+    vtkMRMLVolumeNode* atlasLabelmapNode = vtkMRMLVolumeNode::SafeDownCast(
+      this->GetMRMLScene()->GetNodeByID(this->AtlasIDs[atlasIndex].second.c_str()));
+    if (!atlasImageNode || !atlasLabelmapNode)
+      {
+      vtkErrorMacro("RunMultiAtlasSegmentation: Nodes of atlas " << atlasIndex << " cannot be retrieved!");
+      return;
+      }
+    atlasImages[atlasIndex] = itk::Image<float, 3>::New();
+    SlicerRtCommon::ConvertVolumeNodeToItkImageInLPS<float>(atlasImageNode, atlasImages[atlasIndex]);
+    atlasImageKeys[atlasIndex] = this->GetVolumeNodeKey(this->AtlasIDs[atlasIndex].first.c_str());
+    atlasLabelmaps[atlasIndex] = itk::Image<float, 3>::New();
+    SlicerRtCommon::ConvertVolumeNodeToItkImageInLPS<float>(atlasLabelmapNode, atlasLabelmaps[atlasIndex]);
+    }
+
+  }
+
+  // The target image is prepared once: its pyramid levels are built in parallel and shared by all the atlases
+  std::vector<PlastimatchPyImagePyramid::LevelRequest> levelRequests;
+  for (unsigned int stageIndex=0; this->UseImagePyramid && stageIndex < this->StageParameters.size(); stageIndex++)
+    {
+    PlastimatchPyImagePyramid::LevelRequest levelRequest;
+    if (GetStageSubsampling(this->StageParameters[stageIndex], levelRequest.Subsampling))
+      {
+      levelRequest.ImageKey = targetImageKey;
+      levelRequest.Image = targetItkImage;
+      levelRequests.push_back(levelRequest);
+      }
+    }
+  this->ImagePyramid->SetMemoryBudget((unsigned long long) this->ImagePyramidMemoryBudget * 1024 * 1024);
+  this->ImagePyramid->BuildLevels(levelRequests);
+
+  std::vector< itk::Image<float, 3>::Pointer > targetStageImages;
+  for (unsigned int stageIndex=0; stageIndex < this->StageParameters.size(); stageIndex++)
+    {
+    int subsampling[3] = {1, 1, 1};
+    if (this->UseImagePyramid && GetStageSubsampling(this->StageParameters[stageIndex], subsampling))
+      {
+      vtkDebugMacro("RunMultiAtlasSegmentation: Subsampling (res " << subsampling[0] << " " << subsampling[1] << " " << subsampling[2]
+        << ") of stage " << stageIndex << " is done by the image pyramid with anti-aliasing, Plastimatch runs the stage with res 1 1 1");
+      targetStageImages.push_back(this->ImagePyramid->GetLevel(targetImageKey, targetItkImage, subsampling));
+      }
+    else
+      {
+      targetStageImages.push_back(targetItkImage);
+      }
+    }
+
+  // Each registration and each warp is a job of the scheduler. Inputs are already read, so a registration
+  // is predicted to need its largest stage and the atlas pyramid levels, a warp the warped labelmap
+  // (float and label copies).
+  const itk::Image<float, 3>::SizeType targetSize = targetItkImage->GetBufferedRegion().GetSize();
+  const unsigned long long numberOfTargetVoxels = (unsigned long long) targetSize[0] * targetSize[1] * targetSize[2];
+  const unsigned long long warpPredictedMemory = numberOfTargetVoxels * (sizeof(float) + sizeof(short));
+  PlastimatchPyJobScheduler* scheduler = PlastimatchPyJobScheduler::GetInstance();
+
+  // Register the atlases one after the other, as the Plastimatch registration is not reentrant.
+  // The atlas pyramid levels are kept by the pyramid, so later segmentations with the same atlases reuse them.
+  std::vector<Xform*> atlasTransformations(numberOfAtlases, (Xform*) NULL);
+  for (int atlasIndex=0; atlasIndex < numberOfAtlases; atlasIndex++)
+    {
+    const itk::Image<float, 3>::SizeType atlasSize = atlasImages[atlasIndex]->GetBufferedRegion().GetSize();
+    const unsigned long long numberOfAtlasVoxels = (unsigned long long) atlasSize[0] * atlasSize[1] * atlasSize[2];
+    unsigned long long registrationPredictedMemory = 0;
+    for (unsigned int stageIndex=0; stageIndex < this->StageParameters.size(); stageIndex++)
+      {
+      registrationPredictedMemory = std::max(registrationPredictedMemory,
+        EstimateStageMemory(this->StageParameters[stageIndex], numberOfTargetVoxels, numberOfAtlasVoxels));
+      }
+
+    const long jobId = scheduler->Admit(registrationPredictedMemory);
+    const unsigned long long startMemory = PlastimatchPyJobScheduler::GetProcessMemoryUsage();
+    atlasTransformations[atlasIndex] = this->RunAtlasRegistration(targetStageImages,
+      atlasImageKeys[atlasIndex], atlasImages[atlasIndex]);
+    const unsigned long long endMemory = PlastimatchPyJobScheduler::GetProcessMemoryUsage();
+    scheduler->Release(jobId, endMemory > startMemory ? endMemory - startMemory : 0);
+
+    // Atlas image is not needed anymore
+    atlasImages[atlasIndex] = NULL;
+    }
+
+  // Warp the atlas labelmaps onto the target grid concurrently
+  int numberOfConcurrentWarps = this->NumberOfConcurrentAtlasWarps;
+  if (numberOfConcurrentWarps <= 0)
+    {
+#ifdef _OPENMP
+    numberOfConcurrentWarps = omp_get_num_procs();
+#else
+    numberOfConcurrentWarps = 1;
+#endif
+    }
+  numberOfConcurrentWarps = std::min(numberOfConcurrentWarps, numberOfAtlases);
+
+  Plm_image* targetImage = new Plm_image(targetItkImage);
+  std::vector<PlastimatchPyLabelFusion::LabelImageType::Pointer> warpedLabelmaps(numberOfAtlases);
+#pragma omp parallel for schedule(dynamic) num_threads(numberOfConcurrentWarps)
+  for (int atlasIndex=0; atlasIndex < numberOfAtlases; atlasIndex++)
+    {
+    if (atlasTransformations[atlasIndex])
+      {
+      const long jobId = scheduler->Admit(warpPredictedMemory);
+      const unsigned long long startMemory = PlastimatchPyJobScheduler::GetProcessMemoryUsage();
+
+      Plm_image_header targetImageHeader(targetImage);
+      Plm_image atlasLabelmap(atlasLabelmaps[atlasIndex]);
+      Plm_image warpedLabelmap;
+      plm_warp(&warpedLabelmap, NULL, atlasTransformations[atlasIndex], &targetImageHeader, &atlasLabelmap, 0, 0, 0);
+      warpedLabelmaps[atlasIndex] = PlastimatchPyLabelFusion::ConvertToLabelImage(warpedLabelmap.itk_float());
+
+      const unsigned long long endMemory = PlastimatchPyJobScheduler::GetProcessMemoryUsage();
+      scheduler->Release(jobId, endMemory > startMemory ? endMemory - startMemory : 0);
+      delete atlasTransformations[atlasIndex];
+      atlasTransformations[atlasIndex] = NULL;
+      }
+
+    // Atlas labelmap is not needed anymore
+    atlasLabelmaps[atlasIndex] = NULL;
+    }
+  delete targetImage;
+
+  std::vector<PlastimatchPyLabelFusion::LabelImageType::Pointer> registeredLabelmaps;
+  for (int atlasIndex=0; atlasIndex < numberOfAtlases; atlasIndex++)
+    {
+    if (warpedLabelmaps[atlasIndex])
+      {
+      registeredLabelmaps.push_back(warpedLabelmaps[atlasIndex]);
+      }
+    else
+      {
+      vtkWarningMacro("RunMultiAtlasSegmentation: Registration of atlas " << atlasIndex << " failed, it is not fused!");
+      }
+    }
+  warpedLabelmaps.clear();
+
+  // Fuse the labelmaps in a single streaming pass (or one pass per STAPLE iteration)
+  PlastimatchPyLabelFusion::LabelImageType::Pointer fusedLabelmap = NULL;
+  if (this->LabelFusionMethod == LabelFusionStaple)
+    {
+    int numberOfIterations = 0;
+    fusedLabelmap = PlastimatchPyLabelFusion::FuseStaple(registeredLabelmaps,
+      this->StapleMaximumNumberOfIterations, this->StapleTolerance, numberOfIterations);
+    vtkDebugMacro("RunMultiAtlasSegmentation: STAPLE fusion run " << numberOfIterations << " iterations");
+    }
+  else
+    {
+    fusedLabelmap = PlastimatchPyLabelFusion::FuseMajorityVote(registeredLabelmaps);
+    }
+  if (!fusedLabelmap)
+    {
+    vtkErrorMacro("RunMultiAtlasSegmentation: Warped atlas labelmaps cannot be fused!");
+    return;
+    }
+
+  this->SetLabelmapInVolumeNode(fusedLabelmap, targetVolumeID, outputLabelmapID);
+}
+
+//---------------------------------------------------------------------------
+Xform* vtkSlicerPlastimatchPyModuleLogic::RunAtlasRegistration(
+  const std::vector< itk::Image<float, 3>::Pointer >& targetStageImages, const std::string& atlasImageKey,
+  itk::Image<float, 3>* atlasImage)
+{
+  Xform* transformation = NULL;
+  for (unsigned int stageIndex=0; stageIndex < this->StageParameters.size(); stageIndex++)
+    {
+    // Atlas levels are cached by the pyramid as the target ones
+    itk::Image<float, 3>::Pointer atlasStageImage = atlasImage;
+    int subsampling[3] = {1, 1, 1};
+    StageParameterListType stageOverriddenParameters;
+    if (this->UseImagePyramid && GetStageSubsampling(this->StageParameters[stageIndex], subsampling))
+      {
+      stageOverriddenParameters.push_back(std::make_pair(std::string("res"), std::string("1 1 1")));
+      atlasStageImage = this->ImagePyramid->GetLevel(atlasImageKey, atlasImage, subsampling);
+      }
+
+    Plm_image* fixedStageImage = new Plm_image(targetStageImages[stageIndex]);
+    Plm_image* movingStageImage = new Plm_image(atlasStageImage);
+    Xform* stageTransformation = this->RunStage(this->StageParameters[stageIndex], stageOverriddenParameters,
+      transformation, fixedStageImage, movingStageImage, NULL, NULL);
+    delete fixedStageImage;
+    delete movingStageImage;
+
+    if (transformation)
+      {
+      delete transformation;
+      }
+    transformation = stageTransformation;
+    }
+  return transformation;
+}
+
+//---------------------------------------------------------------------------
+bool vtkSlicerPlastimatchPyModuleLogic::GetStageSubsampling(const StageParameterListType& stageParameters, int subsampling[3])
+{
+  bool found = false;
+  for (StageParameterListType::const_iterator parameterIt = stageParameters.begin(); parameterIt != stageParameters.end(); ++parameterIt)
+    {
+    if (parameterIt->first != "res" && parameterIt->first != "ss")
+      {
+      continue;
+      }
+    int values[3] = {1, 1, 1};
+    int numberOfValues = sscanf(parameterIt->second.c_str(), "%d %d %d", &values[0], &values[1], &values[2]);
+    if (numberOfValues == 1)
+      {
+      values[1] = values[2] = values[0];
+      }
+    else if (numberOfValues != 3)
+      {
+      continue;
+      }
+    for (int d=0; d < 3; d++)
+      {
+      subsampling[d] = values[d] > 1 ? values[d] : 1;
+      }
+    found = true;
+    }
+  return found;
+}
+
+//---------------------------------------------------------------------------
+std::string vtkSlicerPlastimatchPyModuleLogic::GetStageParameter(const StageParameterListType& stageParameters,
+  const char* key, const char* defaultValue)
+{
+  // The last value set wins, as in Plastimatch
+  std::string value = defaultValue;
+  for (StageParameterListType::const_iterator parameterIt = stageParameters.begin(); parameterIt != stageParameters.end(); ++parameterIt)
+    {
+    if (parameterIt->first == key)
+      {
+      value = parameterIt->second;
+      }
+    }
+  return value;
+}
+
+//---------------------------------------------------------------------------
+std::string vtkSlicerPlastimatchPyModuleLogic::GetVolumeNodeKey(const char* volumeID)
+{
+  std::ostringstream volumeKey;
+  volumeKey << (volumeID ? volumeID : "");
+  vtkMRMLVolumeNode* volumeNode = vtkMRMLVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(volumeID));
+  if (volumeNode)
+    {
+    volumeKey << ":" << volumeNode->GetMTime();
+    if (volumeNode->GetImageData())
+      {
+      // Voxel edits may only modify the scalar array, without modifying the image data itself
+      volumeKey << ":" << volumeNode->GetImageData()->GetMTime();
+      vtkDataArray* scalars = volumeNode->GetImageData()->GetPointData()->GetScalars();
+      if (scalars)
+        {
+        volumeKey << ":" << scalars->GetMTime();
+        }
+      }
+    }
+  return volumeKey.str();
+}
+
+//---------------------------------------------------------------------------
+std::string vtkSlicerPlastimatchPyModuleLogic::GetLinearTransformationNodeKey(const char* transformationID)
+{
+  if (!transformationID)
+    {
+    return std::string();
+    }
+
+  // The matrix values are compared, rather than the modification time of the node
+  std::ostringstream transformationKey;
+  transformationKey.precision(17);
+  transformationKey << transformationID;
+  vtkMRMLLinearTransformNode* transformationNode =
+    vtkMRMLLinearTransformNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(transformationID));
+  if (transformationNode && transformationNode->GetMatrixTransformToParent())
+    {
+    vtkMatrix4x4* matrix = transformationNode->GetMatrixTransformToParent();
+    for (int row=0; row < 4; row++)
+      {
+      for (int column=0; column < 4; column++)
+        {
+        transformationKey << ":" << matrix->GetElement(row, column);
+        }
+      }
+    }
+  return transformationKey.str();
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::WarpLandmarks()
+{
+  DeformationFieldType::Pointer vectorField = this->GetMovingImageToFixedImageVectorField();
+  if (!vectorField)
+    {
+    vtkErrorMacro("WarpLandmarks: No vector field available, run the registration first!");
+    return;
+    }
+
+  Labeled_pointset warpedPointset;
+  pointset_warp(&warpedPointset, this->RegistrationData->moving_landmarks, vectorField);
+  
+  // Clear warped landmarks
+  this->WarpedLandmarks->Initialize();
+
+  for (int i=0; i < (int)warpedPointset.count(); ++i)
+  {
+    vtkDebugMacro("[RTN] "
+            << warpedPointset.point_list[i].p[0] << " "
+            << warpedPointset.point_list[i].p[1] << " "
+            << warpedPointset.point_list[i].p[2] << " -> "
+            << -warpedPointset.point_list[i].p[0] << " "
+            << -warpedPointset.point_list[i].p[1] << " "
+            << warpedPointset.point_list[i].p[2]);
+    this->WarpedLandmarks->InsertPoint(i,
+      - warpedPointset.point_list[i].p[0],
+      - warpedPointset.point_list[i].p[1],
+      warpedPointset.point_list[i].p[2]);
+    }
+}
+
+//---------------------------------------------------------------------------
+bool vtkSlicerPlastimatchPyModuleLogic::WarpPointsFromFixedToMoving(vtkPoints* inputPoints, vtkPoints* outputPoints)
+{
+  if (!inputPoints || !outputPoints || inputPoints == outputPoints)
+    {
+    vtkErrorMacro("WarpPointsFromFixedToMoving: Input and output point lists must be valid and distinct!");
+    return false;
+    }
+  if (!this->MovingImageToFixedImageTransformation)
+    {
+    vtkErrorMacro("WarpPointsFromFixedToMoving: No transformation available, run the registration first!");
+    return false;
+    }
+
+  // A compressed field is evaluated directly, without decompressing it
+  Bspline_xform* bsplineTransformation = NULL;
+  DeformationFieldType::Pointer vectorField = NULL;
+  if (this->MovingImageToFixedImageTransformation->m_type == XFORM_GPUIT_BSPLINE)
+    {
+    bsplineTransformation = this->MovingImageToFixedImageTransformation->get_gpuit_bsp();
+    }
+  else if (!this->CompactMovingImageToFixedImageVectorField)
+    {
+    vectorField = this->GetMovingImageToFixedImageVectorField();
+    if (!vectorField)
+      {
+      vtkErrorMacro("WarpPointsFromFixedToMoving: Transformation is not a B-spline and no vector field is available!");
+      return false;
+      }
+    }
+
+  // The output buffer is used as working buffer, so no temporary copy of the points is needed
+  const vtkIdType numberOfPoints = inputPoints->GetNumberOfPoints();
+  float* outputBuffer = this->ConvertPointsToLpsBuffer(inputPoints, outputPoints);
+
+  if (bsplineTransformation)
+    {
+    PlastimatchPyTransformEvaluator::TransformPointsWithBspline(
+      bsplineTransformation, outputBuffer, outputBuffer, (long) numberOfPoints);
+    }
+  else if (vectorField)
+    {
+    PlastimatchPyTransformEvaluator::TransformPointsWithVectorField(
+      vectorField, outputBuffer, outputBuffer, (long) numberOfPoints);
+    }
+  else
+    {
+    this->CompactMovingImageToFixedImageVectorField->TransformPoints(outputBuffer, outputBuffer, (long) numberOfPoints);
+    }
+
+  // The registration maps into the pre-aligned moving image, the initial transformation maps it into the moving image
+  if (this->InitializationLinearTransformation)
+    {
+    double linearTransformationMatrix[3][4];
+    GetLinearTransformationMatrix(this->InitializationLinearTransformation, false, linearTransformationMatrix);
+    PlastimatchPyTransformEvaluator::TransformPointsWithLinearTransformation(
+      linearTransformationMatrix, outputBuffer, outputBuffer, (long) numberOfPoints);
+    }
+
+  this->ConvertLpsBufferToRas(outputBuffer, numberOfPoints);
+  outputPoints->Modified();
+  return true;
+}
+
+//---------------------------------------------------------------------------
+bool vtkSlicerPlastimatchPyModuleLogic::WarpPolyDataFromFixedToMoving(vtkPolyData* inputPolyData, vtkPolyData* outputPolyData)
+{
+  return this->WarpPolyData(inputPolyData, outputPolyData, false);
+}
 
-  this->RegistrationParameters = new Registration_parms();
-  this->RegistrationData = new Registration_data();
+//---------------------------------------------------------------------------
+bool vtkSlicerPlastimatchPyModuleLogic::WarpPolyDataFromMovingToFixed(vtkPolyData* inputPolyData, vtkPolyData* outputPolyData)
+{
+  return this->WarpPolyData(inputPolyData, outputPolyData, true);
 }
 
-//----------------------------------------------------------------------------
-vtkSlicerPlastimatchPyModuleLogic::~vtkSlicerPlastimatchPyModuleLogic()
+//---------------------------------------------------------------------------
+bool vtkSlicerPlastimatchPyModuleLogic::WarpPolyData(vtkPolyData* inputPolyData, vtkPolyData* outputPolyData, bool movingToFixed)
 {
-  this->SetFixedImageID(NULL);
-  this->SetMovingImageID(NULL);
-  this->SetFixedLandmarksFileName(NULL);
-  this->SetMovingLandmarksFileName(NULL);
-  this->SetInitializationLinearTransformationID(NULL);
-  this->SetOutputVolumeID(NULL);
+  if (!inputPolyData || !outputPolyData || !inputPolyData->GetPoints())
+    {
+    vtkErrorMacro("WarpPolyData: Invalid input or output poly data!");
+    return false;
+    }
 
-  this->SetFixedLandmarks(NULL);
-  this->SetMovingLandmarks(NULL);
-  this->SetWarpedLandmarks(NULL);
+  // Reuse the points already owned by the output, if they are not shared with the input.
+  // They are only written once the warp is known to succeed, so the output is left unchanged on failure.
+  vtkSmartPointer<vtkPoints> warpedPoints = outputPolyData->GetPoints();
+  if (!warpedPoints || warpedPoints == inputPolyData->GetPoints())
+    {
+    warpedPoints = vtkSmartPointer<vtkPoints>::New();
+    }
 
-  this->MovingImageToFixedImageVectorField = NULL;
+  const bool warped = movingToFixed
+    ? this->WarpPointsFromMovingToFixed(inputPolyData->GetPoints(), warpedPoints)
+    : this->WarpPointsFromFixedToMoving(inputPolyData->GetPoints(), warpedPoints);
+  if (!warped)
+    {
+    vtkErrorMacro("WarpPolyData: Points cannot be warped, output poly data is left unchanged!");
+    return false;
+    }
 
-  this->RegistrationParameters = NULL;
-  this->RegistrationData = NULL;
+  if (outputPolyData != inputPolyData)
+    {
+    outputPolyData->ShallowCopy(inputPolyData);
+    }
+  outputPolyData->SetPoints(warpedPoints);
+  return true;
 }
 
-//----------------------------------------------------------------------------
-void vtkSlicerPlastimatchPyModuleLogic::PrintSelf(ostream& os, vtkIndent indent)
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::ComputeInverseVectorField()
 {
-  this->Superclass::PrintSelf(os, indent);
+  if (!this->MovingImageToFixedImageTransformation || !this->RegistrationData->moving_image)
+    {
+    vtkErrorMacro("ComputeInverseVectorField: No transformation available, run the registration first!");
+    return;
+    }
+
+  // The inverse is defined on the grid of the image the registration has been computed on
+  this->FixedImageToMovingImageVectorField = PlastimatchPyVectorFieldInverter::AllocateField(
+    this->RegistrationData->moving_image->itk_float(), this->InverseVectorFieldSubsamplingFactor);
+
+  long numberOfNotConvergedVoxels = 0;
+  if (this->MovingImageToFixedImageTransformation->m_type == XFORM_GPUIT_BSPLINE)
+    {
+    numberOfNotConvergedVoxels = PlastimatchPyVectorFieldInverter::InvertBspline(
+      this->MovingImageToFixedImageTransformation->get_gpuit_bsp(), this->FixedImageToMovingImageVectorField,
+      this->InverseVectorFieldMaximumNumberOfIterations, this->InverseVectorFieldTolerance);
+    }
+  else
+    {
+    DeformationFieldType::Pointer vectorField = this->GetMovingImageToFixedImageVectorField();
+    if (!vectorField)
+      {
+      vtkErrorMacro("ComputeInverseVectorField: Transformation is not a B-spline and no vector field is available!");
+      this->FixedImageToMovingImageVectorField = NULL;
+      return;
+      }
+    numberOfNotConvergedVoxels = PlastimatchPyVectorFieldInverter::InvertVectorField(
+      vectorField, this->FixedImageToMovingImageVectorField,
+      this->InverseVectorFieldMaximumNumberOfIterations, this->InverseVectorFieldTolerance);
+    }
+
+  if (numberOfNotConvergedVoxels > 0)
+    {
+    vtkWarningMacro("ComputeInverseVectorField: Inversion did not converge for " << numberOfNotConvergedVoxels << " voxels!");
+    }
 }
 
 //---------------------------------------------------------------------------
-void vtkSlicerPlastimatchPyModuleLogic::SetMRMLSceneInternal(vtkMRMLScene * newScene)
+void vtkSlicerPlastimatchPyModuleLogic::SetInverseVectorFieldSubsamplingFactor(int subsamplingFactor)
 {
-  vtkNew<vtkIntArray> events;
-  events->InsertNextValue(vtkMRMLScene::EndBatchProcessEvent);
-  this->SetAndObserveMRMLSceneEventsInternal(newScene, events.GetPointer());
+  if (this->InverseVectorFieldSubsamplingFactor == subsamplingFactor)
+    {
+    return;
+    }
+  this->InverseVectorFieldSubsamplingFactor = subsamplingFactor;
+  this->FixedImageToMovingImageVectorField = NULL;
+  this->Modified();
 }
 
-//-----------------------------------------------------------------------------
-void vtkSlicerPlastimatchPyModuleLogic::RegisterNodes()
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::SetInverseVectorFieldMaximumNumberOfIterations(int maximumNumberOfIterations)
 {
-  if (!this->GetMRMLScene())
+  if (this->InverseVectorFieldMaximumNumberOfIterations == maximumNumberOfIterations)
     {
-    vtkErrorMacro("RegisterNodes: Invalid MRML Scene!");
     return;
     }
+  this->InverseVectorFieldMaximumNumberOfIterations = maximumNumberOfIterations;
+  this->FixedImageToMovingImageVectorField = NULL;
+  this->Modified();
 }
 
 //---------------------------------------------------------------------------
-void vtkSlicerPlastimatchPyModuleLogic::UpdateFromMRMLScene()
+void vtkSlicerPlastimatchPyModuleLogic::SetInverseVectorFieldTolerance(float tolerance)
 {
-  if (!this->GetMRMLScene())
+  if (this->InverseVectorFieldTolerance == tolerance)
     {
-    vtkErrorMacro("UpdateFromMRMLScene: Invalid MRML Scene!");
     return;
     }
+  this->InverseVectorFieldTolerance = tolerance;
+  this->FixedImageToMovingImageVectorField = NULL;
+  this->Modified();
 }
 
 //---------------------------------------------------------------------------
-void vtkSlicerPlastimatchPyModuleLogic::AddStage()
+bool vtkSlicerPlastimatchPyModuleLogic::WarpPointsFromMovingToFixed(vtkPoints* inputPoints, vtkPoints* outputPoints)
 {
-  this->RegistrationParameters->append_stage();
+  if (!inputPoints || !outputPoints || inputPoints == outputPoints)
+    {
+    vtkErrorMacro("WarpPointsFromMovingToFixed: Input and output point lists must be valid and distinct!");
+    return false;
+    }
+  if (!this->FixedImageToMovingImageVectorField)
+    {
+    this->ComputeInverseVectorField();
+    if (!this->FixedImageToMovingImageVectorField)
+      {
+      vtkErrorMacro("WarpPointsFromMovingToFixed: Inverse vector field cannot be computed!");
+      return false;
+      }
+    }
+  double inverseLinearTransformationMatrix[3][4];
+  if (this->InitializationLinearTransformation
+    && !GetLinearTransformationMatrix(this->InitializationLinearTransformation, true, inverseLinearTransformationMatrix))
+    {
+    vtkErrorMacro("WarpPointsFromMovingToFixed: Initial linear transformation cannot be inverted!");
+    return false;
+    }
+
+  const vtkIdType numberOfPoints = inputPoints->GetNumberOfPoints();
+  float* outputBuffer = this->ConvertPointsToLpsBuffer(inputPoints, outputPoints);
+
+  // Points are first mapped into the pre-aligned moving image, on which the inverse vector field is defined
+  if (this->InitializationLinearTransformation)
+    {
+    PlastimatchPyTransformEvaluator::TransformPointsWithLinearTransformation(
+      inverseLinearTransformationMatrix, outputBuffer, outputBuffer, (long) numberOfPoints);
+    }
+  PlastimatchPyTransformEvaluator::TransformPointsWithVectorField(
+    this->FixedImageToMovingImageVectorField, outputBuffer, outputBuffer, (long) numberOfPoints);
+  this->ConvertLpsBufferToRas(outputBuffer, numberOfPoints);
+  outputPoints->Modified();
+  return true;
 }
 
 //---------------------------------------------------------------------------
-void vtkSlicerPlastimatchPyModuleLogic::SetPar(char* key, char* value)
-{        
-  this->RegistrationParameters->set_key_val(key, value, 1);
+vtkSlicerPlastimatchPyModuleLogic::DeformationFieldType::Pointer vtkSlicerPlastimatchPyModuleLogic::GetInverseVectorFieldOnMovingImageGrid()
+{
+  if (!this->FixedImageToMovingImageVectorField)
+    {
+    this->ComputeInverseVectorField();
+    if (!this->FixedImageToMovingImageVectorField)
+      {
+      return NULL;
+      }
+    }
+  if (!this->InitializationLinearTransformation)
+    {
+    return this->FixedImageToMovingImageVectorField;
+    }
+
+  // The inverse vector field is defined on the pre-aligned moving image, so it is composed
+  // with the inverse of the initial transformation to be defined on the moving image grid
+  double inverseLinearTransformationMatrix[3][4];
+  if (!GetLinearTransformationMatrix(this->InitializationLinearTransformation, true, inverseLinearTransformationMatrix))
+    {
+    vtkErrorMacro("GetInverseVectorFieldOnMovingImageGrid: Initial linear transformation cannot be inverted!");
+    return NULL;
+    }
+  DeformationFieldType::Pointer inverseField = PlastimatchPyVectorFieldInverter::AllocateField(
+    this->ConvertedMovingImageGrid, this->InverseVectorFieldSubsamplingFactor);
+  PlastimatchPyVectorFieldInverter::ComposeWithLinearTransformation(
+    inverseLinearTransformationMatrix, this->FixedImageToMovingImageVectorField, inverseField);
+  return inverseField;
 }
 
 //---------------------------------------------------------------------------
-void vtkSlicerPlastimatchPyModuleLogic::RunRegistration()
+void vtkSlicerPlastimatchPyModuleLogic::WarpVolumeInverse(char* inputVolumeID, char* outputVolumeID, float defaultValue)
 {
-  // Set input images
-  vtkMRMLVolumeNode* fixedVtkImage = vtkMRMLVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(this->FixedImageID));
-  itk::Image<float, 3>::Pointer fixedItkImage = itk::Image<float, 3>::New();
-  SlicerRtCommon::ConvertVolumeNodeToItkImageInLPS<float>(fixedVtkImage, fixedItkImage);
-
-  vtkMRMLVolumeNode* movingVtkImage = vtkMRMLVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(this->MovingImageID));
-  itk::Image<float, 3>::Pointer movingItkImage = itk::Image<float, 3>::New();
-  SlicerRtCommon::ConvertVolumeNodeToItkImageInLPS<float>(movingVtkImage, movingItkImage);
+  DeformationFieldType::Pointer inverseField = this->GetInverseVectorFieldOnMovingImageGrid();
+  if (!inverseField)
+    {
+    vtkErrorMacro("WarpVolumeInverse: Inverse vector field cannot be computed!");
+    return;
+    }
 
-  this->RegistrationData->fixed_image = new Plm_image(fixedItkImage);
-  this->RegistrationData->moving_image = new Plm_image(movingItkImage);
-  
-  // Set landmarks 
-  if (this->FixedLandmarks && this->MovingLandmarks)
+  itk::Image<float, 3>::Pointer inputItkImage = itk::Image<float, 3>::New();
+  {
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> sceneLock(SceneMutex);
+  vtkMRMLVolumeNode* inputVolumeNode = vtkMRMLVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(inputVolumeID));
+  if (!inputVolumeNode)
     {
-    // From Slicer
-    this->SetLandmarksFromSlicer();
+    vtkErrorMacro("WarpVolumeInverse: Node containing the volume to warp cannot be retrieved!");
+    return;
     }
-  else if (this->FixedLandmarksFileName && this->FixedLandmarksFileName)
+  SlicerRtCommon::ConvertVolumeNodeToItkImageInLPS<float>(inputVolumeNode, inputItkImage);
+  }
+  Plm_image* inputImage = new Plm_image(inputItkImage);
+
+  Xform* inverseTransformation = new Xform();
+  inverseTransformation->set_itk_vf(inverseField);
+
+  // Output grid is the grid of the moving image
+  Plm_image_header* movingImageHeader = new Plm_image_header(this->ConvertedMovingImageGrid);
+  Plm_image* warpedImage = new Plm_image();
+  plm_warp(warpedImage, NULL, inverseTransformation, movingImageHeader, inputImage, defaultValue, 0, 1);
+
+  this->SetImageInVolumeNode(warpedImage, this->MovingImageID, outputVolumeID);
+
+  delete warpedImage;
+  delete movingImageHeader;
+  delete inverseTransformation;
+  delete inputImage;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::SetInverseVectorFieldInVolumeNode(char* vectorVolumeID)
+{
+  DeformationFieldType::Pointer inverseField = this->GetInverseVectorFieldOnMovingImageGrid();
+  if (!inverseField)
     {
-    // From Files
-    this->SetLandmarksFromFiles();
+    vtkErrorMacro("SetInverseVectorFieldInVolumeNode: Inverse vector field cannot be computed!");
+    return;
     }
-  else
+
+  // The nodes are looked up under the scene lock, and modified once it is released (\sa RunRegistration)
+  vtkSmartPointer<vtkMRMLVectorVolumeNode> vectorVolumeNode;
+  vtkSmartPointer<vtkMRMLVolumeNode> referenceVolumeNode;
+  {
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> sceneLock(SceneMutex);
+  vectorVolumeNode = vtkMRMLVectorVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(vectorVolumeID));
+  referenceVolumeNode = vtkMRMLVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(this->MovingImageID));
+  }
+  if (!vectorVolumeNode)
     {
-    vtkErrorMacro("RunRegistration: Unable to retrieve fixed and moving landmarks!");
+    vtkErrorMacro("SetInverseVectorFieldInVolumeNode: Node to store the inverse vector field cannot be retrieved!");
     return;
     }
-  
-  // Set initial affine transformation
-  if (this->InitializationLinearTransformationID)
+  if (!referenceVolumeNode)
     {
-    this->ApplyInitialLinearTransformation(); 
-    } 
+    vtkErrorMacro("SetInverseVectorFieldInVolumeNode: Node containing the moving image cannot be retrieved!");
+    return;
+    }
 
-  // Run registration and warp image
-  Xform* movingImageToFixedImageTransformation = NULL; // Transformation (linear or deformable) computed by Plastimatch
-  do_registration_pure(&movingImageToFixedImageTransformation, this->RegistrationData ,this->RegistrationParameters);
+  DeformationFieldType::SizeType size = inverseField->GetBufferedRegion().GetSize();
 
-  Plm_image* warpedImage = new Plm_image();
-  this->ApplyWarp(warpedImage, this->MovingImageToFixedImageVectorField, movingImageToFixedImageTransformation,
-    this->RegistrationData->fixed_image, this->RegistrationData->moving_image, -1200, 0, 1);
+  vtkSmartPointer<vtkImageData> vectorImageVtk = vtkSmartPointer<vtkImageData>::New();
+  int extent[6]={0, (int) size[0]-1, 0, (int) size[1]-1, 0, (int) size[2]-1};
+  vectorImageVtk->SetExtent(extent);
+  vectorImageVtk->SetScalarType(VTK_FLOAT);
+  vectorImageVtk->SetNumberOfScalarComponents(3);
+  vectorImageVtk->AllocateScalars();
 
-  this->SetWarpedImageInVolumeNode(warpedImage);
+  // Displacements are converted from LPS to RAS
+  float* vectorImagePtr = (float*)vectorImageVtk->GetScalarPointer();
+  const VectorType* inverseFieldPtr = inverseField->GetBufferPointer();
+  const long numberOfVoxels = (long) (size[0] * size[1] * size[2]);
+  for (long i=0; i < numberOfVoxels; i++)
+    {
+    vectorImagePtr[3*i]   = - inverseFieldPtr[i][0];
+    vectorImagePtr[3*i+1] = - inverseFieldPtr[i][1];
+    vectorImagePtr[3*i+2] = inverseFieldPtr[i][2];
+    }
 
-  delete warpedImage;
+  // The node may have been removed from the scene while the field was converted
+  if (!this->IsNodeInScene(vectorVolumeNode))
+    {
+    vtkErrorMacro("SetInverseVectorFieldInVolumeNode: Node to store the inverse vector field has been removed from the scene!");
+    return;
+    }
+  vectorVolumeNode->CopyOrientation(referenceVolumeNode);
+  vectorVolumeNode->SetSpacing(inverseField->GetSpacing()[0], inverseField->GetSpacing()[1], inverseField->GetSpacing()[2]);
+  vectorVolumeNode->SetOrigin(- inverseField->GetOrigin()[0], - inverseField->GetOrigin()[1], inverseField->GetOrigin()[2]);
+  vectorVolumeNode->SetAndObserveImageData(vectorImageVtk);
 }
 
 //---------------------------------------------------------------------------
-void vtkSlicerPlastimatchPyModuleLogic::WarpLandmarks()
+bool vtkSlicerPlastimatchPyModuleLogic::IsNodeInScene(vtkMRMLNode* node)
 {
-  Labeled_pointset warpedPointset;
-  pointset_warp(&warpedPointset, this->RegistrationData->moving_landmarks, this->MovingImageToFixedImageVectorField);
-  
-  // Clear warped landmarks
-  this->WarpedLandmarks->Initialize();
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> sceneLock(SceneMutex);
+  return node && this->GetMRMLScene() && this->GetMRMLScene()->IsNodePresent(node);
+}
 
-  for (int i=0; i < (int)warpedPointset.count(); ++i)
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::SetLabelmapInVolumeNode(itk::Image<short, 3>* labelImage,
+  const char* referenceVolumeID, const char* outputVolumeID)
+{
+  // The nodes are looked up under the scene lock, and modified once it is released (\sa RunRegistration)
+  vtkSmartPointer<vtkMRMLVolumeNode> referenceVolumeNode;
+  vtkSmartPointer<vtkMRMLScalarVolumeNode> outputLabelmapNode;
   {
-    vtkDebugMacro("[RTN] "
-            << warpedPointset.point_list[i].p[0] << " "
-            << warpedPointset.point_list[i].p[1] << " "
-            << warpedPointset.point_list[i].p[2] << " -> "
-            << -warpedPointset.point_list[i].p[0] << " "
-            << -warpedPointset.point_list[i].p[1] << " "
-            << warpedPointset.point_list[i].p[2]);
-    this->WarpedLandmarks->InsertPoint(i,
-      - warpedPointset.point_list[i].p[0],
-      - warpedPointset.point_list[i].p[1],
-      warpedPointset.point_list[i].p[2]);
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> sceneLock(SceneMutex);
+  referenceVolumeNode = vtkMRMLVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(referenceVolumeID));
+  outputLabelmapNode = vtkMRMLScalarVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(outputVolumeID));
+  }
+  if (!referenceVolumeNode)
+    {
+    vtkErrorMacro("SetLabelmapInVolumeNode: Node containing the reference image cannot be retrieved!");
+    return;
+    }
+  if (!outputLabelmapNode)
+    {
+    vtkErrorMacro("SetLabelmapInVolumeNode: Node containing the output labelmap cannot be retrieved!");
+    return;
+    }
+
+  itk::Image<short, 3>::SizeType size = labelImage->GetBufferedRegion().GetSize();
+  vtkSmartPointer<vtkImageData> labelImageVtk = vtkSmartPointer<vtkImageData>::New();
+  int extent[6]={0, (int) size[0]-1, 0, (int) size[1]-1, 0, (int) size[2]-1};
+  labelImageVtk->SetExtent(extent);
+  labelImageVtk->SetScalarType(VTK_SHORT);
+  labelImageVtk->SetNumberOfScalarComponents(1);
+  labelImageVtk->AllocateScalars();
+  memcpy(labelImageVtk->GetScalarPointer(), labelImage->GetBufferPointer(), size[0] * size[1] * size[2] * sizeof(short));
+
+  // The node may have been removed from the scene while the labelmap was converted
+  if (!this->IsNodeInScene(outputLabelmapNode))
+    {
+    vtkErrorMacro("SetLabelmapInVolumeNode: Node containing the output labelmap has been removed from the scene!");
+    return;
+    }
+
+  // Set labelmap to a Slicer node (origin is converted from LPS to RAS)
+  outputLabelmapNode->CopyOrientation(referenceVolumeNode);
+  outputLabelmapNode->SetSpacing(labelImage->GetSpacing()[0], labelImage->GetSpacing()[1], labelImage->GetSpacing()[2]);
+  outputLabelmapNode->SetOrigin(- labelImage->GetOrigin()[0], - labelImage->GetOrigin()[1], labelImage->GetOrigin()[2]);
+  outputLabelmapNode->SetLabelMap(1);
+  outputLabelmapNode->SetAndObserveImageData(labelImageVtk);
+}
+
+//---------------------------------------------------------------------------
+float* vtkSlicerPlastimatchPyModuleLogic::ConvertPointsToLpsBuffer(vtkPoints* inputPoints, vtkPoints* outputPoints)
+{
+  const vtkIdType numberOfPoints = inputPoints->GetNumberOfPoints();
+  outputPoints->SetDataTypeToFloat();
+  outputPoints->SetNumberOfPoints(numberOfPoints);
+  float* outputBuffer = static_cast<float*>(outputPoints->GetVoidPointer(0));
+
+#pragma omp parallel for
+  for (long i=0; i < (long) numberOfPoints; i++)
+    {
+    double point[3];
+    inputPoints->GetPoint(i, point);
+    outputBuffer[3*i]   = (float) -point[0];
+    outputBuffer[3*i+1] = (float) -point[1];
+    outputBuffer[3*i+2] = (float) point[2];
+    }
+
+  return outputBuffer;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::ConvertLpsBufferToRas(float* pointsBuffer, vtkIdType numberOfPoints)
+{
+#pragma omp parallel for
+  for (long i=0; i < (long) numberOfPoints; i++)
+    {
+    pointsBuffer[3*i]   = -pointsBuffer[3*i];
+    pointsBuffer[3*i+1] = -pointsBuffer[3*i+1];
     }
 }
 
 //---------------------------------------------------------------------------
-void vtkSlicerPlastimatchPyModuleLogic::SetLandmarksFromSlicer()
+bool vtkSlicerPlastimatchPyModuleLogic::SetLandmarksFromSlicer(Registration_data* registrationData)
 {
   if (!this->FixedLandmarks || !this->MovingLandmarks)
     {
     vtkErrorMacro("SetLandmarksFromSlicer: Landmark point lists are not valid!");
-    return;
+    return false;
+    }
+  if (this->FixedLandmarks->GetNumberOfPoints() != this->MovingLandmarks->GetNumberOfPoints())
+    {
+    vtkErrorMacro("SetLandmarksFromSlicer: Fixed and moving landmark point lists have different sizes!");
+    return false;
     }
 
   Labeled_pointset* fixedLandmarksSet = new Labeled_pointset();
@@ -229,49 +2062,51 @@ void vtkSlicerPlastimatchPyModuleLogic::SetLandmarksFromSlicer()
   
   for (int i = 0; i < this->FixedLandmarks->GetNumberOfPoints(); i++)
     {
-    Labeled_point* fixedLandmark = new Labeled_point("point",
+    Labeled_point fixedLandmark("point",
       - this->FixedLandmarks->GetPoint(i)[0],
       - this->FixedLandmarks->GetPoint(i)[1],
       this->FixedLandmarks->GetPoint(i)[2]);
 
-    Labeled_point* movingLandmark = new Labeled_point("point",
+    Labeled_point movingLandmark("point",
       - this->MovingLandmarks->GetPoint(i)[0],
       - this->MovingLandmarks->GetPoint(i)[1],
       this->MovingLandmarks->GetPoint(i)[2]);
    
-    fixedLandmarksSet->point_list.push_back(*fixedLandmark);
-    movingLandmarksSet->point_list.push_back(*movingLandmark);
+    fixedLandmarksSet->point_list.push_back(fixedLandmark);
+    movingLandmarksSet->point_list.push_back(movingLandmark);
     }
 
-  this->RegistrationData->fixed_landmarks = fixedLandmarksSet;
-  this->RegistrationData->moving_landmarks = movingLandmarksSet;
+  registrationData->fixed_landmarks = fixedLandmarksSet;
+  registrationData->moving_landmarks = movingLandmarksSet;
+  return true;
 }
 
 //---------------------------------------------------------------------------
-void vtkSlicerPlastimatchPyModuleLogic::SetLandmarksFromFiles()
+bool vtkSlicerPlastimatchPyModuleLogic::SetLandmarksFromFiles(Registration_data* registrationData)
 {
   if (!this->FixedLandmarksFileName || !this->MovingLandmarksFileName)
     {
     vtkErrorMacro("SetLandmarksFromFiles: Unable to read landmarks from files as at least one of the filenames is invalid!");
-    return;
+    return false;
     }
 
   Labeled_pointset* fixedLandmarksFromFile = new Labeled_pointset();
   fixedLandmarksFromFile->load(this->FixedLandmarksFileName);
-  this->RegistrationData->fixed_landmarks = fixedLandmarksFromFile;
+  registrationData->fixed_landmarks = fixedLandmarksFromFile;
 
   Labeled_pointset* movingLandmarksFromFile = new Labeled_pointset();
   movingLandmarksFromFile->load(this->MovingLandmarksFileName);
-  this->RegistrationData->moving_landmarks = movingLandmarksFromFile;
+  registrationData->moving_landmarks = movingLandmarksFromFile;
+  return true;
 }
 
 //---------------------------------------------------------------------------
-void vtkSlicerPlastimatchPyModuleLogic::ApplyInitialLinearTransformation()
+Xform* vtkSlicerPlastimatchPyModuleLogic::ImportInitialLinearTransformation()
 {
   if (!this->InitializationLinearTransformationID)
     {
-    vtkErrorMacro("ApplyInitialLinearTransformation: Invalid input transformation ID!");
-    return;
+    vtkErrorMacro("ImportInitialLinearTransformation: Invalid input transformation ID!");
+    return NULL;
     }
 
   // Get transformation as 4x4 matrix
@@ -279,8 +2114,8 @@ void vtkSlicerPlastimatchPyModuleLogic::ApplyInitialLinearTransformation()
     vtkMRMLLinearTransformNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(this->InitializationLinearTransformationID));
   if (!initializationLinearTransformationNode)
     {
-    vtkErrorMacro("ApplyInitialLinearTransformation: Failed to retrieve input transformation!");
-    return;
+    vtkErrorMacro("ImportInitialLinearTransformation: Failed to retrieve input transformation!");
+    return NULL;
     }
   vtkMatrix4x4* initializationTransformationAsVtkTransformationMatrix = 
     initializationLinearTransformationNode->GetMatrixTransformToParent();
@@ -318,38 +2153,180 @@ void vtkSlicerPlastimatchPyModuleLogic::ApplyInitialLinearTransformation()
   Xform* initializationTransformationAsPlastimatchTransformation = new Xform();
   initializationTransformationAsPlastimatchTransformation->set_aff(initializationTransformationAsItkTransformation);
 
+  return initializationTransformationAsPlastimatchTransformation;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::ApplyInitialLinearTransformation(Xform* initializationTransformation)
+{
   // Warp image using the input transformation
   Plm_image* prealignedImage = new Plm_image();
-  this->ApplyWarp(prealignedImage, NULL, initializationTransformationAsPlastimatchTransformation,
+  this->ApplyWarp(prealignedImage, NULL, initializationTransformation,
     this->RegistrationData->fixed_image, this->RegistrationData->moving_image, -1200, 0, 1);
 
   // Update moving image
+  delete this->RegistrationData->moving_image;
   this->RegistrationData->moving_image = prealignedImage;
-
-  delete initializationTransformationAsPlastimatchTransformation;
 }
 
 //---------------------------------------------------------------------------
 void vtkSlicerPlastimatchPyModuleLogic::ApplyWarp(Plm_image* warpedImage,
-  DeformationFieldType::Pointer vectorFieldFromTransformation, Xform* inputTransformation, 
+  DeformationFieldType::Pointer* vectorFieldFromTransformation, Xform* inputTransformation, 
   Plm_image* fixedImage, Plm_image* imageToWarp, float defaultValue, int useItk, int interpolationLinear)
 {
   Plm_image_header* plastimatchImageHeader = new Plm_image_header(fixedImage);
-  plm_warp(warpedImage, &vectorFieldFromTransformation, inputTransformation, plastimatchImageHeader,
+  plm_warp(warpedImage, vectorFieldFromTransformation, inputTransformation, plastimatchImageHeader,
     imageToWarp, defaultValue, useItk, interpolationLinear);
-  this->MovingImageToFixedImageVectorField = vectorFieldFromTransformation;
+  delete plastimatchImageHeader;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::StoreMovingImageToFixedImageVectorField(DeformationFieldType* vectorField)
+{
+  this->MovingImageToFixedImageVectorField = NULL;
+  if (this->CompactMovingImageToFixedImageVectorField)
+    {
+    delete this->CompactMovingImageToFixedImageVectorField;
+    this->CompactMovingImageToFixedImageVectorField = NULL;
+    }
+  if (!vectorField)
+    {
+    return;
+    }
+
+  switch (this->VectorFieldStorageMode)
+    {
+    case VectorFieldStorageFloat:
+      this->MovingImageToFixedImageVectorField = vectorField;
+      break;
+    case VectorFieldStorageHalfFloat:
+    case VectorFieldStorageQuantized:
+      this->CompactMovingImageToFixedImageVectorField = new PlastimatchPyCompactVectorField();
+      this->CompactMovingImageToFixedImageVectorField->Compress(vectorField,
+        this->VectorFieldStorageMode == VectorFieldStorageHalfFloat
+        ? PlastimatchPyCompactVectorField::HalfFloat : PlastimatchPyCompactVectorField::Quantized8Bit);
+      break;
+    default:
+      // Field is computed from the transformation when needed
+      break;
+    }
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::StoreMovingImageToFixedImageBspline()
+{
+  this->StoreMovingImageToFixedImageVectorField(NULL);
+
+  // The field is evaluated on the fixed image grid, as the one rendered by plm_warp
+  this->CompactMovingImageToFixedImageVectorField = new PlastimatchPyCompactVectorField();
+  this->CompactMovingImageToFixedImageVectorField->CompressBspline(
+    this->MovingImageToFixedImageTransformation->get_gpuit_bsp(), this->ConvertedFixedImage,
+    this->VectorFieldStorageMode == VectorFieldStorageHalfFloat
+    ? PlastimatchPyCompactVectorField::HalfFloat : PlastimatchPyCompactVectorField::Quantized8Bit);
+}
+
+//---------------------------------------------------------------------------
+vtkSlicerPlastimatchPyModuleLogic::DeformationFieldType::Pointer vtkSlicerPlastimatchPyModuleLogic::GetMovingImageToFixedImageVectorField()
+{
+  if (this->MovingImageToFixedImageVectorField)
+    {
+    return this->MovingImageToFixedImageVectorField;
+    }
+  if (this->CompactMovingImageToFixedImageVectorField)
+    {
+    return this->CompactMovingImageToFixedImageVectorField->Decompress();
+    }
+  if (!this->MovingImageToFixedImageTransformation || !this->RegistrationData->fixed_image)
+    {
+    return NULL;
+    }
+
+  // Render the field from the transformation on the fixed image grid; it is not kept
+  Plm_image_header fixedImageHeader(this->RegistrationData->fixed_image);
+  Xform vectorFieldTransformation;
+  xform_to_itk_vf(&vectorFieldTransformation, this->MovingImageToFixedImageTransformation, &fixedImageHeader);
+  return vectorFieldTransformation.get_itk_vf();
+}
+
+//---------------------------------------------------------------------------
+unsigned long long vtkSlicerPlastimatchPyModuleLogic::GetVectorFieldMemorySize()
+{
+  if (this->MovingImageToFixedImageVectorField)
+    {
+    const DeformationFieldType::SizeType size = this->MovingImageToFixedImageVectorField->GetBufferedRegion().GetSize();
+    return (unsigned long long) size[0] * size[1] * size[2] * sizeof(VectorType);
+    }
+  if (this->CompactMovingImageToFixedImageVectorField)
+    {
+    return this->CompactMovingImageToFixedImageVectorField->GetMemorySize();
+    }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::ComputeRegistrationQualityMetrics(Plm_image* warpedImage, DeformationFieldType* vectorField)
+{
+  if (!warpedImage || !warpedImage->itk_float() || !this->MovingImageToFixedImageTransformation)
+    {
+    vtkErrorMacro("ComputeRegistrationQualityMetrics: Invalid warped image or transformation!");
+    return;
+    }
+
+  // B-spline results give an analytic Jacobian, other results use the vector field of the final warp
+  Bspline_xform* bsplineTransformation = NULL;
+  if (this->MovingImageToFixedImageTransformation->m_type == XFORM_GPUIT_BSPLINE)
+    {
+    bsplineTransformation = this->MovingImageToFixedImageTransformation->get_gpuit_bsp();
+    }
+
+  PlastimatchPyRegistrationMetrics::ComputeVoxelMetrics(
+    this->ConvertedFixedImage, warpedImage->itk_float(),
+    bsplineTransformation, vectorField,
+    this->MutualInformationNumberOfBins, this->MutualInformationIntensityRange[0], this->MutualInformationIntensityRange[1],
+    this->RegistrationQualityMetrics);
+  if (!this->RegistrationQualityMetrics.Valid)
+    {
+    vtkErrorMacro("ComputeRegistrationQualityMetrics: Fixed and warped images have different sizes!");
+    return;
+    }
+
+  // The landmarks are compared in the moving image space, so the pre-alignment is applied after the deformation
+  double linearTransformationMatrix[3][4];
+  if (this->InitializationLinearTransformation)
+    {
+    GetLinearTransformationMatrix(this->InitializationLinearTransformation, false, linearTransformationMatrix);
+    }
+  PlastimatchPyRegistrationMetrics::ComputeTargetRegistrationError(
+    this->RegistrationData->fixed_landmarks, this->RegistrationData->moving_landmarks,
+    bsplineTransformation, vectorField, this->InitializationLinearTransformation ? linearTransformationMatrix : NULL,
+    this->RegistrationQualityMetrics);
 }
 
 //---------------------------------------------------------------------------
 void vtkSlicerPlastimatchPyModuleLogic::SetWarpedImageInVolumeNode(Plm_image* warpedPlastimatchImage)
 {
-  if (!warpedPlastimatchImage || !warpedPlastimatchImage->itk_float())
+  // The warped image is on the fixed image grid
+  this->CopyImageToVolumeNode(warpedPlastimatchImage, this->FixedImageID, this->OutputVolumeID, false);
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::SetImageInVolumeNode(Plm_image* plastimatchImage,
+  const char* referenceVolumeID, const char* outputVolumeID)
+{
+  this->CopyImageToVolumeNode(plastimatchImage, referenceVolumeID, outputVolumeID, true);
+}
+
+//---------------------------------------------------------------------------
+void vtkSlicerPlastimatchPyModuleLogic::CopyImageToVolumeNode(Plm_image* plastimatchImage,
+  const char* referenceVolumeID, const char* outputVolumeID, bool geometryFromImage)
+{
+  if (!plastimatchImage || !plastimatchImage->itk_float())
     {
-    vtkErrorMacro("SetWarpedImageInVolumeNode: Invalid warped image!");
+    vtkErrorMacro("CopyImageToVolumeNode: Invalid image!");
     return;
     }
 
-  itk::Image<float, 3>::Pointer outputImageItk = warpedPlastimatchImage->itk_float();    
+  itk::Image<float, 3>::Pointer outputImageItk = plastimatchImage->itk_float();    
 
   vtkSmartPointer<vtkImageData> outputImageVtk = vtkSmartPointer<vtkImageData>::New();
   itk::Image<float, 3>::RegionType region = outputImageItk->GetBufferedRegion();
@@ -371,25 +2348,40 @@ void vtkSlicerPlastimatchPyModuleLogic::SetWarpedImageInVolumeNode(Plm_image* wa
     outputImagePtr++;
     }
   
-  // Read fixed image to get the geometrical information
-  vtkMRMLVolumeNode* fixedVolumeNode =
-    vtkMRMLVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(this->FixedImageID));
-  if (!fixedVolumeNode)
+  // Read reference image to get the geometrical information, and the output node. The nodes are looked up
+  // under the scene lock, and modified once it is released (\sa RunRegistration)
+  vtkSmartPointer<vtkMRMLVolumeNode> referenceVolumeNode;
+  vtkSmartPointer<vtkMRMLVolumeNode> outputImageNode;
+  {
+  itk::MutexLockHolder<itk::SimpleFastMutexLock> sceneLock(SceneMutex);
+  referenceVolumeNode = vtkMRMLVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(referenceVolumeID));
+  outputImageNode = vtkMRMLVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(outputVolumeID));
+  }
+  if (!referenceVolumeNode)
+    {
+    vtkErrorMacro("CopyImageToVolumeNode: Node containing the reference image cannot be retrieved!");
+    return;
+    }
+  if (!outputImageNode)
     {
-    vtkErrorMacro("SetWarpedImageInVolumeNode: Node containing the fixed image cannot be retrieved!");
+    vtkErrorMacro("CopyImageToVolumeNode: Node containing the output image cannot be retrieved!");
     return;
     }
 
-  // Create new image node
-  vtkMRMLVolumeNode* warpedImageNode =
-    vtkMRMLVolumeNode::SafeDownCast(this->GetMRMLScene()->GetNodeByID(this->OutputVolumeID));
-  if (!warpedImageNode)
+  // The node may have been removed from the scene since it was looked up
+  if (!this->IsNodeInScene(outputImageNode))
     {
-    vtkErrorMacro("SetWarpedImageInVolumeNode: Node containing the warped image cannot be retrieved!");
+    vtkErrorMacro("CopyImageToVolumeNode: Node containing the output image has been removed from the scene!");
     return;
     }
 
-  // Set warped image to a Slicer node
-  warpedImageNode->CopyOrientation(fixedVolumeNode);
-  warpedImageNode->SetAndObserveImageData(outputImageVtk);
+  // Set image to a Slicer node. The geometry of the reference is kept if the image is on its grid,
+  // otherwise origin and spacing are taken from the image (origin is converted from LPS to RAS).
+  outputImageNode->CopyOrientation(referenceVolumeNode);
+  if (geometryFromImage)
+    {
+    outputImageNode->SetSpacing(outputImageItk->GetSpacing()[0], outputImageItk->GetSpacing()[1], outputImageItk->GetSpacing()[2]);
+    outputImageNode->SetOrigin(- outputImageItk->GetOrigin()[0], - outputImageItk->GetOrigin()[1], outputImageItk->GetOrigin()[2]);
+    }
+  outputImageNode->SetAndObserveImageData(outputImageVtk);
 }
@@ -28,13 +28,20 @@
 
 // PlastimatchPy Module Logic
 #include "vtkSlicerPlastimatchPyModuleLogicExport.h"
+#include "PlastimatchPyRegistrationMetrics.h"
 
 // ITK includes
 #include "itkImage.h"
 
 // VTK includes
+#include <vtkCommand.h>
 #include <vtkPoints.h>
 
+// STD includes
+#include <string>
+#include <utility>
+#include <vector>
+
 // Plastimatch includes
 #include "landmark_warp.h"
 #include "plm_config.h"
@@ -44,14 +51,57 @@
 #include "registration_data.h"
 #include "registration_parms.h"
 
+class vtkMRMLNode;
+class vtkPolyData;
+class PlastimatchPyCompactVectorField;
+class PlastimatchPyImagePyramid;
+
 /// Class to wrap Plastimatch registration capability into the embedded Python shell in Slicer
 class VTK_SLICER_PLASTIMATCHPY_MODULE_LOGIC_EXPORT vtkSlicerPlastimatchPyModuleLogic :
   public vtkSlicerModuleLogic
 {
   typedef itk::Vector< float, 3 >  VectorType;
   typedef itk::Image< VectorType, 3 >  DeformationFieldType;
+  typedef std::vector< std::pair<std::string, std::string> >  StageParameterListType;
 
 public:
+  /// Events invoked by the logic
+  enum
+  {
+    /// Invoked after each stage when a preview has been computed (\sa ProgressivePreview)
+    /// The event is invoked synchronously from the thread running the registration. With RunRegistration(), the
+    /// preview volume has already been updated. With ExecuteRegistration() on a worker thread, the preview is kept
+    /// and observers must not touch the scene, widgets or views, but hand over to the main thread (e.g. with a
+    /// timer), that shows the preview by calling ApplyRegistrationResult().
+    PreviewUpdatedEvent = vtkCommand::UserEvent + 1
+  };
+
+  /// Storage of the vector field of the registration result (\sa VectorFieldStorageMode)
+  enum
+  {
+    VectorFieldStorageNone = 0,  /*!< No dense field is kept, it is computed from the transformation when needed */
+    VectorFieldStorageFloat,     /*!< The dense field is kept in single precision */
+    VectorFieldStorageHalfFloat, /*!< The dense field is kept in half precision */
+    VectorFieldStorageQuantized  /*!< The dense field is kept quantized on 8 bits per component */
+  };
+
+  /// Inputs of the registration (\sa LastRegistrationChangedInputs)
+  enum
+  {
+    FixedImageInput = 1,      /*!< Content of the fixed image */
+    MovingImageInput = 2,     /*!< Content of the moving image */
+    InitializationInput = 4,  /*!< Initial linear transformation */
+    LandmarksInput = 8,       /*!< Fixed or moving landmarks */
+    StagesInput = 16          /*!< Stages and their parameters */
+  };
+
+  /// Fusion of the atlas labelmaps (\sa LabelFusionMethod)
+  enum
+  {
+    LabelFusionMajorityVote = 0, /*!< Each voxel takes the label given by most of the atlases */
+    LabelFusionStaple            /*!< Each voxel takes the most likely label given the estimated performance of each atlas */
+  };
+
   /// Constructor
   static vtkSlicerPlastimatchPyModuleLogic* New();
   vtkTypeMacro(vtkSlicerPlastimatchPyModuleLogic, vtkSlicerModuleLogic);
@@ -64,11 +114,89 @@ public:
   void SetPar(char* key, char* value);
 
   /// Execute registration
+  /// It runs PrepareRegistration(), ExecuteRegistration() and ApplyRegistrationResult() on the calling thread,
+  /// which must be the main thread as the scene is accessed. The registration is a job of the process-wide
+  /// scheduler: it waits until its predicted peak memory fits in the memory budget shared with the other
+  /// registrations (\sa SetJobMemoryBudget).
+  /// Concurrency is limited: the Plastimatch registration calls are not reentrant and are serialized by a
+  /// process-wide lock, so the registrations of N logic instances run one at a time. Only the import of the
+  /// inputs, the image conversions, the warps, the metrics and the export of the results overlap.
   void RunRegistration();
 
+  /// Import the images, landmarks and initial transformation of the registration from the scene.
+  /// To be called from the main thread. Returns false if an input is missing, in which case the previous
+  /// result is cleared and ExecuteRegistration() does nothing.
+  bool PrepareRegistration();
+
+  /// Run the registration prepared by PrepareRegistration(), without accessing the scene, so that it can be
+  /// called from a worker thread while the scene is displayed. The warped image and the latest preview are kept
+  /// until ApplyRegistrationResult() is called from the main thread. Returns false if the registration has
+  /// not been prepared or has been aborted.
+  bool ExecuteRegistration();
+
+  /// Copy the warped image and the latest preview kept by ExecuteRegistration() into their volume nodes.
+  /// To be called from the main thread, e.g. after each PreviewUpdatedEvent and once ExecuteRegistration() returned.
+  void ApplyRegistrationResult();
+
   /// This function warps the landmarks according to OutputTransformation
   void WarpLandmarks();
 
+  /// Map an arbitrary number of points (RAS) from the fixed image space into the moving image space.
+  /// Each point x is mapped to x + u(x), u being the vector field of the computed registration, followed by the
+  /// initial linear transformation if one has been used. This is the opposite direction of WarpLandmarks() (\sa WarpPointsFromMovingToFixed).
+  /// B-spline results are evaluated analytically at each point, other results use the vector field.
+  /// Points are processed in parallel and written into outputPoints (float), which is resized only if needed.
+  /// Returns false, leaving outputPoints unchanged, if no transformation is available.
+  bool WarpPointsFromFixedToMoving(vtkPoints* inputPoints, vtkPoints* outputPoints);
+
+  /// Map all the points of a surface or contour (RAS) from the fixed image space into the moving image space
+  /// (\sa WarpPointsFromFixedToMoving). The output shares the topology of the input, only the point coordinates
+  /// are replaced. Returns false, leaving outputPolyData unchanged, if the points cannot be mapped.
+  bool WarpPolyDataFromFixedToMoving(vtkPolyData* inputPolyData, vtkPolyData* outputPolyData);
+
+  /// Map all the points of a surface or contour (RAS) from the moving image space into the fixed image space,
+  /// e.g. to propagate the structures of a planning image (\sa WarpPointsFromMovingToFixed). The output shares
+  /// the topology of the input, only the point coordinates are replaced. Returns false, leaving outputPolyData
+  /// unchanged, if the points cannot be mapped.
+  bool WarpPolyDataFromMovingToFixed(vtkPolyData* inputPolyData, vtkPolyData* outputPolyData);
+
+  /// Compute the inverse (fixed image to moving image) of the computed registration.
+  /// The inverse is obtained by a fixed-point iteration on the grid of the moving image,
+  /// optionally subsampled (\sa InverseVectorFieldSubsamplingFactor), without running a second registration.
+  void ComputeInverseVectorField();
+
+  /// Map an arbitrary number of points (RAS) from the moving image space into the fixed image space,
+  /// in the same direction as WarpLandmarks(). Each point y is mapped to y + v(y), v being the inverse vector field,
+  /// which is computed if needed (\sa ComputeInverseVectorField). If an initial linear transformation A has been
+  /// used, y is first replaced by A^-1(y).
+  /// Returns false, leaving outputPoints unchanged, if the inverse vector field cannot be computed.
+  bool WarpPointsFromMovingToFixed(vtkPoints* inputPoints, vtkPoints* outputPoints);
+
+  /// Warp a volume defined in the fixed image space (e.g. a dose) back to the moving image space.
+  /// The inverse vector field is computed if needed (\sa ComputeInverseVectorField).
+  void WarpVolumeInverse(char* inputVolumeID, char* outputVolumeID, float defaultValue);
+
+  /// Store the inverse vector field (RAS displacements) into an existing vector volume node.
+  /// The inverse vector field is computed if needed (\sa ComputeInverseVectorField).
+  void SetInverseVectorFieldInVolumeNode(char* vectorVolumeID);
+
+  /// Add an atlas (image and its labelmap) used by the multi-atlas segmentation
+  void AddAtlas(char* atlasImageID, char* atlasLabelmapID);
+
+  /// Remove all the atlases used by the multi-atlas segmentation
+  void ClearAtlases();
+
+  /// Segment the target volume by registering each atlas image to it with the stages set by AddStage() and
+  /// SetPar(), warping each atlas labelmap with nearest neighbor interpolation and fusing the warped labelmaps
+  /// (\sa LabelFusionMethod) into the output labelmap node. The target image is prepared once, and the pyramid
+  /// levels of the target and atlas images are kept by the image pyramid. Landmarks and the initial linear
+  /// transformation are not used.
+  /// The atlases are NOT registered concurrently: the Plastimatch registration calls are not reentrant, so they
+  /// are serialized by a process-wide lock, also against the registrations of the other logic instances. As the
+  /// registrations dominate the run time, it grows linearly with the number of atlases. Only the warps of the
+  /// labelmaps (\sa NumberOfConcurrentAtlasWarps) and the label fusion run in parallel.
+  void RunMultiAtlasSegmentation(char* targetVolumeID, char* outputLabelmapID);
+
 public:
   /// Set the ID of the fixed image (\sa FixedImageID) (image data type must be "float").
   vtkSetStringMacro(FixedImageID);
@@ -100,6 +228,11 @@ public:
   /// Get the ID of the output image (\sa OutputVolumeID).
   vtkGetStringMacro(OutputVolumeID);
 
+  /// Set the ID of the preview image (\sa PreviewVolumeID).
+  vtkSetStringMacro(PreviewVolumeID);
+  /// Get the ID of the preview image (\sa PreviewVolumeID).
+  vtkGetStringMacro(PreviewVolumeID);
+
   /// Set the fixed landmarks (\sa FixedLandmarks) using a vtkPoints object.
   vtkSetObjectMacro(FixedLandmarks, vtkPoints);
   /// Get the fixed landmarks (\sa FixedLandmarks) using a vtkPoints object.
@@ -110,26 +243,261 @@ public:
   /// Get the moving landmarks (\sa MovingLandmarks) using a vtkPoints object.
   vtkGetObjectMacro(MovingLandmarks, vtkPoints);
 
+  /// Set the subsampling factor of the inverse vector field grid (\sa InverseVectorFieldSubsamplingFactor).
+  /// Changing one of the inversion parameters discards the inverse vector field computed so far.
+  void SetInverseVectorFieldSubsamplingFactor(int subsamplingFactor);
+  /// Get the subsampling factor of the inverse vector field grid (\sa InverseVectorFieldSubsamplingFactor).
+  vtkGetMacro(InverseVectorFieldSubsamplingFactor, int);
+
+  /// Set the maximum number of fixed-point iterations of the inversion (\sa InverseVectorFieldMaximumNumberOfIterations).
+  void SetInverseVectorFieldMaximumNumberOfIterations(int maximumNumberOfIterations);
+  /// Get the maximum number of fixed-point iterations of the inversion (\sa InverseVectorFieldMaximumNumberOfIterations).
+  vtkGetMacro(InverseVectorFieldMaximumNumberOfIterations, int);
+
+  /// Set the convergence tolerance (mm) of the inversion (\sa InverseVectorFieldTolerance).
+  void SetInverseVectorFieldTolerance(float tolerance);
+  /// Get the convergence tolerance (mm) of the inversion (\sa InverseVectorFieldTolerance).
+  vtkGetMacro(InverseVectorFieldTolerance, float);
+
+  /// Set the storage of the vector field of the registration result (\sa VectorFieldStorageMode).
+  vtkSetMacro(VectorFieldStorageMode, int);
+  /// Get the storage of the vector field of the registration result (\sa VectorFieldStorageMode).
+  vtkGetMacro(VectorFieldStorageMode, int);
+  void SetVectorFieldStorageModeToNone() { this->SetVectorFieldStorageMode(VectorFieldStorageNone); };
+  void SetVectorFieldStorageModeToFloat() { this->SetVectorFieldStorageMode(VectorFieldStorageFloat); };
+  void SetVectorFieldStorageModeToHalfFloat() { this->SetVectorFieldStorageMode(VectorFieldStorageHalfFloat); };
+  void SetVectorFieldStorageModeToQuantized() { this->SetVectorFieldStorageMode(VectorFieldStorageQuantized); };
+
+  /// Get the memory (bytes) used by the stored vector field of the registration result (\sa VectorFieldStorageMode).
+  unsigned long long GetVectorFieldMemorySize();
+
+  /// Set the flag enabling the shared image pyramid (\sa UseImagePyramid).
+  vtkSetMacro(UseImagePyramid, bool);
+  /// Get the flag enabling the shared image pyramid (\sa UseImagePyramid).
+  vtkGetMacro(UseImagePyramid, bool);
+  /// Set the flag enabling the shared image pyramid (\sa UseImagePyramid).
+  vtkBooleanMacro(UseImagePyramid, bool);
+
+  /// Set the memory budget (MB) of the image pyramid (\sa ImagePyramidMemoryBudget).
+  vtkSetMacro(ImagePyramidMemoryBudget, int);
+  /// Get the memory budget (MB) of the image pyramid (\sa ImagePyramidMemoryBudget).
+  vtkGetMacro(ImagePyramidMemoryBudget, int);
+
+  /// Remove all the subsampled images kept by the image pyramid
+  void ClearImagePyramid();
+
+  /// Set the flag enabling the progressive preview (\sa ProgressivePreview).
+  vtkSetMacro(ProgressivePreview, bool);
+  /// Get the flag enabling the progressive preview (\sa ProgressivePreview).
+  vtkGetMacro(ProgressivePreview, bool);
+  /// Set the flag enabling the progressive preview (\sa ProgressivePreview).
+  vtkBooleanMacro(ProgressivePreview, bool);
+
+  /// Set the subsampling factor of the preview image (\sa PreviewSubsamplingFactor).
+  vtkSetMacro(PreviewSubsamplingFactor, int);
+  /// Get the subsampling factor of the preview image (\sa PreviewSubsamplingFactor).
+  vtkGetMacro(PreviewSubsamplingFactor, int);
+
+  /// Set the flag requesting to stop the running registration (\sa AbortRegistration).
+  vtkSetMacro(AbortRegistration, bool);
+  /// Get the flag requesting to stop the running registration (\sa AbortRegistration).
+  vtkGetMacro(AbortRegistration, bool);
+
+  /// Set the flag enabling the incremental registration (\sa IncrementalRegistration).
+  vtkSetMacro(IncrementalRegistration, bool);
+  /// Get the flag enabling the incremental registration (\sa IncrementalRegistration).
+  vtkGetMacro(IncrementalRegistration, bool);
+  /// Set the flag enabling the incremental registration (\sa IncrementalRegistration).
+  vtkBooleanMacro(IncrementalRegistration, bool);
+
+  /// Set the maximum number of iterations of an incremental registration (\sa IncrementalMaximumNumberOfIterations).
+  vtkSetMacro(IncrementalMaximumNumberOfIterations, int);
+  /// Get the maximum number of iterations of an incremental registration (\sa IncrementalMaximumNumberOfIterations).
+  vtkGetMacro(IncrementalMaximumNumberOfIterations, int);
+
+  /// Get the flag telling if the last registration has been run incrementally (\sa IncrementalRegistration).
+  vtkGetMacro(LastRegistrationIncremental, bool);
+
+  /// Get the inputs that changed between the two last registrations, as a combination of the input flags
+  /// (e.g. LandmarksInput) (\sa LastRegistrationChangedInputs).
+  vtkGetMacro(LastRegistrationChangedInputs, int);
+
+  /// Set the flag enabling the adaptive convergence monitoring (\sa AdaptiveConvergence).
+  vtkSetMacro(AdaptiveConvergence, bool);
+  /// Get the flag enabling the adaptive convergence monitoring (\sa AdaptiveConvergence).
+  vtkGetMacro(AdaptiveConvergence, bool);
+  /// Set the flag enabling the adaptive convergence monitoring (\sa AdaptiveConvergence).
+  vtkBooleanMacro(AdaptiveConvergence, bool);
+
+  /// Set the number of iterations between two checks of the convergence (\sa ConvergenceCheckInterval).
+  vtkSetMacro(ConvergenceCheckInterval, int);
+  /// Get the number of iterations between two checks of the convergence (\sa ConvergenceCheckInterval).
+  vtkGetMacro(ConvergenceCheckInterval, int);
+
+  /// Set the number of iterations of the convergence sliding window (\sa ConvergenceWindowSize).
+  vtkSetMacro(ConvergenceWindowSize, int);
+  /// Get the number of iterations of the convergence sliding window (\sa ConvergenceWindowSize).
+  vtkGetMacro(ConvergenceWindowSize, int);
+
+  /// Set the relative improvement below which a stage is stopped (\sa ConvergenceRelativeImprovement).
+  vtkSetMacro(ConvergenceRelativeImprovement, double);
+  /// Get the relative improvement below which a stage is stopped (\sa ConvergenceRelativeImprovement).
+  vtkGetMacro(ConvergenceRelativeImprovement, double);
+
+  /// Get the number of iterations saved by the adaptive convergence in the last registration (\sa AdaptiveConvergence).
+  /// It is a lower bound, as each chunk of iterations is counted as its full budget.
+  vtkGetMacro(NumberOfIterationsSaved, int);
+
+  /// Get the number of iterations run by a stage of the last registration (\sa AdaptiveConvergence).
+  /// It is the sum of the budgets of the chunks run, an upper bound of the iterations of the optimizer.
+  int GetStageNumberOfIterations(unsigned int stageIndex);
+
+  /// Set the flag enabling the computation of the quality metrics (\sa ComputeQualityMetrics).
+  vtkSetMacro(ComputeQualityMetrics, bool);
+  /// Get the flag enabling the computation of the quality metrics (\sa ComputeQualityMetrics).
+  vtkGetMacro(ComputeQualityMetrics, bool);
+  /// Set the flag enabling the computation of the quality metrics (\sa ComputeQualityMetrics).
+  vtkBooleanMacro(ComputeQualityMetrics, bool);
+
+  /// Set the number of bins per image of the mutual information joint histogram (\sa MutualInformationNumberOfBins).
+  vtkSetMacro(MutualInformationNumberOfBins, int);
+  /// Get the number of bins per image of the mutual information joint histogram (\sa MutualInformationNumberOfBins).
+  vtkGetMacro(MutualInformationNumberOfBins, int);
+
+  /// Set the intensity range of the mutual information joint histogram (\sa MutualInformationIntensityRange).
+  vtkSetVector2Macro(MutualInformationIntensityRange, float);
+  /// Get the intensity range of the mutual information joint histogram (\sa MutualInformationIntensityRange).
+  vtkGetVector2Macro(MutualInformationIntensityRange, float);
+
+  /// Get the quality metrics of the last registration (\sa ComputeQualityMetrics)
+  const PlastimatchPyRegistrationMetrics::Result& GetRegistrationQualityMetrics() { return this->RegistrationQualityMetrics; };
+
+  /// Get the mean squared error between fixed and warped image (\sa ComputeQualityMetrics).
+  double GetMeanSquaredError() { return this->RegistrationQualityMetrics.MeanSquaredError; };
+  /// Get the normalized cross correlation between fixed and warped image (\sa ComputeQualityMetrics).
+  double GetNormalizedCrossCorrelation() { return this->RegistrationQualityMetrics.NormalizedCrossCorrelation; };
+  /// Get the mutual information between fixed and warped image (\sa ComputeQualityMetrics).
+  double GetMutualInformation() { return this->RegistrationQualityMetrics.MutualInformation; };
+  /// Get the minimum of the Jacobian determinant of the deformation (\sa ComputeQualityMetrics).
+  double GetJacobianDeterminantMinimum() { return this->RegistrationQualityMetrics.JacobianDeterminantMinimum; };
+  /// Get the maximum of the Jacobian determinant of the deformation (\sa ComputeQualityMetrics).
+  double GetJacobianDeterminantMaximum() { return this->RegistrationQualityMetrics.JacobianDeterminantMaximum; };
+  /// Get the mean of the Jacobian determinant of the deformation (\sa ComputeQualityMetrics).
+  double GetJacobianDeterminantMean() { return this->RegistrationQualityMetrics.JacobianDeterminantMean; };
+  /// Get the standard deviation of the Jacobian determinant of the deformation (\sa ComputeQualityMetrics).
+  double GetJacobianDeterminantStandardDeviation() { return this->RegistrationQualityMetrics.JacobianDeterminantStandardDeviation; };
+  /// Get the number of voxels where the deformation folds (\sa ComputeQualityMetrics).
+  long GetNumberOfFoldingVoxels() { return this->RegistrationQualityMetrics.NumberOfFoldingVoxels; };
+  /// Get the mean landmark target registration error in mm (\sa ComputeQualityMetrics).
+  double GetTargetRegistrationErrorMean() { return this->RegistrationQualityMetrics.TargetRegistrationErrorMean; };
+  /// Get the maximum landmark target registration error in mm (\sa ComputeQualityMetrics).
+  double GetTargetRegistrationErrorMaximum() { return this->RegistrationQualityMetrics.TargetRegistrationErrorMaximum; };
+
+  /// Set the fusion of the atlas labelmaps (\sa LabelFusionMethod).
+  vtkSetMacro(LabelFusionMethod, int);
+  /// Get the fusion of the atlas labelmaps (\sa LabelFusionMethod).
+  vtkGetMacro(LabelFusionMethod, int);
+  void SetLabelFusionMethodToMajorityVote() { this->SetLabelFusionMethod(LabelFusionMajorityVote); };
+  void SetLabelFusionMethodToStaple() { this->SetLabelFusionMethod(LabelFusionStaple); };
+
+  /// Set the number of atlas labelmaps warped at the same time, the registrations are serialized (\sa NumberOfConcurrentAtlasWarps).
+  vtkSetMacro(NumberOfConcurrentAtlasWarps, int);
+  /// Get the number of atlas labelmaps warped at the same time (\sa NumberOfConcurrentAtlasWarps).
+  vtkGetMacro(NumberOfConcurrentAtlasWarps, int);
+
+  /// Set the maximum number of iterations of the STAPLE fusion (\sa StapleMaximumNumberOfIterations).
+  vtkSetMacro(StapleMaximumNumberOfIterations, int);
+  /// Get the maximum number of iterations of the STAPLE fusion (\sa StapleMaximumNumberOfIterations).
+  vtkGetMacro(StapleMaximumNumberOfIterations, int);
+
+  /// Set the convergence tolerance of the STAPLE fusion (\sa StapleTolerance).
+  vtkSetMacro(StapleTolerance, double);
+  /// Get the convergence tolerance of the STAPLE fusion (\sa StapleTolerance).
+  vtkGetMacro(StapleTolerance, double);
+
+  /// Set the memory budget (MB) of the registrations running at the same time in the process (0 means unlimited).
+  /// The budget is shared by all the logic instances.
+  void SetJobMemoryBudget(int memoryBudget);
+  /// Get the memory budget (MB) of the registrations running at the same time in the process.
+  int GetJobMemoryBudget();
+
+  /// Get the number of registrations of the process waiting for admission
+  int GetJobQueueDepth();
+  /// Get the number of registrations of the process admitted and still running
+  int GetNumberOfRunningJobs();
+  /// Get the predicted memory (MB) of the registrations of the process still running
+  double GetAdmittedJobMemory();
+  /// Get the sum of the predicted memory (MB) of the completed registrations of the process
+  double GetTotalPredictedJobMemory();
+  /// Get the sum of the process memory increases (MB) measured during the completed registrations of the process.
+  /// Registrations that ran at the same time count each other's allocations.
+  double GetTotalJobProcessMemoryIncrease();
+
+  /// Predict the peak memory (MB) of RunRegistration() from the volume dimensions, the stages and the output options
+  double GetEstimatedRegistrationMemory();
+  /// Get the peak memory (MB) predicted for the last registration
+  double GetPredictedRegistrationMemory() { return (double) this->LastRegistrationPredictedMemory / (1024.0 * 1024.0); };
+  /// Get the peak increase of the process memory (MB) measured during the last registration.
+  /// It includes the memory used by the other jobs running at the same time.
+  double GetRegistrationProcessMemoryIncrease() { return (double) this->LastRegistrationProcessMemoryIncrease / (1024.0 * 1024.0); };
+
   /// Set the warped landmarks (\sa WarpedLandmarks) using a vtkPoints object.
   vtkSetObjectMacro(WarpedLandmarks, vtkPoints);
   /// Get the warped landmarks (\sa WarpedLandmarks) using a vtkPoints object.
   vtkGetObjectMacro(WarpedLandmarks, vtkPoints);
 
 protected:
-  /// This function sets the vtkPoints as input landmarks for Plastimatch registration
-  void SetLandmarksFromSlicer();
+  /// This function reads the images, landmarks and initial transformation of the registration from the scene
+  /// into buffers owned by RegistrationData. The caller holds the scene lock. Returns false if an input is missing,
+  /// in which case the previous inputs and result are cleared (\sa ClearRegistrationResult).
+  bool ImportRegistrationInputs();
+
+  /// This function runs the registration job on the inputs imported by PrepareRegistration(), and keeps the warped
+  /// image until ApplyRegistrationResult(). Returns false if the registration has not been prepared or has been aborted.
+  bool RunPreparedRegistration();
+
+  /// This function runs the registration on the imported inputs, without accessing the scene.
+  /// Returns the warped moving image, owned by the caller, or NULL if the registration has been aborted.
+  Plm_image* ComputeRegistration();
+
+  /// This function deletes RegistrationData together with the images and landmarks it points to
+  void ReleaseRegistrationData();
+
+  /// This function deletes the inputs and the result of the previous registration, once new inputs failed to be imported
+  void ClearRegistrationResult();
 
-  /// This function reads the fcsv files containing the landmarks and sets them as input landmarks for Plastimatch registration
-  void SetLandmarksFromFiles();
+  /// This function predicts the peak memory (bytes) of RunRegistration(). The caller holds the scene lock.
+  unsigned long long EstimateRegistrationMemory();
+
+  /// This function predicts the peak memory (bytes) of a registration stage, from the number of voxels of the full resolution images
+  static unsigned long long EstimateStageMemory(const StageParameterListType& stageParameters,
+    unsigned long long numberOfFixedVoxels, unsigned long long numberOfMovingVoxels);
+
+  /// This function returns the number of voxels of a volume node, 0 if it has no image
+  unsigned long long GetVolumeNodeNumberOfVoxels(const char* volumeID);
+
+  /// This function updates the peak of the process memory observed during the running registration
+  void SampleRegistrationMemory();
+
+  /// This function sets the vtkPoints as input landmarks of the given registration data. Returns false if the point lists are not valid.
+  bool SetLandmarksFromSlicer(Registration_data* registrationData);
+
+  /// This function reads the fcsv files containing the landmarks and sets them as input landmarks of the given registration data.
+  /// Returns false if a filename is not valid.
+  bool SetLandmarksFromFiles(Registration_data* registrationData);
+
+  /// This function reads the initial linear transformation from the scene. Returns a transformation owned by the caller,
+  /// or NULL if the transformation node cannot be retrieved.
+  Xform* ImportInitialLinearTransformation();
 
   /// This function applies an initial affine trasformation modifing the moving image before the Plastimatch registration
-  void ApplyInitialLinearTransformation();
+  void ApplyInitialLinearTransformation(Xform* initializationTransformation);
 
   /// This function applies a linear/deformable transformation at an image.
   /// It is used from ApplyInitialLinearTransformation() and RunRegistration().
   void ApplyWarp(
     Plm_image* warpedImage,                        /*!< Output image as Plm_image pointer */
-    DeformationFieldType::Pointer vectorFieldFromTransformation, /*!< Output vector field (optional) as DeformationFieldType::Pointer */
+    DeformationFieldType::Pointer* vectorFieldFromTransformation, /*!< Output vector field (optional, computed only if not NULL) */
     Xform* inputTransformation,                    /*!< Input transformation as Xform pointer */
     Plm_image* fixedImage,                         /*!< Fixed image as Plm_image pointer */
     Plm_image* imageToWarp,                         /*!< Input image to warp as Plm_image pointer */
@@ -138,9 +506,134 @@ protected:
     int interpolationLinear                        /*!< Int to choose between trilinear interpolation (1) on nearest neighbor (0) */
     );
 
-  /// This function shows the deformed image into the Slicer scene
+  /// This function runs the registration stage by stage, each one on the subsampled images
+  /// provided by the image pyramid if enabled (\sa UseImagePyramid), publishing a preview
+  /// after each stage if enabled (\sa ProgressivePreview).
+  void RunStages();
+
+  /// This function warps the moving image at reduced resolution with the current transformation
+  /// and shows it into the Slicer scene (\sa ProgressivePreview).
+  void UpdatePreview(Xform* currentTransformation);
+
+  /// This function runs the stage at stageIndex on the full resolution images, or on the
+  /// subsampled images of the image pyramid if enabled. Returns the computed transformation (owned by the caller).
+  Xform* RunStageWithIndex(
+    unsigned int stageIndex,                            /*!< Index of the stage as added by AddStage() */
+    const StageParameterListType& overriddenParameters, /*!< Parameters replacing the ones set by SetPar() */
+    Xform* inputTransformation                          /*!< Initial transformation (optional) as Xform pointer */
+    );
+
+  /// This function runs the stage at stageIndex in chunks of ConvergenceCheckInterval iterations, each one
+  /// initialized by the result of the previous one. After each chunk the stage metric is evaluated on the
+  /// subsampled images, and the stage is stopped when it does not improve enough over the sliding window.
+  /// Returns the computed transformation (owned by the caller).
+  Xform* RunStageWithConvergenceMonitoring(
+    unsigned int stageIndex,         /*!< Index of the stage as added by AddStage() */
+    int maximumNumberOfIterations,   /*!< Iteration budget of the stage */
+    Xform* inputTransformation,      /*!< Initial transformation (optional) as Xform pointer */
+    int& numberOfIterations          /*!< Output number of iterations run */
+    );
+
+  /// This function evaluates the metric of a stage (MSE, or opposite of the mutual information) for a
+  /// transformation, on the fixed and moving images the stage runs on (\sa GetStageImages).
+  double EvaluateStageMetric(unsigned int stageIndex, Xform* transformation);
+
+  /// This function gets the fixed and moving images a stage runs on: the pyramid levels of its subsampling
+  /// if the pyramid is enabled and the stage sets "res", the registered images otherwise.
+  /// Returns true if the images are pyramid levels, that Plastimatch must not subsample again.
+  bool GetStageImages(unsigned int stageIndex,
+    itk::Image<float, 3>::Pointer& fixedStageImage, itk::Image<float, 3>::Pointer& movingStageImage);
+
+  /// This function returns true if a stage has the same transformation type ("xform") as the previous stage
+  /// and a finer resolution ("res") along at least one axis, and not coarser along any.
+  static bool IsFinerStageOfSameType(const StageParameterListType& previousStageParameters, const StageParameterListType& stageParameters);
+
+  /// This function returns the index of the last B-spline stage, or -1 if there is no deformable stage.
+  int GetLastDeformableStageIndex();
+
+  /// This function runs a single registration stage and returns the computed transformation (owned by the caller).
+  /// It does not access the MRML scene. The Plastimatch call is serialized with the other registrations of the process.
+  Xform* RunStage(
+    const StageParameterListType& stageParameters,      /*!< Parameters of the stage as set by SetPar() */
+    const StageParameterListType& overriddenParameters, /*!< Parameters replacing the ones set by SetPar() */
+    Xform* inputTransformation,                         /*!< Initial transformation (optional) as Xform pointer */
+    Plm_image* fixedImage,                              /*!< Fixed image as Plm_image pointer */
+    Plm_image* movingImage,                             /*!< Moving image as Plm_image pointer */
+    Labeled_pointset* fixedLandmarks,                   /*!< Fixed landmarks (optional) as Labeled_pointset pointer */
+    Labeled_pointset* movingLandmarks                   /*!< Moving landmarks (optional) as Labeled_pointset pointer */
+    );
+
+  /// This function registers an atlas image to the target image, running the stages one by one.
+  /// Returns the computed transformation (owned by the caller). It does not access the MRML scene.
+  Xform* RunAtlasRegistration(
+    const std::vector< itk::Image<float, 3>::Pointer >& targetStageImages, /*!< Target image of each stage (subsampled if the pyramid is enabled) */
+    const std::string& atlasImageKey,                                      /*!< Key of the atlas image content, for its pyramid levels */
+    itk::Image<float, 3>* atlasImage                                       /*!< Full resolution atlas image */
+    );
+
+  /// This function reads the subsampling factors ("res") of a stage. Returns false if they are not set.
+  static bool GetStageSubsampling(const StageParameterListType& stageParameters, int subsampling[3]);
+
+  /// This function reads a parameter of a stage. Returns the default value if it is not set.
+  static std::string GetStageParameter(const StageParameterListType& stageParameters, const char* key, const char* defaultValue);
+
+  /// This function returns a key identifying a volume node and the current content of its image
+  std::string GetVolumeNodeKey(const char* volumeID);
+
+  /// This function returns a key identifying a linear transformation node and its matrix values (empty if no ID is given)
+  std::string GetLinearTransformationNodeKey(const char* transformationID);
+
+  /// This function computes the quality metrics of the registration in a single pass over the warped image.
+  /// The vector field is only needed if the transformation is not a B-spline.
+  void ComputeRegistrationQualityMetrics(Plm_image* warpedImage, DeformationFieldType* vectorField);
+
+  /// This function stores the vector field of the registration result as set by VectorFieldStorageMode
+  void StoreMovingImageToFixedImageVectorField(DeformationFieldType* vectorField);
+
+  /// This function stores the compact vector field of a B-spline result (half float or quantized storage only).
+  /// The field is generated tile by tile from the coefficients, so no dense single precision field is allocated.
+  void StoreMovingImageToFixedImageBspline();
+
+  /// This function returns the dense vector field of the registration result, defined on the fixed image grid.
+  /// The field is taken from the stored one, decompressed, or computed from the transformation if none is stored.
+  DeformationFieldType::Pointer GetMovingImageToFixedImageVectorField();
+
+  /// This function returns the inverse vector field defined on the moving image grid, including the inverse of the
+  /// initial linear transformation if one is used. The inverse vector field is computed if needed. Returns NULL on failure.
+  DeformationFieldType::Pointer GetInverseVectorFieldOnMovingImageGrid();
+
+  /// This function shows the deformed image into the Slicer scene.
+  /// The scene lock is only held to look up the nodes, so that the observers of the output node are called without it.
   void SetWarpedImageInVolumeNode(Plm_image* warpedPlastimatchImage);
 
+  /// This function copies an image into an existing volume node.
+  /// Orientation is taken from the reference volume, origin and spacing from the image itself.
+  /// The scene lock is only held to look up the nodes (\sa SetWarpedImageInVolumeNode).
+  void SetImageInVolumeNode(Plm_image* plastimatchImage, const char* referenceVolumeID, const char* outputVolumeID);
+
+  /// This function copies a labelmap into an existing volume node, that is flagged as labelmap.
+  /// Orientation is taken from the reference volume, origin and spacing from the labelmap itself.
+  /// The scene lock is only held to look up the nodes (\sa SetWarpedImageInVolumeNode).
+  void SetLabelmapInVolumeNode(itk::Image<short, 3>* labelImage, const char* referenceVolumeID, const char* outputVolumeID);
+
+  /// This function checks, under the scene lock, that a node looked up earlier is still in the scene before it is modified
+  bool IsNodeInScene(vtkMRMLNode* node);
+
+  /// This function copies an image into an existing volume node, on behalf of SetWarpedImageInVolumeNode and SetImageInVolumeNode.
+  /// Orientation is taken from the reference volume. Origin and spacing are taken from the image if geometryFromImage is set,
+  /// otherwise from the reference volume, the image being on its grid.
+  void CopyImageToVolumeNode(Plm_image* plastimatchImage, const char* referenceVolumeID, const char* outputVolumeID, bool geometryFromImage);
+
+  /// This function fills the output points with the input points converted from RAS to LPS.
+  /// Returns the float buffer of the output points, that is used as working buffer for the warp.
+  float* ConvertPointsToLpsBuffer(vtkPoints* inputPoints, vtkPoints* outputPoints);
+
+  /// This function converts a packed buffer of points from LPS to RAS in place.
+  void ConvertLpsBufferToRas(float* pointsBuffer, vtkIdType numberOfPoints);
+
+  /// This function maps the points of a poly data in the given direction. The output is modified only on success.
+  bool WarpPolyData(vtkPolyData* inputPolyData, vtkPolyData* outputPolyData, bool movingToFixed);
+
 protected:
   vtkSlicerPlastimatchPyModuleLogic();
   virtual ~vtkSlicerPlastimatchPyModuleLogic();
@@ -184,6 +677,11 @@ protected:
   /// This value is a required parameter to execute a registration.
   char* OutputVolumeID;
 
+  /// ID of the preview image
+  /// If not set, previews are shown in the output image (\sa OutputVolumeID).
+  /// This value is an optional parameter used by the progressive preview.
+  char* PreviewVolumeID;
+
   /// vtkPoints object containing the fixed landmarks
   /// The number of the fixed landmarks must be the same of the number of the moving landmarks.
   /// Landmarks passing as vtkPoints have the priority over landmarks passing by files.
@@ -202,14 +700,213 @@ protected:
   /// This value is a required parameter to execute a landmark based registration.
   vtkPoints* WarpedLandmarks;
   
-  /// Plastimatch registration parameters
+  /// Plastimatch registration parameters, owned by the logic for its whole lifetime
   Registration_parms* RegistrationParameters;
 
-  /// Plastimatch registration data
+  /// Plastimatch registration data. It is owned by the logic together with the images and landmarks
+  /// it points to, and replaced by each registration (\sa ReleaseRegistrationData).
   Registration_data* RegistrationData;
 
-  /// Vector filed computed by Plastimatch
+  /// Initial linear transformation read from the scene. It is applied to the moving image by the registration
+  /// and kept with the result, that maps into the pre-aligned moving image.
+  Xform* InitializationLinearTransformation;
+
+  /// True if the images imported for the running registration are the ones converted by the previous registration
+  bool InputImagesUnchanged;
+
+  /// Transformation (linear or deformable) computed by Plastimatch
+  Xform* MovingImageToFixedImageTransformation;
+
+  /// Vector filed computed by Plastimatch (single precision storage only)
   DeformationFieldType::Pointer MovingImageToFixedImageVectorField;
+
+  /// Vector field computed by Plastimatch (half float or quantized storage only)
+  PlastimatchPyCompactVectorField* CompactMovingImageToFixedImageVectorField;
+
+  /// Storage of the vector field of the registration result
+  /// The transformation (e.g. the B-spline coefficients) is always kept and is the reference result. By default
+  /// (VectorFieldStorageNone) the dense field is not kept and is computed from it when needed. The field can
+  /// be kept in single precision, or compressed in half precision or 8 bit tiles to save memory. The compressed
+  /// tiles of a B-spline result are generated directly from the coefficients, without a dense field.
+  int VectorFieldStorageMode;
+
+  /// Inverse of the vector field computed by Plastimatch, defined on the grid of the registered moving image
+  /// (the pre-aligned moving image if an initial linear transformation is used, \sa GetInverseVectorFieldOnMovingImageGrid)
+  DeformationFieldType::Pointer FixedImageToMovingImageVectorField;
+
+  /// Subsampling factor of the inverse vector field grid with respect to the moving image
+  /// A factor greater than 1 reduces memory and computation time at the price of accuracy. Default is 1.
+  int InverseVectorFieldSubsamplingFactor;
+
+  /// Maximum number of fixed-point iterations used for each voxel of the inverse vector field
+  int InverseVectorFieldMaximumNumberOfIterations;
+
+  /// Convergence tolerance (mm) of the fixed-point iterations used for the inverse vector field
+  float InverseVectorFieldTolerance;
+
+  /// Flag enabling the progressive preview
+  /// If enabled, the stages are run one by one and after each of them the moving image is warped at reduced
+  /// resolution (\sa PreviewSubsamplingFactor) and shown in the preview image. The full resolution warp is
+  /// computed only once, at the end. PreviewUpdatedEvent is invoked after each update. Default is false.
+  bool ProgressivePreview;
+
+  /// Subsampling factor of the preview image with respect to the fixed image. Default is 2.
+  int PreviewSubsamplingFactor;
+
+  /// Flag requesting to stop the running registration
+  /// It is checked after each stage when the stages are run one by one (e.g. by an observer of
+  /// PreviewUpdatedEvent). The remaining stages and the final full resolution warp are skipped.
+  bool AbortRegistration;
+
+  /// Flag enabling the incremental registration
+  /// If enabled and only the landmarks changed since the previous RunRegistration(), the converted images
+  /// are reused and only the last deformable stage is run, starting from the previous B-spline coefficients
+  /// with at most IncrementalMaximumNumberOfIterations iterations. Default is false.
+  bool IncrementalRegistration;
+
+  /// Maximum number of iterations of the deformable stage of an incremental registration. Default is 20.
+  int IncrementalMaximumNumberOfIterations;
+
+  /// True if the last registration has been run incrementally
+  bool LastRegistrationIncremental;
+
+  /// Inputs that changed since the previous registration, as a combination of the input flags
+  /// The images are identified by their node content, the initial transformation by its matrix values
+  /// and the landmarks by their coordinates. Only a change limited to LandmarksInput allows an incremental run.
+  int LastRegistrationChangedInputs;
+
+  /// Fixed image converted (ITK, LPS) by the previous registration
+  itk::Image<float, 3>::Pointer ConvertedFixedImage;
+
+  /// Moving image converted (ITK, LPS) and pre-aligned by the previous registration
+  itk::Image<float, 3>::Pointer ConvertedMovingImage;
+
+  /// Geometry (not allocated) of the moving image converted by the previous registration, before the pre-alignment
+  itk::Image<float, 3>::Pointer ConvertedMovingImageGrid;
+
+  /// Key identifying the content of the fixed image used by the previous registration
+  std::string ConvertedFixedImageKey;
+
+  /// Key identifying the content of the moving image used by the previous registration
+  std::string ConvertedMovingImageKey;
+
+  /// Key identifying the initial linear transformation used by the previous registration
+  std::string ConvertedInitializationKey;
+
+  /// Stage parameters used by the previous registration
+  std::vector<StageParameterListType> PreviousStageParameters;
+
+  /// Coordinates (LPS) of the fixed then moving landmarks used by the previous registration
+  std::vector<float> PreviousLandmarkCoordinates;
+
+  /// Flag enabling the computation of the quality metrics
+  /// If enabled, MSE, NCC, mutual information, Jacobian determinant statistics and landmark TRE are
+  /// computed together after the final warp of RunRegistration(). Default is false.
+  bool ComputeQualityMetrics;
+
+  /// Number of bins per image of the joint histogram used for the mutual information. Default is 64.
+  int MutualInformationNumberOfBins;
+
+  /// Intensity range of the joint histogram used for the mutual information
+  /// Intensities outside of the range are counted in the first or last bin. Default is -1200 3000.
+  float MutualInformationIntensityRange[2];
+
+  /// Quality metrics of the last registration
+  PlastimatchPyRegistrationMetrics::Result RegistrationQualityMetrics;
+
+  /// Flag enabling the adaptive convergence monitoring
+  /// If enabled, the stages are run one by one in chunks of ConvergenceCheckInterval iterations and a stage is
+  /// stopped when its metric improves by less than ConvergenceRelativeImprovement over ConvergenceWindowSize
+  /// iterations. The iterations left by a stage are added to the budget ("max_its") of the next stage if it is
+  /// a finer stage of the same transformation type. Plastimatch offers no per-iteration hook, so the optimizer
+  /// is restarted at each chunk from the current transformation, passed in memory. The restart discards the
+  /// optimizer state (e.g. the L-BFGS-B history and step size), so a stage run in chunks follows another
+  /// trajectory than the configured stage and may converge more slowly or to a worse result: a plateau of the
+  /// chunked stage does not prove that the configured stage would have converged. Plastimatch does not report
+  /// the iterations it ran either, so each chunk is counted as its full budget (\sa NumberOfIterationsSaved).
+  /// The metric is evaluated on the cached pyramid levels of the stage, so the image pyramid is required
+  /// (\sa UseImagePyramid): without it the stages run with their configured iterations. Default is false.
+  bool AdaptiveConvergence;
+
+  /// Number of iterations between two checks of the convergence. Default is 10.
+  int ConvergenceCheckInterval;
+
+  /// Number of iterations of the sliding window the relative improvement is measured on. Default is 30.
+  int ConvergenceWindowSize;
+
+  /// Relative improvement of the metric over the sliding window below which a stage is stopped. Default is 0.005.
+  double ConvergenceRelativeImprovement;
+
+  /// Number of iterations of the stages not run by the last registration (configured budget minus the budgets of the chunks run)
+  int NumberOfIterationsSaved;
+
+  /// Number of iterations run by each stage of the last registration
+  std::vector<int> StageNumberOfIterations;
+
+  /// Flag set by PrepareRegistration() once the inputs are imported, cleared when the registration is run
+  bool RegistrationPrepared;
+
+  /// Flag keeping the previews until ApplyRegistrationResult(), set while ExecuteRegistration() runs
+  bool SceneUpdatesDeferred;
+
+  /// Warped image of the last registration, waiting to be copied into the output volume by ApplyRegistrationResult()
+  Plm_image* PendingWarpedImage;
+
+  /// Latest preview image, waiting to be copied into the preview volume by ApplyRegistrationResult()
+  Plm_image* PendingPreviewImage;
+
+  /// Peak memory (bytes) predicted for the last registration
+  unsigned long long LastRegistrationPredictedMemory;
+
+  /// Peak increase of the process memory (bytes) measured during the last registration, including the concurrent jobs
+  unsigned long long LastRegistrationProcessMemoryIncrease;
+
+  /// Process memory (bytes) when the running registration has been admitted
+  unsigned long long RegistrationStartMemory;
+
+  /// Peak of the process memory (bytes) sampled during the running registration
+  unsigned long long RegistrationPeakMemory;
+
+  /// Parameters of each stage, as set by AddStage() and SetPar()
+  std::vector<StageParameterListType> StageParameters;
+
+  /// Flag enabling the image pyramid
+  /// If enabled, each stage runs on anti-aliased subsampled images built once per resolution level ("res")
+  /// and shared by all the stages and registrations run by this logic. The subsampling of the stages is then
+  /// done by the pyramid instead of Plastimatch, which is logged for each stage. Default is false.
+  bool UseImagePyramid;
+
+  /// Maximum memory (MB) used by the subsampled images kept by the image pyramid (0 means unlimited)
+  int ImagePyramidMemoryBudget;
+
+  /// Subsampled fixed and moving images shared by the registration stages
+  PlastimatchPyImagePyramid* ImagePyramid;
+
+  /// Key identifying the content of the fixed image used by the current registration
+  std::string FixedImageKey;
+
+  /// Key identifying the content of the moving image used by the current registration
+  std::string MovingImageKey;
+
+  /// Key identifying the initial linear transformation used by the current registration (\sa GetLinearTransformationNodeKey)
+  std::string InitializationKey;
+
+  /// Image and labelmap IDs of the atlases, as set by AddAtlas()
+  std::vector< std::pair<std::string, std::string> > AtlasIDs;
+
+  /// Fusion of the atlas labelmaps. Default is majority vote.
+  int LabelFusionMethod;
+
+  /// Number of atlas labelmaps warped at the same time
+  /// It does not apply to the atlas registrations, that run one at a time (\sa RunMultiAtlasSegmentation).
+  /// 0 means one warp per processor. Default is 0.
+  int NumberOfConcurrentAtlasWarps;
+
+  /// Maximum number of expectation-maximization iterations of the STAPLE fusion. Default is 30.
+  int StapleMaximumNumberOfIterations;
+
+  /// Convergence tolerance of the STAPLE fusion (maximum change of the atlas confusion matrices). Default is 1e-4.
+  double StapleTolerance;
   
 private:
   vtkSlicerPlastimatchPyModuleLogic(const vtkSlicerPlastimatchPyModuleLogic&); // Not implemented